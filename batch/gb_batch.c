@@ -0,0 +1,645 @@
+//バッチ実行: ジョブファイルに並べたROM(と入力の動画)をまとめて最高速で実行し、
+//ジョブごとに最後の画面のハッシュ・セーブデータ・ログを書き出して、全体のスループットを表示する
+//コアの状態はスレッドごとにあるので、CPUの数だけワーカースレッドを起動し、ワークスティーリングのデックでジョブを分け合う
+//(ワーカーはジョブごとにインスタンスを作り直すだけで、プロセスやSDLの起動はしない)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#include "gb.h"
+#include "cpu.h"
+#include "cartridge.h"
+#include "memory.h"
+#include "lcd.h"
+#include "machine.h"
+#include "movie.h"
+
+#define MAX_WORKERS 256
+#define FRAME_CYCLES 70224
+
+#define JOB_PENDING 0
+#define JOB_RUNNING 1
+#define JOB_DONE    2
+#define JOB_FAILED  3
+
+//ジョブファイルの1行: ROM [frames=N] [cycles=N] [movie=FILE] [save=FILE] [name=NAME] [dmg]
+struct job {
+	char *rom;
+	char *movie;
+	char *save;
+	char *name;
+	long frames; //0なら制限なし
+	uint64_t cycles; //0なら制限なし
+	int dmg;
+	int line;
+};
+
+//以下はワーカーが書き、全部終わってからメインスレッドが読む
+struct job_result {
+	atomic_int state;
+	int worker;
+	uint64_t frames;
+	uint64_t cycles;
+	uint64_t ns;
+	uint64_t fb_hash;
+	int sram_size;
+};
+
+struct worker_stats {
+	uint64_t jobs;
+	uint64_t steals;
+	uint64_t busy_ns;
+};
+
+//Chase-Levのデック。ジョブは最初に連続した範囲で配り、あとから積むことはないので
+//中身は[top, bottom)のジョブ番号そのもの。持ち主はbottom側から、ほかのワーカーはtop側から取る
+struct deque {
+	atomic_long top;
+	atomic_long bottom;
+};
+
+struct shared {
+	struct deque deques[MAX_WORKERS];
+	struct worker_stats workers[MAX_WORKERS];
+	struct job_result results[];
+};
+
+static struct job *jobs = NULL;
+static size_t num_jobs = 0;
+static struct shared *shared = NULL;
+static int num_workers = 1;
+static const char *out_dir = "gb_batch_out";
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static long take(struct deque *d) {
+	long b = atomic_load(&d->bottom) - 1;
+	atomic_store(&d->bottom, b);
+	long t = atomic_load(&d->top);
+	if(t > b){
+		atomic_store(&d->bottom, t);
+		return -1;
+	}
+	if(t == b){
+		//最後の1つはほかのワーカーと取り合う
+		if(!atomic_compare_exchange_strong(&d->top, &t, t+1))
+			b = -1;
+		atomic_store(&d->bottom, t+1);
+	}
+	return b;
+}
+
+static long steal(struct deque *d) {
+	long t = atomic_load(&d->top);
+	long b = atomic_load(&d->bottom);
+	if(t >= b)
+		return -1;
+	if(!atomic_compare_exchange_strong(&d->top, &t, t+1))
+		return -2; //取られた。もう一度見る
+	return t;
+}
+
+//自分のデックが空なら隣から順に盗む。全部空なら-1
+static long next_job(int self) {
+	long j = take(&shared->deques[self]);
+	if(j >= 0)
+		return j;
+	for(;;){
+		int contended = 0;
+		for(int i=1; i<num_workers; i++){
+			j = steal(&shared->deques[(self + i) % num_workers]);
+			if(j >= 0){
+				shared->workers[self].steals++;
+				return j;
+			}
+			if(j == -2)
+				contended = 1;
+		}
+		if(!contended)
+			return -1;
+	}
+}
+
+//ワーカーのメッセージはジョブのログ(log)に書く
+static uint8_t *read_file(FILE *log, const char *path, size_t *size) {
+	FILE *fp = fopen(path, "rb");
+	if(fp == NULL){
+		fprintf(log, "%s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	fseek(fp, 0, SEEK_END);
+	long n = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	uint8_t *data = malloc(n > 0 ? n : 1);
+	if(n < 0 || data == NULL || fread(data, 1, n, fp) != (size_t)n){
+		fprintf(log, "%s: read failed\n", path);
+		fclose(fp);
+		free(data);
+		return NULL;
+	}
+	fclose(fp);
+	*size = n;
+	return data;
+}
+
+static int write_file(FILE *log, const char *path, const uint8_t *data, size_t size) {
+	FILE *fp = fopen(path, "wb");
+	if(fp == NULL){
+		fprintf(log, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	size_t n = fwrite(data, 1, size, fp);
+	if(fclose(fp) != 0 || n != size){
+		fprintf(log, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+//ヘッダの大きさより短いROMはバンクを切り替えたときにはみ出さないよう0で埋める
+static struct cartridge *load_cartridge(FILE *log, const char *path, uint8_t **rom) {
+	size_t size;
+	if((*rom = read_file(log, path, &size)) == NULL)
+		return NULL;
+	if(size < 0x150){
+		fprintf(log, "%s: not a ROM\n", path);
+		return NULL;
+	}
+	struct cartridge *cart = cart_init(*rom);
+	if(cart == NULL)
+		return NULL;
+	int rom_size;
+	cart_getrom(cart, &rom_size);
+	if((size_t)rom_size > size){
+		uint8_t *p = realloc(*rom, rom_size);
+		free(cart);
+		if(p == NULL)
+			return NULL;
+		memset(p + size, 0, rom_size - size);
+		*rom = p;
+		cart = cart_init(*rom);
+	}
+	return cart;
+}
+
+static uint64_t framebuf_hash(const uint32_t *fb) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for(int i=0; i<160*144; i++)
+		for(int k=0; k<32; k+=8)
+			h = (h ^ ((fb[i] >> k) & 0xff)) * 0x100000001b3ULL;
+	return h;
+}
+
+//ジョブを1つ実行する。ログはout_dir/NAME.logへ
+//(コアが出すメッセージ(動画の不一致など)はプロセスの標準出力に出る)
+static int run_job(const struct job *job, struct job_result *r, uint32_t *framebuf) {
+	char path[4096];
+	int ret = -1;
+
+	snprintf(path, sizeof(path), "%s/%s.log", out_dir, job->name);
+	FILE *log = fopen(path, "w");
+	if(log == NULL){
+		printf("%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	uint8_t *rom = NULL, *ram = NULL;
+	struct gb *gb = NULL;
+	struct cartridge *cart = load_cartridge(log, job->rom, &rom);
+	if(cart == NULL)
+		goto out;
+
+	int ram_size;
+	time_t t;
+	cart_getram(cart, &ram_size, &t);
+	if(ram_size > 0){
+		if((ram = calloc(1, ram_size)) == NULL){
+			fprintf(log, "calloc: %s\n", strerror(errno));
+			goto out;
+		}
+		if(job->save != NULL){
+			size_t n;
+			uint8_t *data = read_file(log, job->save, &n);
+			if(data == NULL)
+				goto out;
+			if(n != (size_t)ram_size){
+				fprintf(log, "%s: save data size mismatch\n", job->save);
+				free(data);
+				goto out;
+			}
+			memcpy(ram, data, n);
+			free(data);
+		}
+		cart_setram(cart, ram, 0);
+	}
+
+	if((gb = gb_new()) == NULL){
+		fputs("gb_new failed\n", log);
+		goto out;
+	}
+	int dmg = job->dmg;
+	int input_rate = 1;
+	if(job->movie != NULL){
+		int flags;
+		uint32_t lead;
+		if(movie_play(job->movie, cart, &flags, &input_rate, &lead) < 0){
+			fprintf(log, "%s: cannot play the movie\n", job->movie);
+			goto out;
+		}
+		dmg = flags & MOVIE_FLAG_DMG;
+	}
+	if(memory_init(cart)){
+		fputs("memory_init failed\n", log);
+		goto out;
+	}
+	if(dmg)
+		CGBMODE = 0;
+	startup();
+	machine_wait_lcd_on();
+
+	//予算はフレームの区切りで確かめる(動画の入力はフレームごとにラッチするので途中で止めない)
+	//動画だけで予算がなければ、動画の終わりまで
+	uint64_t start = now_ns();
+	uint64_t start_cycles = cpu_cycles;
+	uint64_t frames = 0;
+	for(;;){
+		if(job->frames > 0 && frames >= (uint64_t)job->frames)
+			break;
+		if(job->cycles > 0 && cpu_cycles - start_cycles >= job->cycles)
+			break;
+		if(job->frames == 0 && job->cycles == 0 && !movie_playing())
+			break;
+		if(movie_playing())
+			machine_run_frame_latched(framebuf, input_rate);
+		else
+			machine_run_frame(framebuf);
+		frames++;
+	}
+	r->ns = now_ns() - start;
+	r->frames = frames;
+	r->cycles = cpu_cycles - start_cycles;
+	r->fb_hash = framebuf_hash(framebuf);
+	fprintf(log, "%s: %llu frames, %llu cycles, %.3f s, framebuffer %016llx\n", job->name,
+			(unsigned long long)frames, (unsigned long long)r->cycles, r->ns / 1e9, (unsigned long long)r->fb_hash);
+
+	//動画はセーブデータを差し替えるので、最後のものをカートリッジから取り出す
+	uint8_t *sram = cart_getram(cart, &ram_size, &t);
+	r->sram_size = sram != NULL ? ram_size : 0;
+	ret = 0;
+	if(sram != NULL){
+		snprintf(path, sizeof(path), "%s/%s.sav", out_dir, job->name);
+		if(write_file(log, path, sram, ram_size) < 0)
+			ret = -1;
+		if(sram != ram)
+			free(sram);
+	}
+out:
+	movie_close();
+	if(gb != NULL){
+		gb_switch(gb);
+		memory_free();
+		gb_free(gb);
+	}
+	free(ram);
+	free(cart);
+	free(rom);
+	if(fclose(log) != 0)
+		ret = -1;
+	return ret;
+}
+
+static void *worker_main(void *arg) {
+	int self = (int)(intptr_t)arg;
+	uint32_t framebuf[160*144];
+	long j;
+	while((j = next_job(self)) >= 0){
+		struct job_result *r = &shared->results[j];
+		r->worker = self;
+		atomic_store(&r->state, JOB_RUNNING);
+		uint64_t start = now_ns();
+		int ret = run_job(&jobs[j], r, framebuf);
+		shared->workers[self].busy_ns += now_ns() - start;
+		shared->workers[self].jobs++;
+		atomic_store(&r->state, ret < 0 ? JOB_FAILED : JOB_DONE);
+		if(ret < 0)
+			printf("%s: failed (see %s/%s.log)\n", jobs[j].name, out_dir, jobs[j].name);
+	}
+	return NULL;
+}
+
+static char *dup_string(const char *s) {
+	char *p = strdup(s);
+	if(p == NULL){
+		perror("strdup");
+		exit(-1);
+	}
+	return p;
+}
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp((*(struct job *const *)a)->name, (*(struct job *const *)b)->name);
+}
+
+//1行1ジョブ。空行と#で始まる行は読み飛ばす(パスに空白は使えない)
+static int load_jobs(const char *path, long default_frames) {
+	FILE *fp = fopen(path, "r");
+	if(fp == NULL){
+		perror(path);
+		return -1;
+	}
+	size_t cap = 0;
+	char line[8192];
+	int lineno = 0;
+	while(fgets(line, sizeof(line), fp) != NULL){
+		lineno++;
+		char *tok = strtok(line, " \t\r\n");
+		if(tok == NULL || tok[0] == '#')
+			continue;
+		if(num_jobs == cap){
+			cap = cap ? cap*2 : 256;
+			struct job *p = realloc(jobs, cap * sizeof(struct job));
+			if(p == NULL){
+				perror("realloc");
+				fclose(fp);
+				return -1;
+			}
+			jobs = p;
+		}
+		struct job *job = &jobs[num_jobs];
+		memset(job, 0, sizeof(*job));
+		job->line = lineno;
+		job->rom = dup_string(tok);
+		while((tok = strtok(NULL, " \t\r\n")) != NULL){
+			if(strncmp(tok, "frames=", 7) == 0)
+				job->frames = atol(tok + 7);
+			else if(strncmp(tok, "cycles=", 7) == 0)
+				job->cycles = strtoull(tok + 7, NULL, 0);
+			else if(strncmp(tok, "movie=", 6) == 0)
+				job->movie = dup_string(tok + 6);
+			else if(strncmp(tok, "save=", 5) == 0)
+				job->save = dup_string(tok + 5);
+			else if(strncmp(tok, "name=", 5) == 0 && tok[5] != '\0' && strchr(tok + 5, '/') == NULL)
+				job->name = dup_string(tok + 5);
+			else if(strcmp(tok, "dmg") == 0)
+				job->dmg = 1;
+			else{
+				printf("%s:%d: unknown option %s\n", path, lineno, tok);
+				fclose(fp);
+				return -1;
+			}
+		}
+		if(job->frames < 0){
+			printf("%s:%d: invalid frame count\n", path, lineno);
+			fclose(fp);
+			return -1;
+		}
+		if(job->frames == 0 && job->cycles == 0 && job->movie == NULL)
+			job->frames = default_frames;
+		if(job->name == NULL){
+			char buf[32];
+			snprintf(buf, sizeof(buf), "job%05zu", num_jobs);
+			job->name = dup_string(buf);
+		}
+		num_jobs++;
+	}
+	fclose(fp);
+
+	//名前はログ・セーブデータのファイル名になるので重ならないようにする
+	struct job **sorted = malloc(num_jobs * sizeof(struct job *));
+	if(sorted == NULL){
+		perror("malloc");
+		return -1;
+	}
+	for(size_t i=0; i<num_jobs; i++)
+		sorted[i] = &jobs[i];
+	qsort(sorted, num_jobs, sizeof(struct job *), compare_names);
+	int ret = 0;
+	for(size_t i=1; i<num_jobs; i++){
+		if(strcmp(sorted[i-1]->name, sorted[i]->name) == 0){
+			const struct job *a = sorted[i-1]->line < sorted[i]->line ? sorted[i-1] : sorted[i];
+			const struct job *b = a == sorted[i] ? sorted[i-1] : sorted[i];
+			printf("%s:%d: duplicate job name %s (also on line %d)\n", path, b->line, b->name, a->line);
+			ret = -1;
+		}
+	}
+	free(sorted);
+	return ret;
+}
+
+static const char *state_name(int state) {
+	switch(state){
+	case JOB_DONE: return "ok";
+	case JOB_FAILED: return "failed";
+	}
+	return "not_run";
+}
+
+static void put_json_string(FILE *fp, const char *s) {
+	if(s == NULL){
+		fputs("null", fp);
+		return;
+	}
+	fputc('"', fp);
+	for(; *s; s++){
+		if(*s == '"' || *s == '\\')
+			fputc('\\', fp);
+		if((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+static void usage() {
+	puts("usage: gb_batch [--workers=N] [--frames=N] [--out=DIR] [--json=FILE|-] JOBFILE");
+	puts("  --workers=N   number of worker threads (default: number of CPUs)");
+	puts("  --frames=N    frames per job without frames=/cycles=/movie= (default: 3600)");
+	puts("  --out=DIR     output directory (default: gb_batch_out)");
+	puts("  --json=FILE   write the summary as JSON (- for stdout)");
+}
+
+enum {
+	OPT_WORKERS = 0x100,
+	OPT_FRAMES,
+	OPT_OUT,
+	OPT_JSON,
+};
+
+static const struct option long_options[] = {
+	{"workers", required_argument, NULL, OPT_WORKERS},
+	{"frames", required_argument, NULL, OPT_FRAMES},
+	{"out", required_argument, NULL, OPT_OUT},
+	{"json", required_argument, NULL, OPT_JSON},
+	{0, 0, 0, 0}
+};
+
+int main(int argc, char *argv[]) {
+	long default_frames = 3600;
+	const char *json_path = NULL;
+	num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+	int c;
+	while((c = getopt_long(argc, argv, "", long_options, NULL)) != -1){
+		switch(c){
+		case OPT_WORKERS:
+			num_workers = atoi(optarg);
+			if(num_workers <= 0 || num_workers > MAX_WORKERS){
+				printf("invalid worker count: %s (1-%d)\n", optarg, MAX_WORKERS);
+				return -1;
+			}
+			break;
+		case OPT_FRAMES:
+			default_frames = atol(optarg);
+			if(default_frames <= 0){
+				printf("invalid frame count: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case OPT_OUT:
+			out_dir = optarg;
+			break;
+		case OPT_JSON:
+			json_path = optarg;
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+	if(optind + 1 != argc){
+		usage();
+		return -1;
+	}
+	if(num_workers <= 0)
+		num_workers = 1;
+	if(num_workers > MAX_WORKERS)
+		num_workers = MAX_WORKERS;
+
+	if(load_jobs(argv[optind], default_frames) < 0)
+		return -1;
+	if(num_jobs == 0){
+		puts("no jobs");
+		return -1;
+	}
+	if((size_t)num_workers > num_jobs)
+		num_workers = num_jobs;
+	if(mkdir(out_dir, 0755) < 0 && errno != EEXIST){
+		perror(out_dir);
+		return -1;
+	}
+
+	shared = calloc(1, sizeof(struct shared) + num_jobs * sizeof(struct job_result));
+	if(shared == NULL){
+		perror("calloc");
+		return -1;
+	}
+	//ジョブは順に連続した範囲で配る(近いジョブは同じROMのことが多い)
+	for(int i=0; i<num_workers; i++){
+		atomic_store(&shared->deques[i].top, (long)(num_jobs * i / num_workers));
+		atomic_store(&shared->deques[i].bottom, (long)(num_jobs * (i+1) / num_workers));
+	}
+
+	printf("%zu jobs, %d worker threads\n", num_jobs, num_workers);
+	fflush(stdout);
+	lcd_init();
+	uint64_t start = now_ns();
+	//起動できなかったワーカーのデックは、ほかのワーカーが盗んで片付ける
+	pthread_t threads[MAX_WORKERS];
+	int started = 0;
+	for(int i=0; i<num_workers; i++){
+		int err = pthread_create(&threads[i], NULL, worker_main, (void *)(intptr_t)i);
+		if(err != 0){
+			printf("worker %d: %s\n", i, strerror(err));
+			break;
+		}
+		started++;
+	}
+	if(started == 0)
+		return -1;
+	for(int i=0; i<started; i++)
+		pthread_join(threads[i], NULL);
+	uint64_t elapsed = now_ns() - start;
+	int ret = 0;
+
+	//結果の一覧はジョブファイルの順に書く
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/results.tsv", out_dir);
+	FILE *fp = fopen(path, "w");
+	if(fp == NULL){
+		perror(path);
+		return -1;
+	}
+	fputs("name\tstatus\tframes\tcycles\tseconds\tframebuffer\tsram\tworker\n", fp);
+	size_t ok = 0;
+	uint64_t total_frames = 0, total_cycles = 0;
+	for(size_t j=0; j<num_jobs; j++){
+		struct job_result *r = &shared->results[j];
+		int state = atomic_load(&r->state);
+		if(state == JOB_DONE){
+			ok++;
+			total_frames += r->frames;
+			total_cycles += r->cycles;
+		}else
+			ret = -1;
+		fprintf(fp, "%s\t%s\t%llu\t%llu\t%.6f\t%016llx\t%d\t%d\n", jobs[j].name, state_name(state),
+				(unsigned long long)r->frames, (unsigned long long)r->cycles, r->ns / 1e9,
+				(unsigned long long)r->fb_hash, r->sram_size, r->worker);
+	}
+	fclose(fp);
+
+	double wall = elapsed / 1e9;
+	double mhz = total_cycles / wall / 1e6;
+	double fps = total_frames / wall;
+	double speed = (total_cycles / 4194304.0) / wall;
+	uint64_t busy = 0;
+	for(int i=0; i<num_workers; i++)
+		busy += shared->workers[i].busy_ns;
+
+	printf("%zu/%zu jobs ok in %.3f s (%.1f jobs/s)\n", ok, num_jobs, wall, num_jobs / wall);
+	printf("  %llu frames, %.2f MHz, %.1f fps (%.2fx), workers busy %.1f%%\n", (unsigned long long)total_frames,
+			mhz, fps, speed, 100.0 * busy / (elapsed * (double)num_workers));
+	for(int i=0; i<num_workers; i++){
+		struct worker_stats *w = &shared->workers[i];
+		printf("  worker %-3d %6llu jobs, %5llu stolen, busy %5.1f%%\n", i, (unsigned long long)w->jobs,
+				(unsigned long long)w->steals, 100.0 * w->busy_ns / elapsed);
+	}
+	printf("  results: %s\n", path);
+
+	if(json_path != NULL){
+		FILE *jp = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+		if(jp == NULL){
+			perror(json_path);
+			return -1;
+		}
+		fprintf(jp, "{\"workers\": %d, \"jobs\": %zu, \"ok\": %zu, \"wall_s\": %.6f, \"frames\": %llu, \"cycles\": %llu, "
+				"\"mhz\": %.4f, \"fps\": %.3f, \"speed\": %.4f, \"results\": [",
+				num_workers, num_jobs, ok, wall, (unsigned long long)total_frames, (unsigned long long)total_cycles,
+				mhz, fps, speed);
+		for(size_t j=0; j<num_jobs; j++){
+			struct job_result *r = &shared->results[j];
+			fputs(j > 0 ? ", {\"name\": " : "{\"name\": ", jp);
+			put_json_string(jp, jobs[j].name);
+			fprintf(jp, ", \"status\": \"%s\", \"frames\": %llu, \"cycles\": %llu, \"wall_s\": %.6f, "
+					"\"framebuffer\": \"%016llx\", \"sram\": %d}",
+					state_name(atomic_load(&r->state)), (unsigned long long)r->frames, (unsigned long long)r->cycles,
+					r->ns / 1e9, (unsigned long long)r->fb_hash, r->sram_size);
+		}
+		fputs("]}\n", jp);
+		if(jp != stdout)
+			fclose(jp);
+	}
+	free(shared);
+	return ret;
+}
@@ -0,0 +1,273 @@
+//ベンチマーク: ROM(と入力の動画)を待ち時間なしでNフレーム実行し、
+//実時間・エミュレーション上のクロック・フレームレート・命令数と、CPU/メモリ/PPU/APUの内訳を表示する
+//ウィンドウ・オーディオデバイスは使わない(SDLを使わないコアだけをリンクする)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+
+#include "cpu.h"
+#include "cartridge.h"
+#include "memory.h"
+#include "lcd.h"
+#include "sound.h"
+#include "machine.h"
+#include "movie.h"
+#include "prof.h"
+
+#ifndef GB_BENCH_COMMIT
+#define GB_BENCH_COMMIT ""
+#endif
+
+#define SAMPLE_INTERVAL_US 1000
+
+volatile sig_atomic_t prof_section = PROF_OTHER;
+uint64_t prof_instructions = 0;
+
+static volatile uint64_t samples[PROF_SECTIONS];
+static timer_t timer;
+static const char *section_names[PROF_SECTIONS] = {"other", "cpu", "memory", "ppu", "apu"};
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void on_sigprof(int sig) {
+	(void)sig;
+	samples[prof_section]++;
+}
+
+static int profile_start() {
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_sigprof;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if(sigaction(SIGPROF, &sa, NULL) < 0){
+		perror("sigaction");
+		return -1;
+	}
+	//ITIMER_PROFはカーネルのティック単位でしか届かないので、高分解能のタイマーを使う
+	//(ベンチマークは1スレッドで回り続けるので、実時間で数えてもCPU時間とほぼ同じ)
+	struct sigevent sev;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_SIGNAL;
+	sev.sigev_signo = SIGPROF;
+	if(timer_create(CLOCK_MONOTONIC, &sev, &timer) < 0){
+		perror("timer_create");
+		return -1;
+	}
+	struct itimerspec it = {{0, SAMPLE_INTERVAL_US*1000}, {0, SAMPLE_INTERVAL_US*1000}};
+	if(timer_settime(timer, 0, &it, NULL) < 0){
+		perror("timer_settime");
+		return -1;
+	}
+	return 0;
+}
+
+static void profile_stop() {
+	timer_delete(timer);
+}
+
+//ROMは読むだけ、セーブデータは毎回0から始める(ファイルには触らない)
+static struct cartridge *load_cartridge(const char *path) {
+	FILE *fp = fopen(path, "rb");
+	if(fp == NULL){
+		perror(path);
+		return NULL;
+	}
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	uint8_t *rom = malloc(size);
+	if(rom == NULL || fread(rom, 1, size, fp) != (size_t)size){
+		printf("%s: read failed\n", path);
+		fclose(fp);
+		free(rom);
+		return NULL;
+	}
+	fclose(fp);
+
+	struct cartridge *cart = cart_init(rom);
+	if(cart == NULL)
+		return NULL;
+
+	static const int ramsize_table[] = {0,2048,8192,8192*4,8192*16,8192*8};
+	struct gb_carthdr *hdr = cart_header(cart);
+	if(hdr->ramsize != 0){
+		int ramsize = ramsize_table[hdr->ramsize];
+		if(hdr->carttype==CARTTYPE_MBC2 || hdr->carttype==CARTTYPE_MBC2_BATT)
+			ramsize = 512;
+		uint8_t *ram = calloc(1, ramsize);
+		if(ram == NULL)
+			return NULL;
+		cart_setram(cart, ram, 0);
+	}
+	return cart;
+}
+
+static void put_json_string(FILE *fp, const char *s) {
+	if(s == NULL){
+		fputs("null", fp);
+		return;
+	}
+	fputc('"', fp);
+	for(; *s; s++){
+		if(*s == '"' || *s == '\\')
+			fputc('\\', fp);
+		if((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+static void usage() {
+	puts("usage: gb_bench [--frames=N] [--movie=FILE] [--no-audio] [--dmg] [--json=FILE|-] ROM");
+}
+
+enum {
+	OPT_FRAMES = 0x100,
+	OPT_MOVIE,
+	OPT_NO_AUDIO,
+	OPT_DMG,
+	OPT_JSON,
+};
+
+static const struct option long_options[] = {
+	{"frames", required_argument, NULL, OPT_FRAMES},
+	{"movie", required_argument, NULL, OPT_MOVIE},
+	{"no-audio", no_argument, NULL, OPT_NO_AUDIO},
+	{"dmg", no_argument, NULL, OPT_DMG},
+	{"json", required_argument, NULL, OPT_JSON},
+	{0, 0, 0, 0}
+};
+
+int main(int argc, char *argv[]) {
+	long frames = 3600;
+	const char *movie_path = NULL;
+	const char *json_path = NULL;
+	int audio = 1;
+	int force_dmg = 0;
+
+	int c;
+	while((c = getopt_long(argc, argv, "", long_options, NULL)) != -1){
+		switch(c){
+		case OPT_FRAMES:
+			frames = atol(optarg);
+			if(frames <= 0){
+				printf("invalid frame count: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case OPT_MOVIE:
+			movie_path = optarg;
+			break;
+		case OPT_NO_AUDIO:
+			audio = 0;
+			break;
+		case OPT_DMG:
+			force_dmg = 1;
+			break;
+		case OPT_JSON:
+			json_path = optarg;
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+	if(optind + 1 != argc){
+		usage();
+		return -1;
+	}
+	const char *romname = argv[optind];
+
+	struct cartridge *cart = load_cartridge(romname);
+	if(cart == NULL)
+		return -1;
+	int input_rate = 1;
+	if(movie_path != NULL){
+		int flags;
+		uint32_t lead;
+		if(movie_play(movie_path, cart, &flags, &input_rate, &lead) < 0)
+			return -1;
+		force_dmg = flags & MOVIE_FLAG_DMG;
+	}
+	if(memory_init(cart)){
+		puts("memory_init failed");
+		return -1;
+	}
+	if(force_dmg)
+		CGBMODE = 0;
+	startup();
+
+	lcd_init();
+	if(audio && sound_init(SOUND_SAMPLE_RATE) < 0)
+		return -1;
+
+	static uint32_t framebuf[160*144];
+	if(profile_start() < 0)
+		return -1;
+	uint64_t start = now_ns();
+	for(long i=0; i<frames; i++){
+		if(movie_playing())
+			machine_run_frame_latched(framebuf, input_rate);
+		else
+			machine_run_frame(framebuf);
+	}
+	uint64_t elapsed = now_ns() - start;
+	profile_stop();
+
+	double wall = elapsed / 1e9;
+	double mhz = cpu_cycles / wall / 1e6;
+	double fps = frames / wall;
+	double speed = (frames * 70224.0 / 4194304.0) / wall;
+	double ips = prof_instructions / wall;
+	uint64_t total = 0;
+	for(int i=0; i<PROF_SECTIONS; i++)
+		total += samples[i];
+
+	printf("%s: %ld frames in %.3f s\n", romname, frames, wall);
+	printf("  %.2f MHz, %.1f fps (%.2fx), %.2f M instructions/s\n", mhz, fps, speed, ips / 1e6);
+	for(int i=1; i<=PROF_SECTIONS; i++){
+		int s = i % PROF_SECTIONS; //otherは最後に出す
+		printf("  %-7s %5.1f%%\n", section_names[s], total ? 100.0 * samples[s] / total : 0.0);
+	}
+	printf("  (%llu samples every %d us)\n", (unsigned long long)total, SAMPLE_INTERVAL_US);
+
+	if(json_path != NULL){
+		FILE *fp = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+		if(fp == NULL){
+			perror(json_path);
+			return -1;
+		}
+		fputs("{\"commit\": ", fp);
+		put_json_string(fp, GB_BENCH_COMMIT);
+		fputs(", \"rom\": ", fp);
+		put_json_string(fp, romname);
+		fputs(", \"movie\": ", fp);
+		put_json_string(fp, movie_path);
+		fprintf(fp, ", \"audio\": %s, \"frames\": %ld, \"wall_s\": %.6f, \"cycles\": %llu, "
+				"\"mhz\": %.4f, \"fps\": %.3f, \"speed\": %.4f, \"instructions\": %llu, \"instructions_per_s\": %.0f, "
+				"\"breakdown\": {",
+				audio ? "true" : "false", frames, wall, (unsigned long long)cpu_cycles, mhz, fps, speed,
+				(unsigned long long)prof_instructions, ips);
+		for(int i=1; i<=PROF_SECTIONS; i++){
+			int s = i % PROF_SECTIONS;
+			fprintf(fp, "%s\"%s\": %.4f", i > 1 ? ", " : "", section_names[s], total ? (double)samples[s] / total : 0.0);
+		}
+		fprintf(fp, "}, \"samples\": %llu}\n", (unsigned long long)total);
+		if(fp != stdout)
+			fclose(fp);
+	}
+
+	movie_close();
+	memory_free();
+	return 0;
+}
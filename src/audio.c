@@ -0,0 +1,201 @@
+#include "audio.h"
+#include "sound.h"
+#include "pacing.h"
+#include "spsc.h"
+#include "SDL2/SDL.h"
+#include <stdatomic.h>
+#include <stdio.h>
+
+#define MAX_BLOCK 4096 //sound.cが1度に渡す最大のフレーム数
+
+static SDL_AudioSpec Desired;
+static SDL_AudioSpec Obtained;
+static int device_opened = 0;
+
+//合成済みサンプルをコールバックへ渡すリングバッファ(要素はL/RのSint16の組)
+static struct spsc ring;
+static Sint16 last_frame[2];
+static atomic_ullong underruns; //コールバックでサンプルが足りなかった回数
+static atomic_ullong overruns;  //リングが一杯でサンプルを捨てた回数
+
+//動的レート制御
+//映像側(vsyncやタイマー)とオーディオデバイスの時計のずれを、リングバッファの量が
+//target_fillに保たれるようにデバイスへ送る直前でわずかにリサンプリングして吸収する
+//(合成そのものはエミュレーション上の時刻だけで決まり、キャプチャはこの前から取る)
+#define RATE_MAX_PPM 5000 //最大0.5%
+static size_t target_fill;
+static atomic_int rate_adjust_ppm;
+static uint64_t resample_step = 1ULL << 32; //出力1フレームあたりに進む入力フレーム数(32.32固定小数点)
+static uint64_t resample_pos;               //resample_prevからの位置(32.32固定小数点)
+static Sint16 resample_prev[2];
+
+//早送り中は、リングがtarget_fillに足りないときだけブロックを送り、残りは捨てる(間引き)
+//リングの量は増えも減りもしないので、遅延も途切れも起きない。レート制御は止めておく
+static int fast_forward = 0;
+
+//再生位置の推定用(コールバックで更新、seqlockで読む)
+//最初のコールバックまではpacing_now_ns()をそのまま返し、そのときの時刻を基準にする(基準が途中で変わらないように)
+static atomic_uint clock_seq;
+static uint64_t clock_samples;     //最後のコールバックより前に渡したフレーム数
+static uint64_t clock_last_samples; //最後のコールバックで渡したフレーム数
+static uint64_t clock_callback_ns;
+static uint64_t clock_start_ns;     //最初のコールバックの時刻(0ならまだ)
+
+//線形補間でresample_stepに従ってリサンプリングし、リングバッファへ送る
+static void resample_to_ring(const Sint16 *in, int count) {
+	static Sint16 out[MAX_BLOCK * 2 * 2];
+	int n = 0;
+	for(int i=0; i<count; i++){
+		while(resample_pos < (1ULL << 32)){
+			int64_t t = resample_pos >> 16;
+			out[n*2] = resample_prev[0] + (((in[i*2] - resample_prev[0]) * t) >> 16);
+			out[n*2+1] = resample_prev[1] + (((in[i*2+1] - resample_prev[1]) * t) >> 16);
+			n++;
+			resample_pos += resample_step;
+		}
+		resample_pos -= 1ULL << 32;
+		resample_prev[0] = in[i*2];
+		resample_prev[1] = in[i*2+1];
+	}
+
+	//再生が追いつかないときは新しい方を捨てる
+	if(spsc_write(&ring, out, n) < (size_t)n)
+		atomic_fetch_add_explicit(&overruns, 1, memory_order_relaxed);
+}
+
+static void update_rate() {
+	long long fill = spsc_count(&ring);
+	long long ppm = RATE_MAX_PPM * ((long long)target_fill - fill) / (long long)target_fill;
+	if(ppm > RATE_MAX_PPM) ppm = RATE_MAX_PPM;
+	if(ppm < -RATE_MAX_PPM) ppm = -RATE_MAX_PPM;
+	resample_step = (uint64_t)(((1ULL << 32) * 1000000) / (1000000 + ppm));
+	atomic_store_explicit(&rate_adjust_ppm, (int)ppm, memory_order_relaxed);
+}
+
+static void update_clock(int samples) {
+	uint64_t now = pacing_now_ns();
+	atomic_fetch_add_explicit(&clock_seq, 1, memory_order_acq_rel);
+	if(clock_start_ns == 0)
+		clock_start_ns = now;
+	clock_samples += clock_last_samples;
+	clock_last_samples = samples;
+	clock_callback_ns = now;
+	atomic_fetch_add_explicit(&clock_seq, 1, memory_order_acq_rel);
+}
+
+//オーディオデバイスの時計(ns)。pacing_now_ns()と同じ基準
+//コールバック間は実時間で補間し、そのバッファの分より先には進めない
+uint64_t audio_clock_ns() {
+	uint64_t start, samples, last, cb_ns;
+	unsigned int seq;
+	do{
+		seq = atomic_load_explicit(&clock_seq, memory_order_acquire);
+		start = clock_start_ns;
+		samples = clock_samples;
+		last = clock_last_samples;
+		cb_ns = clock_callback_ns;
+	}while((seq & 1) || seq != atomic_load_explicit(&clock_seq, memory_order_acquire));
+
+	uint64_t now = pacing_now_ns();
+	if(start == 0 || Obtained.freq == 0)
+		return now; //まだ再生が始まっていない
+
+	uint64_t buffer_ns = last * 1000000000ULL / Obtained.freq;
+	uint64_t elapsed = now - cb_ns;
+	if(elapsed > buffer_ns)
+		elapsed = buffer_ns;
+	return start + samples * 1000000000ULL / Obtained.freq + elapsed;
+}
+
+static void callback(void *unused, Uint8 *stream, int len) {
+	int16_t *frames = (int16_t *) stream;
+	size_t want = len / 4;
+	update_clock(want);
+	size_t n = spsc_read(&ring, frames, want);
+	if(n > 0){
+		last_frame[0] = frames[(n-1)*2];
+		last_frame[1] = frames[(n-1)*2+1];
+	}
+	if(n < want){
+		//足りないときは直前の値を保つ(プチノイズ防止)
+		atomic_fetch_add_explicit(&underruns, 1, memory_order_relaxed);
+		for(size_t i=n; i<want; i++){
+			frames[i*2] = last_frame[0];
+			frames[i*2+1] = last_frame[1];
+		}
+	}
+}
+
+
+
+//sound.cから合成したブロックごとに呼ばれる(エミュレーションスレッド)
+static void output(const int16_t *frames, int count, void *unused) {
+	(void)unused;
+	if(fast_forward){
+		if(spsc_count(&ring) < target_fill)
+			resample_to_ring(frames, count);
+		return;
+	}
+	resample_to_ring(frames, count);
+	update_rate();
+}
+
+//エミュレーションスレッドから呼ぶ
+void audio_set_fast_forward(int on) {
+	fast_forward = on;
+}
+
+void audio_get_stats(struct audio_stats *st) {
+	st->underruns = atomic_load_explicit(&underruns, memory_order_relaxed);
+	st->overruns = atomic_load_explicit(&overruns, memory_order_relaxed);
+	st->fill = device_opened ? spsc_count(&ring) : 0;
+	st->capacity = device_opened ? spsc_capacity(&ring) : 0;
+	st->target_fill = target_fill;
+	st->rate_adjust_ppm = atomic_load_explicit(&rate_adjust_ppm, memory_order_relaxed);
+}
+
+void audio_print_stats() {
+	struct audio_stats st;
+	audio_get_stats(&st);
+	printf("audio: underrun %llu, overrun %llu, fill %zu/%zu frames (target %zu), rate %+d ppm\n",
+			st.underruns, st.overruns, st.fill, st.capacity, st.target_fill, st.rate_adjust_ppm);
+}
+
+//デバイスを開き、そのレートで音の合成を有効にする
+//buffer_samples: デバイスのバッファのサンプル数(2の累乗)
+int audio_init(int buffer_samples) {
+	Desired.freq= SOUND_SAMPLE_RATE;
+	Desired.format= AUDIO_S16LSB;
+	Desired.channels= 2;
+	Desired.samples= buffer_samples;
+	Desired.callback= callback;
+	Desired.userdata= NULL;
+
+	if(SDL_OpenAudio(&Desired, &Obtained) < 0){
+		printf("SDL_OpenAudio failed: %s\n", SDL_GetError());
+		return -1;
+	}
+
+	//フレームの終わりにまとめて書き込まれるので、1回分のコールバックに加えて
+	//2フレーム分を目標に溜めておく
+	int frame_samples = Obtained.freq / 60;
+	target_fill = Obtained.samples + frame_samples*2;
+	size_t capacity = 4096;
+	while(capacity < target_fill*2 + MAX_BLOCK)
+		capacity <<= 1;
+	if(spsc_init(&ring, capacity, sizeof(Sint16)*2) < 0){
+		puts("audio_init: spsc_init failed");
+		SDL_CloseAudio();
+		return -1;
+	}
+
+	if(sound_init(Obtained.freq) < 0){
+		spsc_free(&ring);
+		SDL_CloseAudio();
+		return -1;
+	}
+	sound_set_output(output, NULL);
+	device_opened = 1;
+	SDL_PauseAudio(0);
+	return 0;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stddef.h>
+
+//オーディオデバイス(SDL)への出力
+//sound.cが合成したサンプルをリングバッファ経由でコールバックへ渡す
+
+struct audio_stats {
+	unsigned long long underruns; //コールバックでサンプルが足りなかった回数
+	unsigned long long overruns;  //リングバッファが一杯で捨てた回数
+	size_t fill;                  //リングバッファに溜まっているフレーム数
+	size_t capacity;
+	size_t target_fill;           //レート制御の目標
+	int rate_adjust_ppm;          //現在のサンプル生成レートの補正
+};
+
+#define AUDIO_BUFFER_DEFAULT 1024
+
+int audio_init(int buffer_samples);
+uint64_t audio_clock_ns(void);
+void audio_set_fast_forward(int on);
+void audio_get_stats(struct audio_stats *st);
+void audio_print_stats(void);
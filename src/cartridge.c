@@ -1,5 +1,7 @@
 #include "cartridge.h"
 #include "memory.h"
+#include "cpu.h"
+#include "state.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,6 +21,8 @@ struct cartridge {
 	uint8_t *rom0;
 	uint8_t *romn;
 	uint8_t *ramn;
+	int rtc_virtual; //1ならRTCは実時間ではなくrtc_baseからの経過サイクルで進む
+	time_t rtc_base;
 };
 
 const uint8_t VALID_LOGO[] = {
@@ -31,7 +35,10 @@ const uint8_t VALID_LOGO[] = {
 struct cartridge *cart_init(uint8_t *rom) {
 	struct cartridge *cart = malloc(sizeof(struct cartridge));
 	cart->rom = rom;
+	cart->ram = NULL;
+	cart->ram_time = 0;
 	cart->ram_enabled = 1;
+	cart->rtc_virtual = 0;
 	memcpy(&(cart->header), rom+0x100, sizeof(struct gb_carthdr));
 
 	/*
@@ -110,6 +117,53 @@ int get_romsize(int n) {
 		return 0;
 }
 
+const uint8_t *cart_getrom(struct cartridge *cart, int *size) {
+	*size = get_romsize(cart->header.romsize);
+	return cart->rom;
+}
+
+//セーブデータ(なければNULL)とその大きさ、最後に保存された時刻
+uint8_t *cart_getram(struct cartridge *cart, int *size, time_t *t) {
+	static const int ramsize_table[] = {0,2048,8192,8192*4,8192*16,8192*8};
+	*size = ramsize_table[cart->header.ramsize];
+	if(cart->header.carttype==CARTTYPE_MBC2 || cart->header.carttype==CARTTYPE_MBC2_BATT)
+		*size = 512;
+	*t = cart->ram_time;
+	return cart->ram;
+}
+
+//RTCを実時間から切り離し、baseから経過したエミュレーション上の時間で進める
+void cart_set_virtual_rtc(struct cartridge *cart, time_t base) {
+	cart->rtc_virtual = 1;
+	cart->rtc_base = base;
+}
+
+//ステートセーブ(バンクの選択とRAMの中身)
+void cart_state_save(struct cartridge *cart, struct state_buf *b) {
+	int size;
+	time_t t;
+	uint8_t *ram = cart_getram(cart, &size, &t);
+	state_put(b, &cart->ram_enabled, sizeof(cart->ram_enabled));
+	state_put(b, &cart->rom_banknum, sizeof(cart->rom_banknum));
+	state_put(b, &cart->ram_banknum, sizeof(cart->ram_banknum));
+	state_put(b, &cart->mbc1_mode, sizeof(cart->mbc1_mode));
+	if(ram != NULL)
+		state_put(b, ram, size);
+}
+
+void cart_state_load(struct cartridge *cart, struct state_buf *b) {
+	int size;
+	time_t t;
+	uint8_t *ram = cart_getram(cart, &size, &t);
+	state_get(b, &cart->ram_enabled, sizeof(cart->ram_enabled));
+	state_get(b, &cart->rom_banknum, sizeof(cart->rom_banknum));
+	state_get(b, &cart->ram_banknum, sizeof(cart->ram_banknum));
+	state_get(b, &cart->mbc1_mode, sizeof(cart->mbc1_mode));
+	if(ram != NULL)
+		state_get(b, ram, size);
+	update_mapping(cart);
+}
+
 static void update_mapping(struct cartridge *cart) {
 	//ROM
 	switch(cart->header.carttype) {
@@ -314,16 +368,23 @@ uint8_t cart_ramn_read8(struct cartridge *cart, uint16_t src) {
 	case CARTTYPE_MBC3_TIM_BATT:
 	case CARTTYPE_MBC3_TIM_RAM_BATT:
 		{
-			time_t t = time(NULL);
-			struct tm *local = localtime(&t);
+			time_t t;
+			struct tm local; //ほかのスレッドのインスタンスと共有しないよう_rを使う
+			if(cart->rtc_virtual){
+				t = cart->rtc_base + cpu_cycles/4194304;
+				gmtime_r(&t, &local);
+			}else{
+				t = time(NULL);
+				localtime_r(&t, &local);
+			}
 			int daydiff = (cart->ram_time-t)/60*60*24;
 			switch(cart->ram_banknum){
 			case 0x8:
-				return local->tm_sec;
+				return local.tm_sec;
 			case 0x9:
-				return local->tm_min;
+				return local.tm_min;
 			case 0xa:
-				return local->tm_hour;
+				return local.tm_hour;
 			case 0xb:
 				return daydiff>=0 ? daydiff&0xff : 0;
 			case 0xc:
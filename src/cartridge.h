@@ -24,6 +24,12 @@ struct gb_carthdr {
 struct cartridge *cart_init(uint8_t *rom);
 void cart_setram(struct cartridge *cart, uint8_t *ram, time_t t);
 struct gb_carthdr *cart_header(struct cartridge *cart);
+const uint8_t *cart_getrom(struct cartridge *cart, int *size);
+uint8_t *cart_getram(struct cartridge *cart, int *size, time_t *t);
+void cart_set_virtual_rtc(struct cartridge *cart, time_t base);
+struct state_buf;
+void cart_state_save(struct cartridge *cart, struct state_buf *b);
+void cart_state_load(struct cartridge *cart, struct state_buf *b);
 void cart_rom0_write8(struct cartridge *cart, uint16_t dst, uint8_t value);
 void cart_romn_write8(struct cartridge *cart, uint16_t dst, uint8_t value);
 void cart_ramn_write8(struct cartridge *cart, uint16_t dst, uint8_t value);
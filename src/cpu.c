@@ -4,6 +4,9 @@
 #include "cpu.h"
 #include "memory.h"
 #include "serial.h"
+#include "state.h"
+#include "prof.h"
+#include <string.h>
 
 //#define SHOW_DISAS
 
@@ -13,6 +16,42 @@
 			  ##__VA_ARGS__ \
 	)
 
+#ifdef GB_PROFILE
+//メモリアクセスの時間をCPUと分けて数える
+static inline uint8_t prof_read8(uint16_t src) {
+	PROF_BEGIN(PROF_MEMORY);
+	uint8_t v = memory_read8(src);
+	PROF_END();
+	return v;
+}
+
+static inline uint16_t prof_read16(uint16_t src) {
+	PROF_BEGIN(PROF_MEMORY);
+	uint16_t v = memory_read16(src);
+	PROF_END();
+	return v;
+}
+
+static inline uint8_t prof_write8(uint16_t dst, uint8_t value) {
+	PROF_BEGIN(PROF_MEMORY);
+	uint8_t v = memory_write8(dst, value);
+	PROF_END();
+	return v;
+}
+
+static inline uint16_t prof_write16(uint16_t dst, uint16_t value) {
+	PROF_BEGIN(PROF_MEMORY);
+	uint16_t v = memory_write16(dst, value);
+	PROF_END();
+	return v;
+}
+
+#define memory_read8 prof_read8
+#define memory_read16 prof_read16
+#define memory_write8 prof_write8
+#define memory_write16 prof_write16
+#endif
+
 #define BIT7_6(v) (((v)>>6)&0x3)
 #define BIT5_3(v) (((v)>>3)&0x7)
 #define BIT2_0(v) ((v)&0x7)
@@ -63,10 +102,10 @@ union reg16 {
 	} v;
 };
 
-static union reg16 reg_bc, reg_de, reg_hl;
-static uint16_t reg_pc, reg_sp;
-static uint8_t reg_a;
-static uint32_t FLG_Z, FLG_N, FLG_H, FLG_C, FLG_IME;
+static GB_LOCAL union reg16 reg_bc, reg_de, reg_hl;
+static GB_LOCAL uint16_t reg_pc, reg_sp;
+static GB_LOCAL uint8_t reg_a;
+static GB_LOCAL uint32_t FLG_Z, FLG_N, FLG_H, FLG_C, FLG_IME;
 #define REG_B reg_bc.v.h
 #define REG_C reg_bc.v.l
 #define REG_D reg_de.v.h
@@ -149,13 +188,16 @@ static uint32_t FLG_Z, FLG_N, FLG_H, FLG_C, FLG_IME;
 #define ADDSP_16 (cr=REG_SP+(int8_t)(OPERAND8), FLG_Z=0, FLG_N=0, FLG_C=((REG_SP&0xff)+OPERAND8)&0x100, FLG_H=((OPERAND8&0xf)+(REG_SP&0xf))&0x10, REG_SP=cr)
 #define ADDHLSP_16 (cr=REG_SP+(int8_t)(OPERAND8), FLG_Z=0, FLG_N=0, FLG_C=((REG_SP&0xff)+OPERAND8)&0x100, FLG_H=((OPERAND8&0xf)+(REG_SP&0xf))&0x10, REG_HL=cr)
 
-static int CPUMODE;
+static GB_LOCAL int CPUMODE;
 #define CPU_MODE_NORMAL 0
 #define CPU_MODE_STOP 	1
 #define CPU_MODE_HALT	2
 
+GB_LOCAL uint64_t cpu_cycles = 0; //起動からの通算サイクル数(サウンドのタイムスタンプ用)
+
 void tick(int *cycles, int n) {
 	*cycles -= n;
+	cpu_cycles += n;
 	if(CPUMODE == CPU_MODE_STOP)
 		return;
 	uint8_t tac = INTERNAL_IO[IO_TAC_R];
@@ -172,18 +214,8 @@ void tick(int *cycles, int n) {
 		}
 	}
 
-	serial_remaining -= n;	 
-	if(serial_remaining<0 && serial_received){
-		serial_received = 0;
-		if(!serial_sent){
-			serial_send(INTERNAL_IO[IO_SB_R]);
-		}
-		INTERNAL_IO[IO_SB_R] = serial_recv_buffer;
-		INTERNAL_IO[IO_SC_R] &= ~0x80;
-		serial_sent=0;
-		cpu_request_interrupt(INT_SERIAL);
-	}
-
+	if(cpu_cycles >= serial_next_check)
+		serial_update();
 }
 
 
@@ -246,13 +278,62 @@ void startup() {
 }
 
 
+//インスタンスごとの状態(gb_switchで入れ替える)
+struct cpu_context {
+	union reg16 bc, de, hl;
+	uint16_t pc, sp;
+	uint8_t a;
+	uint32_t z, n, h, c, ime;
+	int mode;
+	int delayed_ei;
+	uint64_t cycles;
+};
+
+static GB_LOCAL int delayed_ei;
+
+struct cpu_context *cpu_context_new() {
+	return calloc(1, sizeof(struct cpu_context));
+}
+
+void cpu_context_save(struct cpu_context *ctx) {
+	ctx->bc = reg_bc; ctx->de = reg_de; ctx->hl = reg_hl;
+	ctx->pc = reg_pc; ctx->sp = reg_sp; ctx->a = reg_a;
+	ctx->z = FLG_Z; ctx->n = FLG_N; ctx->h = FLG_H; ctx->c = FLG_C; ctx->ime = FLG_IME;
+	ctx->mode = CPUMODE;
+	ctx->delayed_ei = delayed_ei;
+	ctx->cycles = cpu_cycles;
+}
+
+void cpu_context_load(const struct cpu_context *ctx) {
+	reg_bc = ctx->bc; reg_de = ctx->de; reg_hl = ctx->hl;
+	reg_pc = ctx->pc; reg_sp = ctx->sp; reg_a = ctx->a;
+	FLG_Z = ctx->z; FLG_N = ctx->n; FLG_H = ctx->h; FLG_C = ctx->c; FLG_IME = ctx->ime;
+	CPUMODE = ctx->mode;
+	delayed_ei = ctx->delayed_ei;
+	cpu_cycles = ctx->cycles;
+}
+
+//ステートセーブ
+void cpu_state_save(struct state_buf *b) {
+	struct cpu_context ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	cpu_context_save(&ctx);
+	state_put(b, &ctx, sizeof(ctx));
+}
+
+void cpu_state_load(struct state_buf *b) {
+	struct cpu_context ctx;
+	state_get(b, &ctx, sizeof(ctx));
+	cpu_context_load(&ctx);
+}
+
+
 void cpu_request_interrupt(uint8_t type) {
 	INTERNAL_IO[IO_IF_R] |= type;
 }
 
 
 int logging_enabled = 0;
-static int delayed_ei = 0;
 
 //超過サイクル数を返す
 int cpu_exec(int cycles) {
@@ -304,6 +385,7 @@ int cpu_exec(int cycles) {
 			cpu_disas_one(REG_PC);
 		}
 
+		PROF_INSTRUCTION();
 		switch(memory_read8(REG_PC)){
 		case 0x00: /* NOP - ---- */			REG_PC+=1;  tick(&cycles, 4); continue;
 		case 0x01: /* LD BC,nn ---- */  	REG_BC=OPERAND16; REG_PC+=3; tick(&cycles, 12); continue;
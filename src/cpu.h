@@ -1,7 +1,19 @@
 #pragma once
 
+#include <inttypes.h>
+#include "gb.h"
+
 extern int master_sent;
+extern GB_LOCAL uint64_t cpu_cycles;
+
+struct state_buf;
+struct cpu_context;
 
+struct cpu_context *cpu_context_new(void);
+void cpu_context_save(struct cpu_context *ctx);
+void cpu_context_load(const struct cpu_context *ctx);
+void cpu_state_save(struct state_buf *b);
+void cpu_state_load(struct state_buf *b);
 void startup(void);
 void cpu_request_interrupt(uint8_t type);
 int cpu_exec(int cycles);
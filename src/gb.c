@@ -0,0 +1,103 @@
+#include "gb.h"
+#include "cpu.h"
+#include "memory.h"
+#include "lcd.h"
+#include "machine.h"
+#include "joypad.h"
+#include "sound.h"
+#include "serial.h"
+#include "movie.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+struct gb {
+	struct cpu_context *cpu;
+	struct memory_context *memory;
+	struct lcd_context *lcd;
+	struct machine_context *machine;
+	struct joypad_context *joypad;
+	struct sound_context *sound;
+	struct serial_context *serial;
+	struct movie_context *movie;
+};
+
+static GB_LOCAL struct gb *current = NULL;
+
+//電源投入直後の状態のインスタンスを作って切り替える
+//このあとmemory_init()とstartup()を呼んで使う(音の合成は無効)
+struct gb *gb_new() {
+	struct gb *gb = malloc(sizeof(struct gb));
+	if(gb == NULL)
+		return NULL;
+	gb->cpu = cpu_context_new();
+	gb->memory = memory_context_new();
+	gb->lcd = lcd_context_new();
+	gb->machine = machine_context_new();
+	gb->joypad = joypad_context_new();
+	gb->sound = sound_context_new();
+	gb->serial = serial_context_new();
+	gb->movie = movie_context_new();
+	if(gb->cpu == NULL || gb->memory == NULL || gb->lcd == NULL || gb->machine == NULL ||
+			gb->joypad == NULL || gb->sound == NULL || gb->serial == NULL || gb->movie == NULL){
+		puts("gb_new: out of memory");
+		free(gb->cpu); free(gb->memory); free(gb->lcd); free(gb->machine);
+		free(gb->joypad); sound_context_free(gb->sound); free(gb->serial); free(gb->movie);
+		free(gb);
+		return NULL;
+	}
+
+	if(current != NULL)
+		gb_switch(NULL);
+	current = gb;
+	cpu_context_load(gb->cpu);
+	memory_context_load(gb->memory);
+	lcd_context_load(gb->lcd);
+	machine_context_load(gb->machine);
+	joypad_context_load(gb->joypad);
+	sound_context_load(gb->sound);
+	serial_context_load(gb->serial);
+	movie_context_load(gb->movie);
+	return gb;
+}
+
+//インスタンスを捨てる(memory_free()とmovie_close()は先にgbを今のインスタンスにして呼んでおく)
+void gb_free(struct gb *gb) {
+	if(gb == NULL)
+		return;
+	if(gb == current)
+		gb_switch(NULL);
+	free(gb->cpu); free(gb->memory); free(gb->lcd); free(gb->machine);
+	free(gb->joypad); sound_context_free(gb->sound); free(gb->serial); free(gb->movie);
+	free(gb);
+}
+
+//今のインスタンスの状態をしまい、gbの状態を読み込む(NULLならしまうだけ)
+void gb_switch(struct gb *gb) {
+	if(gb == current)
+		return;
+	if(current != NULL){
+		cpu_context_save(current->cpu);
+		memory_context_save(current->memory);
+		lcd_context_save(current->lcd);
+		machine_context_save(current->machine);
+		joypad_context_save(current->joypad);
+		sound_context_save(current->sound);
+		serial_context_save(current->serial);
+		movie_context_save(current->movie);
+	}
+	current = gb;
+	if(gb != NULL){
+		cpu_context_load(gb->cpu);
+		memory_context_load(gb->memory);
+		lcd_context_load(gb->lcd);
+		machine_context_load(gb->machine);
+		joypad_context_load(gb->joypad);
+		sound_context_load(gb->sound);
+		serial_context_load(gb->serial);
+		movie_context_load(gb->movie);
+	}
+}
+
+struct gb *gb_current() {
+	return current;
+}
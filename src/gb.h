@@ -0,0 +1,17 @@
+#pragma once
+
+//エミュレータのインスタンス
+//各モジュールの状態はこれまでどおりモジュールのグローバル変数にあり、
+//gb_switch()で「今のインスタンス」の状態を入れ替える(メモリ本体はポインタだけを入れ替える)
+//インスタンスを作らなければ今までどおり1台分として動く
+//これらのグローバル変数(GB_LOCAL)はスレッドごとにあり、今のインスタンスもスレッドごとに選ぶ
+//別々のスレッドで別々のインスタンスを同時に動かせる。1つのインスタンスを別のスレッドへ渡すときは、
+//渡す側でgb_switch(NULL)してしまってから受け取った側でgb_switch()する
+struct gb;
+
+#define GB_LOCAL _Thread_local
+
+struct gb *gb_new(void);
+void gb_free(struct gb *gb);
+void gb_switch(struct gb *gb);
+struct gb *gb_current(void);
@@ -0,0 +1,231 @@
+#include "gbcore.h"
+#include "gb.h"
+#include "cartridge.h"
+#include "cpu.h"
+#include "memory.h"
+#include "lcd.h"
+#include "joypad.h"
+#include "sound.h"
+#include "machine.h"
+#include "state.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+struct gbcore {
+	pthread_mutex_t lock; //1つのインスタンスを複数のスレッドから使うときのため
+	struct gb *gb;
+	struct cartridge *cart;
+	uint8_t *rom;
+	uint8_t *ram;
+	size_t ram_size;
+	uint32_t framebuf[GBCORE_WIDTH * GBCORE_HEIGHT];
+	int16_t *audio; //L/Rインターリーブ、読み出されるまで溜める
+	size_t audio_count, audio_cap; //フレーム数
+	struct state_buf state;
+};
+
+//溜まりすぎたら古い方から捨てる
+static void audio_output(const int16_t *frames, int count, void *userdata) {
+	struct gbcore *core = userdata;
+	if((size_t)count > core->audio_cap){
+		frames += (count - core->audio_cap) * 2;
+		count = core->audio_cap;
+	}
+	if(core->audio_count + count > core->audio_cap){
+		size_t drop = core->audio_count + count - core->audio_cap;
+		memmove(core->audio, core->audio + drop*2, (core->audio_count - drop) * 2 * sizeof(int16_t));
+		core->audio_count -= drop;
+	}
+	memcpy(core->audio + core->audio_count*2, frames, count * 2 * sizeof(int16_t));
+	core->audio_count += count;
+}
+
+static pthread_once_t lcd_once = PTHREAD_ONCE_INIT;
+
+//coreをこのスレッドの今のインスタンスにする
+//呼び出しの間はほかのスレッドから使えないようにし、終わったらrelease_coreで状態をcoreにしまって手放す
+//(手放しておけば次にどのスレッドから呼ばれても続きから動く)
+static void select_core(struct gbcore *core) {
+	pthread_mutex_lock(&core->lock);
+	gb_switch(core->gb);
+}
+
+static void release_core(struct gbcore *core) {
+	gb_switch(NULL);
+	pthread_mutex_unlock(&core->lock);
+}
+
+struct gbcore *gbcore_new(const uint8_t *rom, size_t size, int sample_rate, int flags, int64_t rtc_base) {
+	if(size < 0x150){
+		puts("gbcore: ROM too small");
+		return NULL;
+	}
+	struct gbcore *core = calloc(1, sizeof(struct gbcore));
+	if(core == NULL || (core->rom = malloc(size)) == NULL){
+		perror("gbcore");
+		free(core);
+		return NULL;
+	}
+	memcpy(core->rom, rom, size);
+	pthread_mutex_init(&core->lock, NULL);
+
+	//ヘッダの大きさより短いROMはバンクを切り替えたときにはみ出さないよう0で埋める
+	if((core->cart = cart_init(core->rom)) == NULL)
+		goto err;
+	int rom_size;
+	cart_getrom(core->cart, &rom_size);
+	if((size_t)rom_size > size){
+		uint8_t *p = realloc(core->rom, rom_size);
+		if(p == NULL)
+			goto err;
+		memset(p + size, 0, rom_size - size);
+		core->rom = p;
+		free(core->cart);
+		if((core->cart = cart_init(core->rom)) == NULL)
+			goto err;
+	}
+
+	//RTCは実時間を見ず、rtc_baseから実行したサイクル数だけ進める(同じ入力なら同じ結果になる)
+	int ram_size;
+	time_t t;
+	cart_getram(core->cart, &ram_size, &t);
+	if(ram_size > 0){
+		if((core->ram = calloc(1, ram_size)) == NULL)
+			goto err;
+		core->ram_size = ram_size;
+		cart_setram(core->cart, core->ram, rtc_base);
+	}
+	cart_set_virtual_rtc(core->cart, rtc_base);
+
+	if(sample_rate > 0){
+		core->audio_cap = sample_rate / 4;
+		if((core->audio = malloc(core->audio_cap * 2 * sizeof(int16_t))) == NULL)
+			goto err;
+	}
+
+	pthread_once(&lcd_once, lcd_init);
+	if((core->gb = gb_new()) == NULL)
+		goto err;
+	if(memory_init(core->cart)){
+		gb_free(core->gb);
+		core->gb = NULL;
+		goto err;
+	}
+	if(flags & GBCORE_FLAG_DMG)
+		CGBMODE = 0;
+	if(sample_rate > 0 && sound_init(sample_rate) < 0){
+		memory_free();
+		gb_free(core->gb);
+		core->gb = NULL;
+		goto err;
+	}
+	if(core->audio != NULL)
+		sound_set_output(audio_output, core);
+	startup();
+	machine_wait_lcd_on();
+	gb_switch(NULL);
+	return core;
+err:
+	puts("gbcore_new failed");
+	pthread_mutex_destroy(&core->lock);
+	free(core->audio);
+	free(core->ram);
+	free(core->cart);
+	free(core->rom);
+	free(core);
+	return NULL;
+}
+
+void gbcore_free(struct gbcore *core) {
+	if(core == NULL)
+		return;
+	gb_switch(core->gb);
+	memory_free();
+	gb_free(core->gb);
+	pthread_mutex_destroy(&core->lock);
+	state_buf_free(&core->state);
+	free(core->audio);
+	free(core->ram);
+	free(core->cart);
+	free(core->rom);
+	free(core);
+}
+
+//ボタンのビットが立っていれば押している。次に実行するサイクルから反映される
+void gbcore_set_buttons(struct gbcore *core, uint8_t buttons) {
+	select_core(core);
+	joypad_set_buttons(buttons);
+	release_core(core);
+}
+
+void gbcore_run_frame(struct gbcore *core) {
+	select_core(core);
+	machine_run_frame(core->framebuf);
+	release_core(core);
+}
+
+//cyclesサイクル(4.19MHz)だけ進める。フレームの途中で止まってもよく、終わったフレームの数を返す
+int gbcore_run_cycles(struct gbcore *core, uint64_t cycles) {
+	select_core(core);
+	uint64_t until = cpu_cycles + cycles;
+	int frames = 0;
+	while(cpu_cycles < until)
+		frames += machine_run(core->framebuf, until);
+	release_core(core);
+	return frames;
+}
+
+//160x144のARGB8888。描いている途中のフレームは前のフレームと混ざる
+const uint32_t *gbcore_framebuffer(struct gbcore *core) {
+	return core->framebuf;
+}
+
+//溜まっている音をmax_framesフレーム(1フレームはL/Rの2サンプル)まで取り出し、取り出した数を返す
+size_t gbcore_read_audio(struct gbcore *core, int16_t *dst, size_t max_frames) {
+	pthread_mutex_lock(&core->lock);
+	size_t n = core->audio_count < max_frames ? core->audio_count : max_frames;
+	if(n > 0){
+		memcpy(dst, core->audio, n * 2 * sizeof(int16_t));
+		memmove(core->audio, core->audio + n*2, (core->audio_count - n) * 2 * sizeof(int16_t));
+		core->audio_count -= n;
+	}
+	pthread_mutex_unlock(&core->lock);
+	return n;
+}
+
+//カートリッジのRAM(セーブデータ)。なければNULL
+//起動時は0で埋まっているので、保存してあるものは最初のフレームの前に書き込む
+uint8_t *gbcore_ram(struct gbcore *core, size_t *size) {
+	*size = core->ram_size;
+	return core->ram;
+}
+
+size_t gbcore_state_size(struct gbcore *core) {
+	select_core(core);
+	state_save(&core->state);
+	size_t len = core->state.len;
+	release_core(core);
+	return len;
+}
+
+//ステートセーブの形式はstate.cと同じ。capが足りなければ-1
+int gbcore_save_state(struct gbcore *core, void *buf, size_t cap) {
+	select_core(core);
+	state_save(&core->state);
+	int ret = -1;
+	if(core->state.len <= cap){
+		memcpy(buf, core->state.data, core->state.len);
+		ret = 0;
+	}
+	release_core(core);
+	return ret;
+}
+
+int gbcore_load_state(struct gbcore *core, const void *buf, size_t len) {
+	select_core(core);
+	int ret = state_load(buf, len);
+	release_core(core);
+	return ret;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+#include <inttypes.h>
+
+//組み込み用のコア(libgbcore)
+//SDLを使わず、ROMを渡してフレーム単位(またはサイクル単位)で進め、画面・音・状態を取り出す
+//インスタンスは複数作れ、別々のインスタンスは別々のスレッドで同時に動かせる
+//1つのインスタンスをいくつかのスレッドから呼んでもよい(呼び出しはインスタンスごとに1つずつ順に行う)
+
+struct gbcore;
+
+#define GBCORE_WIDTH  160
+#define GBCORE_HEIGHT 144
+#define GBCORE_FRAME_CYCLES 70224
+#define GBCORE_CLOCK 4194304
+
+//ボタンのビット(joypad.hのBUTTON_*と同じ)
+#define GBCORE_BUTTON_RIGHT  0x01
+#define GBCORE_BUTTON_LEFT   0x02
+#define GBCORE_BUTTON_UP     0x04
+#define GBCORE_BUTTON_DOWN   0x08
+#define GBCORE_BUTTON_A      0x10
+#define GBCORE_BUTTON_B      0x20
+#define GBCORE_BUTTON_SELECT 0x40
+#define GBCORE_BUTTON_START  0x80
+
+#define GBCORE_FLAG_DMG 0x1 //CGB対応のROMでもDMGとして動かす
+
+//romはコピーするので呼び出し後に解放してよい。sample_rateが0なら音は合成しない
+//RTCはrtc_base(UNIX時間)から始まり、実時間ではなく実行したサイクル数だけ進む
+struct gbcore *gbcore_new(const uint8_t *rom, size_t size, int sample_rate, int flags, int64_t rtc_base);
+void gbcore_free(struct gbcore *core);
+void gbcore_set_buttons(struct gbcore *core, uint8_t buttons);
+void gbcore_run_frame(struct gbcore *core);
+int gbcore_run_cycles(struct gbcore *core, uint64_t cycles);
+const uint32_t *gbcore_framebuffer(struct gbcore *core);
+size_t gbcore_read_audio(struct gbcore *core, int16_t *dst, size_t max_frames);
+uint8_t *gbcore_ram(struct gbcore *core, size_t *size);
+size_t gbcore_state_size(struct gbcore *core);
+int gbcore_save_state(struct gbcore *core, void *buf, size_t cap);
+int gbcore_load_state(struct gbcore *core, const void *buf, size_t len);
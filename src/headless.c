@@ -0,0 +1,313 @@
+#include "headless.h"
+#include "machine.h"
+#include "joypad.h"
+#include "pacing.h"
+#include "serial.h"
+#include "gb.h"
+#include "movie.h"
+#include "rewind.h"
+#include "runahead.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//ウィンドウ・オーディオデバイス・イベントループを使わずに実行するモード
+
+struct script_entry {
+	long frame;
+	uint8_t buttons;
+};
+
+struct script {
+	struct script_entry *entries;
+	int len, pos;
+};
+
+//[0]: 自分, [1]: 同じプロセスでつないだ相手(--link-peer)
+static struct script scripts[2];
+
+static const struct {
+	const char *name;
+	uint8_t button;
+} button_names[] = {
+	{"right", BUTTON_RIGHT}, {"left", BUTTON_LEFT}, {"up", BUTTON_UP}, {"down", BUTTON_DOWN},
+	{"a", BUTTON_A}, {"b", BUTTON_B}, {"select", BUTTON_SELECT}, {"start", BUTTON_START},
+};
+
+//"right,a" のようなボタンの並びを解釈する("-"は何も押さない)
+static int parse_buttons(char *str, uint8_t *buttons) {
+	*buttons = 0;
+	if(strcmp(str, "-") == 0)
+		return 0;
+	for(char *tok = strtok(str, ","); tok != NULL; tok = strtok(NULL, ",")){
+		unsigned int i;
+		for(i=0; i<sizeof(button_names)/sizeof(button_names[0]); i++){
+			if(strcmp(tok, button_names[i].name) == 0){
+				*buttons |= button_names[i].button;
+				break;
+			}
+		}
+		if(i == sizeof(button_names)/sizeof(button_names[0]))
+			return -1;
+	}
+	return 0;
+}
+
+//入力スクリプト: 1行に「フレーム番号 ボタン」
+//指定したフレームから押されているボタンの集合が変わる。#以降はコメント
+static int load_script(struct script *script, const char *path) {
+	FILE *fp = fopen(path, "r");
+	if(fp == NULL){
+		perror(path);
+		return -1;
+	}
+
+	char line[256];
+	int lineno = 0, capacity = 0;
+	long prev = -1;
+	while(fgets(line, sizeof(line), fp) != NULL){
+		lineno++;
+		char *comment = strchr(line, '#');
+		if(comment != NULL) *comment = '\0';
+
+		long frame;
+		char buttons[200];
+		int n = sscanf(line, "%ld %199s", &frame, buttons);
+		if(n <= 0)
+			continue;
+		struct script_entry e;
+		if(n != 2 || frame < prev || parse_buttons(buttons, &e.buttons) < 0){
+			printf("%s:%d: invalid input script line\n", path, lineno);
+			fclose(fp);
+			return -1;
+		}
+		e.frame = prev = frame;
+
+		if(script->len == capacity){
+			capacity = capacity ? capacity*2 : 64;
+			struct script_entry *p = realloc(script->entries, capacity*sizeof(struct script_entry));
+			if(p == NULL){
+				fclose(fp);
+				return -1;
+			}
+			script->entries = p;
+		}
+		script->entries[script->len++] = e;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+static void script_step(struct script *script, long frame) {
+	while(script->pos < script->len && script->entries[script->pos].frame <= frame)
+		joypad_set_buttons(script->entries[script->pos++].buttons);
+}
+
+int headless_parse_dump_format(const char *name) {
+	if(strcmp(name, "raw") == 0) return DUMP_FORMAT_RAW;
+	if(strcmp(name, "ppm") == 0) return DUMP_FORMAT_PPM;
+	if(strcmp(name, "png") == 0) return DUMP_FORMAT_PNG;
+	return -1;
+}
+
+static uint32_t crc_table[256];
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t len) {
+	if(crc_table[1] == 0){
+		for(uint32_t n=0; n<256; n++){
+			uint32_t c = n;
+			for(int k=0; k<8; k++)
+				c = (c&1) ? 0xedb88320 ^ (c>>1) : c>>1;
+			crc_table[n] = c;
+		}
+	}
+	crc = ~crc;
+	for(size_t i=0; i<len; i++)
+		crc = crc_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+	p[0] = v>>24; p[1] = v>>16; p[2] = v>>8; p[3] = v;
+}
+
+static void png_chunk(FILE *fp, const char *type, const uint8_t *data, uint32_t len) {
+	uint8_t hdr[8];
+	put_be32(hdr, len);
+	memcpy(hdr+4, type, 4);
+	fwrite(hdr, 1, 8, fp);
+	fwrite(data, 1, len, fp);
+	uint32_t crc = crc32_update(crc32_update(0, (const uint8_t *)type, 4), data, len);
+	uint8_t tail[4];
+	put_be32(tail, crc);
+	fwrite(tail, 1, 4, fp);
+}
+
+//無圧縮(stored)のdeflateブロックでPNGを書く。zlibは使わない
+static void write_png(FILE *fp, const uint8_t *rgb) {
+	static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	fwrite(signature, 1, 8, fp);
+
+	uint8_t ihdr[13];
+	put_be32(ihdr, 160);
+	put_be32(ihdr+4, 144);
+	ihdr[8] = 8;  //bit depth
+	ihdr[9] = 2;  //truecolor
+	ihdr[10] = 0; ihdr[11] = 0; ihdr[12] = 0;
+	png_chunk(fp, "IHDR", ihdr, sizeof(ihdr));
+
+	//各行はフィルタ種別(0)+RGB。1行(481バイト)を1ブロックにする
+	enum { ROW = 1 + 160*3, BLOCK = 5 + ROW };
+	static uint8_t idat[2 + BLOCK*144 + 4];
+	uint8_t *p = idat;
+	uint32_t a = 1, b = 0;
+	*p++ = 0x78; *p++ = 0x01;
+	for(int y=0; y<144; y++){
+		*p++ = (y == 143);
+		*p++ = ROW & 0xff; *p++ = ROW >> 8;
+		*p++ = ~ROW & 0xff; *p++ = (~ROW >> 8) & 0xff;
+		uint8_t *row = p;
+		*p++ = 0;
+		memcpy(p, rgb + y*160*3, 160*3);
+		p += 160*3;
+		for(int i=0; i<ROW; i++){
+			a = (a + row[i]) % 65521;
+			b = (b + a) % 65521;
+		}
+	}
+	put_be32(p, b<<16 | a);
+	p += 4;
+	png_chunk(fp, "IDAT", idat, p - idat);
+	png_chunk(fp, "IEND", NULL, 0);
+}
+
+//フレームバッファ(ARGB8888)をファイルに書き出す
+//rawはフレームバッファそのまま(160x144のネイティブエンディアン32bit)
+int headless_dump_frame(const uint32_t *framebuf, int format, const char *path) {
+	FILE *fp = fopen(path, "wb");
+	if(fp == NULL){
+		perror(path);
+		return -1;
+	}
+
+	static uint8_t rgb[160*144*3];
+	for(int i=0; i<160*144; i++){
+		rgb[i*3] = framebuf[i]>>16;
+		rgb[i*3+1] = framebuf[i]>>8;
+		rgb[i*3+2] = framebuf[i];
+	}
+
+	switch(format){
+	case DUMP_FORMAT_RAW:
+		fwrite(framebuf, sizeof(uint32_t), 160*144, fp);
+		break;
+	case DUMP_FORMAT_PPM:
+		fprintf(fp, "P6\n160 144\n255\n");
+		fwrite(rgb, 1, sizeof(rgb), fp);
+		break;
+	case DUMP_FORMAT_PNG:
+		write_png(fp, rgb);
+		break;
+	}
+
+	if(fclose(fp) != 0){
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+static int dump(struct headless_config *cfg, const uint32_t *framebuf, const char *prefix, long frame) {
+	static const char *ext[] = {"raw", "ppm", "png"};
+	char path[512];
+	snprintf(path, sizeof(path), "%s%s%06ld.%s", cfg->dump_prefix, prefix, frame, ext[cfg->dump_format]);
+	return headless_dump_frame(framebuf, cfg->dump_format, path);
+}
+
+//自分だけを実行し、実行したフレーム数をframesに入れる。書き出しに失敗したら-1
+static int run_single(struct headless_config *cfg, long *frames) {
+	static uint32_t framebuf[160*144];
+	machine_wait_lcd_on();
+
+	int ret = 0;
+	long frame;
+	for(frame=0; cfg->frames == 0 || frame < cfg->frames; frame++){
+		script_step(&scripts[0], frame);
+		rewind_capture();
+		if(movie_playing())
+			machine_run_frame_latched(framebuf, movie_input_rate());
+		else
+			runahead_run_frame(framebuf, 0);
+		if(cfg->dump_every > 0 && (frame+1) % cfg->dump_every == 0 && dump(cfg, framebuf, "", frame+1) < 0){
+			ret = -1;
+			frame++;
+			break;
+		}
+		if(cfg->speed > 0)
+			pacing_wait();
+	}
+	*frames = frame;
+	return ret;
+}
+
+//同じプロセスでつないだ相手と一緒に実行する(フレーム数・速度は自分のフレームで数える)
+//相手の画面は接頭辞に"peer_"を付けて書き出す
+static int run_pair(struct headless_config *cfg, long *frames) {
+	static uint32_t framebufs[2][160*144];
+	int ret = 0;
+	uint32_t *fb[2] = {framebufs[0], framebufs[1]};
+	struct gb *self = gb_current();
+	long frame[2] = {0, 0};
+
+	gb_switch(cfg->peer);
+	machine_wait_lcd_on();
+	script_step(&scripts[1], 0);
+	gb_switch(self);
+	machine_wait_lcd_on();
+	script_step(&scripts[0], 0);
+	serial_pair(self, cfg->peer);
+
+	while(cfg->frames == 0 || frame[0] < cfg->frames){
+		int i = serial_pair_run(fb);
+		frame[i]++;
+		script_step(&scripts[i], frame[i]);
+		if(cfg->dump_every > 0 && frame[i] % cfg->dump_every == 0 && dump(cfg, fb[i], i ? "peer_" : "", frame[i]) < 0){
+			ret = -1;
+			break;
+		}
+		if(i == 0 && cfg->speed > 0)
+			pacing_wait();
+	}
+	gb_switch(self);
+	*frames = frame[0];
+	return ret;
+}
+
+int headless_run(struct headless_config *cfg) {
+	if(cfg->input_script != NULL && load_script(&scripts[0], cfg->input_script) < 0)
+		return -1;
+	if(cfg->peer_input_script != NULL && load_script(&scripts[1], cfg->peer_input_script) < 0)
+		return -1;
+
+	pacing_init(PACING_SYNC_TIMER);
+	if(cfg->speed > 0)
+		pacing_set_speed(cfg->speed);
+
+	uint64_t start = pacing_now_ns();
+	long frame;
+	int ret = cfg->peer != NULL ? run_pair(cfg, &frame) : run_single(cfg, &frame);
+
+	double elapsed = (pacing_now_ns() - start) / 1e9;
+	printf("headless: %ld frames in %.3f s (%.1f fps, %.2fx)\n", frame, elapsed,
+			frame / elapsed, frame / elapsed / (4194304.0/70224.0));
+
+	for(int i=0; i<2; i++){
+		free(scripts[i].entries);
+		scripts[i].entries = NULL;
+		scripts[i].len = scripts[i].pos = 0;
+	}
+	if(ret < 0)
+		puts("headless: stopped because a frame could not be written");
+	return ret;
+}
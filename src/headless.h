@@ -0,0 +1,24 @@
+#pragma once
+
+#include <inttypes.h>
+
+struct gb;
+
+#define DUMP_FORMAT_RAW 0
+#define DUMP_FORMAT_PPM 1
+#define DUMP_FORMAT_PNG 2
+
+struct headless_config {
+	const char *input_script; //NULLなら入力なし
+	int dump_every;           //Nフレームごとにフレームバッファを書き出す(0なら書き出さない)
+	int dump_format;
+	const char *dump_prefix;
+	double speed;             //実機に対する速度(0なら最高速)
+	long frames;              //実行するフレーム数(0なら無制限)
+	struct gb *peer;          //同じプロセスでつなぐ相手(NULLならなし)
+	const char *peer_input_script;
+};
+
+int headless_parse_dump_format(const char *name);
+int headless_dump_frame(const uint32_t *framebuf, int format, const char *path);
+int headless_run(struct headless_config *cfg);
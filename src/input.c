@@ -0,0 +1,84 @@
+#include "input.h"
+#include "joypad.h"
+#include "SDL2/SDL.h"
+#include "SDL2/SDL_gamecontroller.h"
+
+int JOYPAD_INPUTDEVICE;
+
+static SDL_Joystick *joystick;
+static uint8_t axis_x = 0, axis_y = 0; //スティックの方向
+
+int input_init(SDL_Joystick *js) {
+	joystick = js;
+	if(joystick==NULL)
+		JOYPAD_INPUTDEVICE = INPUTDEVICE_KEYBOARD;
+	else
+		JOYPAD_INPUTDEVICE = INPUTDEVICE_JOYSTICK;
+	return 0;
+}
+
+static uint8_t key_to_button(SDL_Keycode key) {
+	switch(key){
+	case RIGHT_KEY: return BUTTON_RIGHT;
+	case LEFT_KEY: return BUTTON_LEFT;
+	case UP_KEY: return BUTTON_UP;
+	case DOWN_KEY: return BUTTON_DOWN;
+	case A_KEY: return BUTTON_A;
+	case B_KEY: return BUTTON_B;
+	case SELECT_KEY: return BUTTON_SELECT;
+	case START_KEY: return BUTTON_START;
+	}
+	return 0;
+}
+
+static uint8_t joybutton_to_button(int jbutton) {
+	switch(jbutton){
+	case JOYSTICK_BUTTON_A: return BUTTON_A;
+	case JOYSTICK_BUTTON_B: return BUTTON_B;
+	case JOYSTICK_BUTTON_SELECT: return BUTTON_SELECT;
+	case JOYSTICK_BUTTON_START: return BUTTON_START;
+	}
+	return 0;
+}
+
+//スティックの軸の値を方向ボタンの押下/解放に変換
+static void axis_changed(uint8_t *state, uint8_t positive, uint8_t negative, int value) {
+	uint8_t next = 0;
+	if(value > JOYSTICK_DEAD_ZONE) next = positive;
+	if(value < -JOYSTICK_DEAD_ZONE) next = negative;
+	if(next == *state)
+		return;
+	if(*state) joypad_input(*state, 0);
+	if(next) joypad_input(next, 1);
+	*state = next;
+}
+
+//表示スレッドで受け取ったSDLのイベントをボタンの状態に反映する
+void input_handle_event(SDL_Event *e) {
+	uint8_t button;
+	switch(e->type){
+	case SDL_KEYDOWN:
+	case SDL_KEYUP:
+		if(JOYPAD_INPUTDEVICE != INPUTDEVICE_KEYBOARD || e->key.repeat)
+			break;
+		if((button = key_to_button(e->key.keysym.sym)) != 0)
+			joypad_input(button, e->type == SDL_KEYDOWN);
+		break;
+	case SDL_JOYAXISMOTION:
+		if(e->jaxis.axis == 0)
+			axis_changed(&axis_x, BUTTON_RIGHT, BUTTON_LEFT, e->jaxis.value);
+		else if(e->jaxis.axis == 1)
+			axis_changed(&axis_y, BUTTON_DOWN, BUTTON_UP, e->jaxis.value);
+		break;
+	case SDL_JOYBUTTONDOWN:
+	case SDL_JOYBUTTONUP:
+		if((button = joybutton_to_button(e->jbutton.button)) != 0)
+			joypad_input(button, e->type == SDL_JOYBUTTONDOWN);
+		break;
+	}
+}
+
+void input_close() {
+	if(joystick!=NULL)
+		SDL_JoystickClose(joystick);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "SDL2/SDL_joystick.h"
+#include "SDL2/SDL_events.h"
+
+//使用するジョイスティックに応じて以下を変更
+//ジョイスティックの感度
+#define JOYSTICK_DEAD_ZONE 8000
+//ボタン番号の対応
+#define JOYSTICK_BUTTON_A 0
+#define JOYSTICK_BUTTON_B 1
+#define JOYSTICK_BUTTON_SELECT 6
+#define JOYSTICK_BUTTON_START 7
+
+#define RIGHT_KEY      SDLK_l
+#define LEFT_KEY       SDLK_h
+#define UP_KEY         SDLK_k
+#define DOWN_KEY       SDLK_j
+#define SELECT_KEY     SDLK_LEFTBRACKET
+#define START_KEY      SDLK_RIGHTBRACKET
+#define A_KEY          SDLK_a
+#define B_KEY          SDLK_s
+#define LOGGING_KEY    SDLK_0
+#define SCREENSHOT_KEY SDLK_1
+#define MUTE_CH1_KEY   SDLK_2
+#define MUTE_CH2_KEY   SDLK_3
+#define MUTE_CH3_KEY   SDLK_4
+#define MUTE_CH4_KEY   SDLK_5
+#define SAVE_STATE_KEY SDLK_6
+#define LOAD_STATE_KEY SDLK_7
+#define REWIND_KEY     SDLK_8
+#define FAST_FORWARD_KEY SDLK_9 //押している間早送り、Shiftと一緒に押すと切り替え
+
+
+extern int JOYPAD_INPUTDEVICE;
+#define INPUTDEVICE_KEYBOARD 0
+#define INPUTDEVICE_JOYSTICK 1
+
+//キーボード・ジョイスティック(SDL)の入力をjoypadのボタンに変換する(表示スレッド側)
+
+int input_init(SDL_Joystick *js);
+void input_handle_event(SDL_Event *e);
+void input_close(void);
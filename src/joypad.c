@@ -1,57 +1,91 @@
 #include "joypad.h"
 #include "memory.h"
-#include "SDL2/SDL.h"
-#include "SDL2/SDL_gamecontroller.h"
+#include "cpu.h"
+#include "movie.h"
+#include "state.h"
+#include "gb.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdatomic.h>
 
-int JOYPAD_INPUTDEVICE;
+//表示スレッド(入力元)が書き、エミュレーションスレッドがjoypad_updateのときだけ読むボタンの状態
+//P1の読み出しはラッチした値を返すだけなので、入力はラッチの時点でしか変わらない
+static atomic_uint input_held;   //いま押されているボタン
+static atomic_uint input_tapped; //前回のラッチ以降に押されたボタン(ラッチまでに離されても1回は押したことにする)
+static uint8_t held = 0; //表示スレッド側
+static GB_LOCAL uint8_t buttons = 0; //押されているボタン(エミュレーションスレッド側)
 
-static SDL_Joystick *joystick;
+//インスタンスごとの状態(gb_switchで入れ替える)
+struct joypad_context {
+	uint8_t buttons;
+};
 
-void joypad_init(SDL_Joystick *js) {
-	joystick = js;
-	if(joystick==NULL)
-		JOYPAD_INPUTDEVICE = INPUTDEVICE_KEYBOARD;
-	else
-		JOYPAD_INPUTDEVICE = INPUTDEVICE_JOYSTICK;
+struct joypad_context *joypad_context_new() {
+	return calloc(1, sizeof(struct joypad_context));
 }
 
-uint8_t joypad_status() {
-	uint8_t p1=INTERNAL_IO[IO_P1_R];
-	int p10=1, p11=1, p12=1, p13=1, p14 = p1&0x10, p15 = p1&0x20;
-	SDL_PumpEvents();
-	if(JOYPAD_INPUTDEVICE == INPUTDEVICE_KEYBOARD){
-		const Uint8 *state=SDL_GetKeyboardState(NULL);
-		if(!p14){
-			if(state[SDL_GetScancodeFromKey(RIGHT_KEY)]) p10=0;
-			if(state[SDL_GetScancodeFromKey(LEFT_KEY)]) p11=0;
-			if(state[SDL_GetScancodeFromKey(UP_KEY)]) p12=0;
-			if(state[SDL_GetScancodeFromKey(DOWN_KEY)]) p13=0;
-		}
-		if(!p15){
-			if(state[SDL_GetScancodeFromKey(A_KEY)]) p10=0;
-			if(state[SDL_GetScancodeFromKey(B_KEY)]) p11=0;
-			if(state[SDL_GetScancodeFromKey(SELECT_KEY)]) p12=0;
-			if(state[SDL_GetScancodeFromKey(START_KEY)]) p13=0;
-		}
-	}else if(JOYPAD_INPUTDEVICE == INPUTDEVICE_JOYSTICK){
-		if(!p14){
-			if(SDL_JoystickGetAxis(joystick, 0) > JOYSTICK_DEAD_ZONE) p10=0;
-			if(SDL_JoystickGetAxis(joystick, 0) < -JOYSTICK_DEAD_ZONE) p11=0;
-			if(SDL_JoystickGetAxis(joystick, 1) < -JOYSTICK_DEAD_ZONE) p12=0;
-			if(SDL_JoystickGetAxis(joystick, 1) > JOYSTICK_DEAD_ZONE) p13=0;
-		}
-		if(!p15){
-			if(SDL_JoystickGetButton(joystick, JOYSTICK_BUTTON_A)) p10=0;
-			if(SDL_JoystickGetButton(joystick, JOYSTICK_BUTTON_B)) p11=0;
-			if(SDL_JoystickGetButton(joystick, JOYSTICK_BUTTON_SELECT)) p12=0;
-			if(SDL_JoystickGetButton(joystick, JOYSTICK_BUTTON_START)) p13=0;
-		}
+void joypad_context_save(struct joypad_context *ctx) {
+	ctx->buttons = buttons;
+}
+
+void joypad_context_load(const struct joypad_context *ctx) {
+	buttons = ctx->buttons;
+}
+
+//ステートセーブ
+void joypad_state_save(struct state_buf *b) {
+	struct joypad_context ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	joypad_context_save(&ctx);
+	state_put(b, &ctx, sizeof(ctx));
+}
+
+void joypad_state_load(struct state_buf *b) {
+	struct joypad_context ctx;
+	state_get(b, &ctx, sizeof(ctx));
+	joypad_context_load(&ctx);
+}
+
+//ボタンの状態を更新し、新たに押されたボタンが選択中の側なら割り込みを要求する
+//入力を記録・再生しているときはここで記録し、再生中は記録されたボタンに差し替える
+static void set_buttons(uint8_t next) {
+	next = movie_input(next);
+	uint8_t pressed = next & ~buttons;
+	buttons = next;
+	if((pressed & BUTTON_DIRECTIONS) && (INTERNAL_IO[IO_P1_R]&0x10)==0)
+		cpu_request_interrupt(INT_JOYPAD);
+	if((pressed & ~BUTTON_DIRECTIONS) && (INTERNAL_IO[IO_P1_R]&0x20)==0)
+		cpu_request_interrupt(INT_JOYPAD);
+}
+
+//ボタンが押された・離された(表示スレッドなど、入力元のスレッドで呼ぶ)
+void joypad_input(uint8_t button, int pressed) {
+	if(pressed){
+		held |= button;
+		atomic_fetch_or(&input_tapped, button);
+	}else{
+		held &= ~button;
 	}
+	atomic_store(&input_held, held);
+}
 
-	return 0x3<<6 | p15<<5 | p14<<4 | p13<<3 | p12<<2 | p11<<1 | p10;
+//エミュレーションスレッドで表示スレッドの入力をラッチする(フレームごと、または--input-rateの間隔で)
+void joypad_update() {
+	set_buttons(atomic_load(&input_held) | atomic_exchange(&input_tapped, 0));
 }
 
-void joypad_close() {
-	if(joystick!=NULL)
-		SDL_JoystickClose(joystick);
+//SDLを使わない入力元(スクリプトなど)からボタンの状態を直接与える
+void joypad_set_buttons(uint8_t state) {
+	set_buttons(state);
+}
+
+uint8_t joypad_status() {
+	uint8_t p1=INTERNAL_IO[IO_P1_R];
+	uint8_t lines = 0;
+	if(!(p1&0x10))
+		lines |= buttons & 0xf;
+	if(!(p1&0x20))
+		lines |= buttons >> 4;
+
+	return 0x3<<6 | (p1&0x30) | (~lines&0xf);
 }
@@ -1,32 +1,27 @@
 #pragma once
 
-#include "SDL2/SDL_joystick.h"
+#include <inttypes.h>
 
-//使用するジョイスティックに応じて以下を変更
-//ジョイスティックの感度
-#define JOYSTICK_DEAD_ZONE 8000
-//ボタン番号の対応
-#define JOYSTICK_BUTTON_A 0
-#define JOYSTICK_BUTTON_B 1
-#define JOYSTICK_BUTTON_SELECT 6
-#define JOYSTICK_BUTTON_START 7
+//ボタンのビット(P1の下位4bitと同じ並び)
+#define BUTTON_RIGHT  0x01
+#define BUTTON_LEFT   0x02
+#define BUTTON_UP     0x04
+#define BUTTON_DOWN   0x08
+#define BUTTON_A      0x10
+#define BUTTON_B      0x20
+#define BUTTON_SELECT 0x40
+#define BUTTON_START  0x80
+#define BUTTON_DIRECTIONS 0x0f
 
-#define RIGHT_KEY      SDLK_l
-#define LEFT_KEY       SDLK_h
-#define UP_KEY         SDLK_k
-#define DOWN_KEY       SDLK_j
-#define SELECT_KEY     SDLK_LEFTBRACKET
-#define START_KEY      SDLK_RIGHTBRACKET
-#define A_KEY          SDLK_a
-#define B_KEY          SDLK_s
-#define LOGGING_KEY    SDLK_0
-#define SCREENSHOT_KEY SDLK_1
+struct state_buf;
+struct joypad_context;
 
-
-extern int JOYPAD_INPUTDEVICE;
-#define INPUTDEVICE_KEYBOARD 0
-#define INPUTDEVICE_JOYSTICK 1
-
-void joypad_init(SDL_Joystick *js);
+struct joypad_context *joypad_context_new(void);
+void joypad_context_save(struct joypad_context *ctx);
+void joypad_context_load(const struct joypad_context *ctx);
+void joypad_state_save(struct state_buf *b);
+void joypad_state_load(struct state_buf *b);
+void joypad_input(uint8_t button, int pressed);
+void joypad_update(void);
+void joypad_set_buttons(uint8_t state);
 uint8_t joypad_status(void);
-void joypad_close(void);
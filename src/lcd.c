@@ -1,24 +1,61 @@
 #include "lcd.h"
 #include "memory.h"
 #include "cpu.h"
-#include "SDL2/SDL.h"
+#include "state.h"
+#include "gb.h"
+#include <stdlib.h>
+#include <string.h>
 
 struct RGB{
-	Uint8 r,g,b;
+	uint8_t r,g,b;
 };
 
 static struct RGB ACTUALCOLOR[4] = {{222,249,208},
 									 {139,192,112},
 									 {68,100,59},
 									 {36,54,31}};
-static Uint32 ABSCOLOR[4];
+static uint32_t ABSCOLOR[4];
 
 #define PALETTE(p,n) ((INTERNAL_IO[p]>>((n)<<1))&0x3)
 #define BGPALETTE(n) ((INTERNAL_IO[IO_BGP_R]>>((n)<<1))&0x3)
 
 #define SPRITECOUNT 40
 
-static int LCDMODE = 2;
+static GB_LOCAL int LCDMODE = 2;
+
+//インスタンスごとの状態(gb_switchで入れ替える)
+struct lcd_context {
+	int mode;
+};
+
+struct lcd_context *lcd_context_new() {
+	struct lcd_context *ctx = malloc(sizeof(struct lcd_context));
+	if(ctx != NULL)
+		ctx->mode = 2;
+	return ctx;
+}
+
+void lcd_context_save(struct lcd_context *ctx) {
+	ctx->mode = LCDMODE;
+}
+
+void lcd_context_load(const struct lcd_context *ctx) {
+	LCDMODE = ctx->mode;
+}
+
+//ステートセーブ
+void lcd_state_save(struct state_buf *b) {
+	struct lcd_context ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	lcd_context_save(&ctx);
+	state_put(b, &ctx, sizeof(ctx));
+}
+
+void lcd_state_load(struct state_buf *b) {
+	struct lcd_context ctx;
+	state_get(b, &ctx, sizeof(ctx));
+	lcd_context_load(&ctx);
+}
 
 uint8_t lcd_get_mode() {
 	return LCDMODE;
@@ -43,33 +80,33 @@ void lcd_change_mode(int mode) {
 	}
 }
 
-static SDL_Surface *surface;
+//画面の画素はARGB8888
+#define ARGB(r,g,b) (0xff000000u | (uint32_t)(r)<<16 | (uint32_t)(g)<<8 | (uint32_t)(b))
 
-void lcd_init(SDL_Surface *s) {
-	surface = s;
+void lcd_init() {
 	for(int i=0; i<4; i++)
-		ABSCOLOR[i] = SDL_MapRGBA(surface->format, ACTUALCOLOR[i].r, ACTUALCOLOR[i].g, ACTUALCOLOR[i].b, 255);
+		ABSCOLOR[i] = ARGB(ACTUALCOLOR[i].r, ACTUALCOLOR[i].g, ACTUALCOLOR[i].b);
 }
 
-void lcd_clear(Uint32 buf[]) {
-	for(int i=0; i<160*144; i++)
-		buf[i] = ABSCOLOR[0];
+void lcd_clear_oneline(uint32_t line[]) {
+	for(int i=0; i<160; i++)
+		line[i] = ABSCOLOR[0];
 }
 
-Uint32 get_color_from_cgbpallete(uint8_t *cpal, int palno, int index){
+uint32_t get_color_from_cgbpallete(uint8_t *cpal, int palno, int index){
 	uint8_t *ptr = cpal + palno*8 + index*2;
-	return SDL_MapRGBA(surface->format, (ptr[0]&0x1f)<<3, (((ptr[0]&0xe0)>>5)|((ptr[1]&0x3)<<3))<<3,
-						 ((ptr[1]&0x7c)>>2)<<3, 255);
+	return ARGB((ptr[0]&0x1f)<<3, (((ptr[0]&0xe0)>>5)|((ptr[1]&0x3)<<3))<<3,
+						 ((ptr[1]&0x7c)>>2)<<3);
 }
 
-void lcd_draw_background_oneline(Uint32 buf[]) {
+void lcd_draw_background_oneline(uint32_t line[]) {
 	uint8_t lcdc = INTERNAL_IO[IO_LCDC_R];
 	uint8_t y = INTERNAL_IO[IO_LY_R];
 	uint8_t *tilemap = INTERNAL_VRAM+(((lcdc&0x8)?0x9c00:0x9800)-V_INTERNAL_VRAM);
 	uint8_t *tiledata = INTERNAL_VRAM+(((lcdc&0x10)?0x8000:0x9000)-V_INTERNAL_VRAM);
 	uint8_t scx=INTERNAL_IO[IO_SCX_R], scy=INTERNAL_IO[IO_SCY_R];
 
-	int current_index = y*160;
+	int current_index = 0;
 	int map_y=(y+scy)%256, tile_y=map_y>>3;
 	int in_y=map_y%8;
 
@@ -87,7 +124,7 @@ void lcd_draw_background_oneline(Uint32 buf[]) {
 			int in_x=map_x%8;
 			uint8_t lower=thisdata[in_y*2], upper=thisdata[in_y*2+1];
 			int palno = tileattr&0x7;
-			buf[current_index++] = get_color_from_cgbpallete(COLORPALETTE_BG, palno,
+			line[current_index++] = get_color_from_cgbpallete(COLORPALETTE_BG, palno,
 											((upper>>(7-in_x))&0x1)<<1 | ((lower>>(7-in_x))&0x1));
 		}
 	}else{
@@ -101,20 +138,20 @@ void lcd_draw_background_oneline(Uint32 buf[]) {
 
 			int in_x=map_x%8;
 			uint8_t lower=thisdata[in_y*2], upper=thisdata[in_y*2+1];
-			buf[current_index++] = ABSCOLOR[BGPALETTE(((upper>>(7-in_x))&0x1)<<1 | ((lower>>(7-in_x))&0x1))];
+			line[current_index++] = ABSCOLOR[BGPALETTE(((upper>>(7-in_x))&0x1)<<1 | ((lower>>(7-in_x))&0x1))];
 		}
 	}
 }
 
 
-void lcd_draw_window_oneline(Uint32 buf[]) {
+void lcd_draw_window_oneline(uint32_t line[]) {
 	uint8_t lcdc = INTERNAL_IO[IO_LCDC_R];
 	uint8_t y = INTERNAL_IO[IO_LY_R];
 	uint8_t *tilemap = INTERNAL_VRAM+(((lcdc&0x40)?0x9c00:0x9800)-V_INTERNAL_VRAM);
 	uint8_t *tiledata = INTERNAL_VRAM+(((lcdc&0x10)?0x8000:0x9000)-V_INTERNAL_VRAM);
 	int wx=INTERNAL_IO[IO_WX_R]-7, wy=INTERNAL_IO[IO_WY_R];
 
-	int current_index = y*160;
+	int current_index = 0;
 	int map_y=y-wy, in_y=map_y%8;
 	int tile_y=map_y>>3;
 	int map_x=-wx;
@@ -134,7 +171,7 @@ void lcd_draw_window_oneline(Uint32 buf[]) {
 			int in_x=map_x%8;
 			uint8_t lower=thisdata[in_y*2], upper=thisdata[in_y*2+1];
 			int palno = tileattr&0x7;
-			buf[current_index] = get_color_from_cgbpallete(COLORPALETTE_BG, palno,
+			line[current_index] = get_color_from_cgbpallete(COLORPALETTE_BG, palno,
 											((upper>>(7-in_x))&0x1)<<1 | ((lower>>(7-in_x))&0x1));
 		}
 	}else{
@@ -149,12 +186,12 @@ void lcd_draw_window_oneline(Uint32 buf[]) {
 
 			int in_x=map_x%8;
 			uint8_t lower=thisdata[in_y*2], upper=thisdata[in_y*2+1];
-			buf[current_index] = ABSCOLOR[BGPALETTE(((upper>>(7-in_x))&0x1)<<1 | ((lower>>(7-in_x))&0x1))];
+			line[current_index] = ABSCOLOR[BGPALETTE(((upper>>(7-in_x))&0x1)<<1 | ((lower>>(7-in_x))&0x1))];
 		}
 	}
 }
 
-void lcd_draw_sprite_oneline(Uint32 buf[]) {
+void lcd_draw_sprite_oneline(uint32_t line[]) {
 	uint8_t lcdc = INTERNAL_IO[IO_LCDC_R];
 	uint8_t scr_y = INTERNAL_IO[IO_LY_R];
 	uint8_t *tiledata = INTERNAL_VRAM+(0x8000-V_INTERNAL_VRAM);
@@ -196,9 +233,9 @@ void lcd_draw_sprite_oneline(Uint32 buf[]) {
 				for(int x=0; x<8; x++){
 					int scr_x=(flags&0x20)?(sp_x+(7-x)):(sp_x+x);
 					if(scr_x<0 || scr_x>=160) continue;
-					Uint32 cnum = ((upper>>(7-x))&0x1)<<1 | ((lower>>(7-x))&0x1);
+					uint32_t cnum = ((upper>>(7-x))&0x1)<<1 | ((lower>>(7-x))&0x1);
 					if(cnum!=0)
-						buf[scr_y*160 + scr_x] = get_color_from_cgbpallete(COLORPALETTE_SP, palno, cnum); //0なら透過
+						line[scr_x] = get_color_from_cgbpallete(COLORPALETTE_SP, palno, cnum); //0なら透過
 				}
 			}else{
 				//8x8 mode
@@ -208,9 +245,9 @@ void lcd_draw_sprite_oneline(Uint32 buf[]) {
 				for(int x=0; x<8; x++){
 					int scr_x=(flags&0x20)?(sp_x+(7-x)):(sp_x+x);
 					if(scr_x<0 || scr_x>=160) continue;
-					Uint32 cnum = ((upper>>(7-x))&0x1)<<1 | ((lower>>(7-x))&0x1);
+					uint32_t cnum = ((upper>>(7-x))&0x1)<<1 | ((lower>>(7-x))&0x1);
 					if(cnum!=0)
-						buf[scr_y*160 + scr_x] = get_color_from_cgbpallete(COLORPALETTE_SP, palno, cnum); //0なら透過
+						line[scr_x] = get_color_from_cgbpallete(COLORPALETTE_SP, palno, cnum); //0なら透過
 				}
 			}
 		}
@@ -232,9 +269,9 @@ void lcd_draw_sprite_oneline(Uint32 buf[]) {
 				for(int x=0; x<8; x++){
 					int scr_x=(flags&0x20)?(sp_x+(7-x)):(sp_x+x);
 					if(scr_x<0 || scr_x>=160) continue;
-					Uint32 cnum = ((upper>>(7-x))&0x1)<<1 | ((lower>>(7-x))&0x1);
-					if(cnum!=0 && (!(flags&0x80) || buf[scr_y*160 + scr_x]==ABSCOLOR[BGPALETTE(0)]))
-						buf[scr_y*160 + scr_x] = ABSCOLOR[PALETTE(palette_addr, cnum)]; //0なら透過
+					uint32_t cnum = ((upper>>(7-x))&0x1)<<1 | ((lower>>(7-x))&0x1);
+					if(cnum!=0 && (!(flags&0x80) || line[scr_x]==ABSCOLOR[BGPALETTE(0)]))
+						line[scr_x] = ABSCOLOR[PALETTE(palette_addr, cnum)]; //0なら透過
 				}
 			}else{
 				//8x8 mode
@@ -244,9 +281,9 @@ void lcd_draw_sprite_oneline(Uint32 buf[]) {
 				for(int x=0; x<8; x++){
 					int scr_x=(flags&0x20)?(sp_x+(7-x)):(sp_x+x);
 					if(scr_x<0 || scr_x>=160) continue;
-					Uint32 cnum = ((upper>>(7-x))&0x1)<<1 | ((lower>>(7-x))&0x1);
-					if(cnum!=0 && (!(flags&0x80) || buf[scr_y*160 + scr_x]==ABSCOLOR[BGPALETTE(0)]))
-						buf[scr_y*160 + scr_x] = ABSCOLOR[PALETTE(palette_addr, cnum)]; //0なら透過
+					uint32_t cnum = ((upper>>(7-x))&0x1)<<1 | ((lower>>(7-x))&0x1);
+					if(cnum!=0 && (!(flags&0x80) || line[scr_x]==ABSCOLOR[BGPALETTE(0)]))
+						line[scr_x] = ABSCOLOR[PALETTE(palette_addr, cnum)]; //0なら透過
 				}
 			}
 		}
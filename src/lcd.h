@@ -1,16 +1,24 @@
 #pragma once
 
-#include "SDL2/SDL.h"
+#include <inttypes.h>
 
 #define LCDMODE_HBLANK 0
 #define LCDMODE_VBLANK 1
 #define LCDMODE_SEARCHOAM 2
 #define LCDMODE_TRANSFERRING 3
 
-void lcd_init(SDL_Surface *surface);
+struct state_buf;
+struct lcd_context;
+
+struct lcd_context *lcd_context_new(void);
+void lcd_context_save(struct lcd_context *ctx);
+void lcd_context_load(const struct lcd_context *ctx);
+void lcd_state_save(struct state_buf *b);
+void lcd_state_load(struct state_buf *b);
+void lcd_init(void);
 uint8_t lcd_get_mode(void);
 void lcd_change_mode(int mode);
-void lcd_clear(Uint32 buf[]);
-void lcd_draw_background_oneline(Uint32 buf[]);
-void lcd_draw_window_oneline(Uint32 buf[]);
-void lcd_draw_sprite_oneline(Uint32 buf[]);
+void lcd_clear_oneline(uint32_t line[]);
+void lcd_draw_background_oneline(uint32_t line[]);
+void lcd_draw_window_oneline(uint32_t line[]);
+void lcd_draw_sprite_oneline(uint32_t line[]);
@@ -0,0 +1,223 @@
+#include "machine.h"
+#include "cpu.h"
+#include "memory.h"
+#include "lcd.h"
+#include "sound.h"
+#include "joypad.h"
+#include "movie.h"
+#include "state.h"
+#include "prof.h"
+#include "gb.h"
+#include <string.h>
+#include <stdlib.h>
+
+#define INC_LY ((++INTERNAL_IO[IO_LY_R]==INTERNAL_IO[IO_LYC_R] && INTERNAL_IO[IO_STAT_R]&0x40)?cpu_request_interrupt(INT_LCDSTAT):0)
+#define RST_LY (((INTERNAL_IO[IO_LY_R]=0)==INTERNAL_IO[IO_LYC_R] && INTERNAL_IO[IO_STAT_R]&0x40)?cpu_request_interrupt(INT_LCDSTAT):0)
+
+//1フレームを途中で止めて再開できるよう、どこまで進んだかを状態として持つ
+#define PHASE_START 0    //フレームの始め
+#define PHASE_OAM 1      //モード2
+#define PHASE_TRANSFER 2 //モード3
+#define PHASE_HBLANK 3   //モード0
+#define PHASE_VBLANK 4   //LY=144~153の1ライン
+#define PHASE_OFF 5      //LCDがOFFのフレーム
+
+static GB_LOCAL int phase = PHASE_START;
+static GB_LOCAL int phase_left = 0; //フェーズの残りサイクル(0以下なら前のフェーズの超過分)
+static GB_LOCAL int frame_lcd_on = 0;
+
+//インスタンスごとの状態(gb_switchで入れ替える)
+struct machine_context {
+	int phase;
+	int phase_left;
+	int frame_lcd_on;
+};
+
+struct machine_context *machine_context_new() {
+	return calloc(1, sizeof(struct machine_context));
+}
+
+void machine_context_save(struct machine_context *ctx) {
+	ctx->phase = phase;
+	ctx->phase_left = phase_left;
+	ctx->frame_lcd_on = frame_lcd_on;
+}
+
+void machine_context_load(const struct machine_context *ctx) {
+	phase = ctx->phase;
+	phase_left = ctx->phase_left;
+	frame_lcd_on = ctx->frame_lcd_on;
+}
+
+//ステートセーブ
+void machine_state_save(struct state_buf *b) {
+	struct machine_context ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	machine_context_save(&ctx);
+	state_put(b, &ctx, sizeof(ctx));
+}
+
+void machine_state_load(struct state_buf *b) {
+	struct machine_context ctx;
+	state_get(b, &ctx, sizeof(ctx));
+	machine_context_load(&ctx);
+}
+
+void machine_wait_lcd_on() {
+	while(!(INTERNAL_IO[IO_LCDC_R]&0x80)){
+		cpu_exec(4);
+	}
+}
+
+static void hblank_dma() {
+	uint16_t src=(INTERNAL_IO[IO_HDMA1_R]<<8) | INTERNAL_IO[IO_HDMA2_R];
+	uint16_t dst=(INTERNAL_IO[IO_HDMA3_R]<<8) | INTERNAL_IO[IO_HDMA4_R];
+	//transfer 0x10 bytes
+	for(int i=0; i<0x10; i++,src++,dst++)
+		memory_write8(dst, memory_read8(src));
+	int remaining = (INTERNAL_IO[IO_HDMA5_R]&0x7f)/0x10-1;
+	remaining -= 0x10;
+	if(remaining == 0)
+		INTERNAL_IO[IO_HDMA5_R] = 0xff;
+	else
+		INTERNAL_IO[IO_HDMA5_R] = (remaining+1)*0x10;
+	INTERNAL_IO[IO_HDMA1_R] = src>>8;
+	INTERNAL_IO[IO_HDMA2_R] = src&0xff;
+	INTERNAL_IO[IO_HDMA3_R] = dst>>8;
+	INTERNAL_IO[IO_HDMA4_R] = dst&0xff;
+}
+
+//今のフェーズを、cpu_cyclesがuntilに達するまで実行する。フェーズが終われば1
+//命令の途中では止まらないので、続けて呼べば1回で実行したときと同じになる
+static int run_phase(uint64_t until) {
+	while(phase_left > 0){
+		if(cpu_cycles >= until)
+			return 0;
+		int n = phase_left;
+		if(until - cpu_cycles < (uint64_t)n)
+			n = until - cpu_cycles;
+		PROF_BEGIN(PROF_CPU);
+		phase_left -= n + cpu_exec(n);
+		PROF_END();
+	}
+	return 1;
+}
+
+static void start_phase(int next, int cycles) {
+	phase = next;
+	phase_left += cycles;
+}
+
+//V-Blankのライン(LCDがONのときだけ)。残っていなければフレームの終わり
+static int start_vblank() {
+	if(INTERNAL_IO[IO_LCDC_R]&0x80 && INTERNAL_IO[IO_LY_R]<=153){
+		start_phase(PHASE_VBLANK, /*456*/468); //464 ... for street fighter 2
+		return 0;
+	}
+	sound_end_frame();
+	movie_end_frame();
+	phase = PHASE_START;
+	return 1;
+}
+
+//cpu_cyclesがuntilに達するかフレームが終わるまで実行し、framebuf(160x144)に描画する
+//フレームが終わったら1を返す。framebufがNULLなら描画だけを省略する
+int machine_run(uint32_t *framebuf, uint64_t until) {
+	for(;;){
+		switch(phase){
+		case PHASE_START:
+			frame_lcd_on = INTERNAL_IO[IO_LCDC_R]&0x80;
+			if(frame_lcd_on){
+				//LCDがON
+				RST_LY;
+				lcd_change_mode(2);
+				start_phase(PHASE_OAM, 80);
+			}else{
+				if(framebuf != NULL)
+					for(int i=0; i<160*144; i++)
+						framebuf[i] = 0xffffffff;
+				start_phase(PHASE_OFF, 70224);
+			}
+			break;
+		case PHASE_OAM:
+			if(!run_phase(until))
+				return 0;
+			lcd_change_mode(3);
+			start_phase(PHASE_TRANSFER, 172);
+			break;
+		case PHASE_TRANSFER:
+			if(!run_phase(until))
+				return 0;
+			if(framebuf != NULL){
+				PROF_BEGIN(PROF_PPU);
+				uint32_t *line = framebuf + INTERNAL_IO[IO_LY_R]*160;
+				if(INTERNAL_IO[IO_LCDC_R]&0x1)
+					lcd_draw_background_oneline(line);
+				else
+					lcd_clear_oneline(line);
+
+				if(INTERNAL_IO[IO_LCDC_R]&0x20)
+					lcd_draw_window_oneline(line);
+				if(INTERNAL_IO[IO_LCDC_R]&0x2)
+					lcd_draw_sprite_oneline(line);
+				PROF_END();
+			}
+			lcd_change_mode(0);
+			start_phase(PHASE_HBLANK, 204);
+			break;
+		case PHASE_HBLANK:
+			if(!run_phase(until))
+				return 0;
+			//H-Blank DMA
+			if(CGBMODE && (INTERNAL_IO[IO_HDMA5_R]&0x80) == 0)
+				hblank_dma();
+
+			INC_LY;
+			if(INTERNAL_IO[IO_LY_R]<=143){
+				lcd_change_mode(2);
+				start_phase(PHASE_OAM, 80);
+			}else{
+				lcd_change_mode(LCDMODE_VBLANK);
+				if(start_vblank())
+					return 1;
+			}
+			break;
+		case PHASE_OFF:
+			if(!run_phase(until))
+				return 0;
+			if(start_vblank())
+				return 1;
+			break;
+		case PHASE_VBLANK:
+			if(!run_phase(until))
+				return 0;
+			INC_LY;
+			if(INTERNAL_IO[IO_LY_R]<=153)
+				start_phase(PHASE_VBLANK, 468);
+			else if(start_vblank())
+				return 1;
+			break;
+		}
+	}
+}
+
+//1フレーム(70224サイクル)を実行し、framebuf(160x144)に描画する
+//framebufがNULLなら描画だけを省略する(CPU・タイマー等のエミュレーションは同じ)
+//LCDがOFFのときは0を返す(framebufは白で塗られる)
+int machine_run_frame(uint32_t *framebuf) {
+	while(!machine_run(framebuf, UINT64_MAX))
+		;
+	return frame_lcd_on;
+}
+
+//フレームの始めと、フレームをn等分した区切りごとにjoypad_updateで入力をラッチしながら1フレームを実行する
+//入力の記録と再生で同じサイクルにラッチするよう、両方ともこれを使う
+int machine_run_frame_latched(uint32_t *framebuf, int n) {
+	joypad_update();
+	if(n <= 1)
+		return machine_run_frame(framebuf);
+	uint64_t slice = 70224 / n;
+	while(!machine_run(framebuf, cpu_cycles + slice))
+		joypad_update();
+	return frame_lcd_on;
+}
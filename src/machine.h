@@ -0,0 +1,16 @@
+#pragma once
+
+#include <inttypes.h>
+
+struct state_buf;
+struct machine_context;
+
+struct machine_context *machine_context_new(void);
+void machine_context_save(struct machine_context *ctx);
+void machine_context_load(const struct machine_context *ctx);
+void machine_state_save(struct state_buf *b);
+void machine_state_load(struct state_buf *b);
+void machine_wait_lcd_on(void);
+int machine_run(uint32_t *framebuf, uint64_t until);
+int machine_run_frame(uint32_t *framebuf);
+int machine_run_frame_latched(uint32_t *framebuf, int n);
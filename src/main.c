@@ -1,20 +1,34 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
 
 #include "cpu.h"
 #include "cartridge.h"
 #include "memory.h"
 #include "lcd.h"
 #include "joypad.h"
+#include "input.h"
 #include "sound.h"
+#include "audio.h"
 #include "serial.h"
+#include "machine.h"
+#include "triplebuf.h"
+#include "pacing.h"
+#include "headless.h"
+#include "wavwriter.h"
+#include "gb.h"
+#include "movie.h"
+#include "state.h"
+#include "rewind.h"
+#include "runahead.h"
 
 #include "SDL2/SDL.h"
 #include "SDL2/SDL_ttf.h"
@@ -25,13 +39,12 @@
 static int SCREEN_WIDTH = 160;
 static int SCREEN_HEIGHT = 144;
 
-#define TIMER_START(t) ((t)=SDL_GetTicks())
-#define TIMER_GET(t) (SDL_GetTicks()-(t))
 
 #define MIN(x,y) ((x)<(y)?(x):(y))
 
 static SDL_Window *main_window;
 static SDL_Renderer *window_renderer;
+static SDL_Texture *screen_texture;
 
 static uint8_t *open_rom(char* filename) {
 	int fd;
@@ -90,6 +103,61 @@ static uint8_t *open_ram(char* filename, unsigned int size, time_t *t) {
 	return data;
 }
 
+//ROMとセーブデータ(ramnameがNULLなら ROM名.save)を開く
+//titleにはヘッダのタイトルが入る(0xb+1バイト)
+static struct cartridge *load_cartridge(char *romname, char *ramname, char *title) {
+	uint8_t *rom = open_rom(romname);
+	if(rom==NULL){
+		printf("open_rom failed\n");
+		return NULL;
+	}
+
+	struct cartridge *cart = cart_init(rom);
+	if(cart == NULL){
+		printf("cart_init failed\n");
+		return NULL;
+	}
+
+	static const int ramsize_table[] = {0,2048,8192,8192*4,8192*16,8192*8};
+	struct gb_carthdr *hdr = cart_header(cart);
+
+  memset(title, 0, 0xb + 1);
+  for(int i = 0; i < 0xb; i++)
+    if(isprint(hdr->title[i]))
+      title[i] = hdr->title[i];
+    else
+      break;
+
+  printf("title: %.16s\ncgbflag: 0x%X\ncarttype: 0x%X\nromsize: 0x%X\nramsize: 0x%X(%dKB)\n",
+   title, hdr->cgbflag, hdr->carttype, hdr->romsize, hdr->ramsize, ramsize_table[hdr->ramsize]);
+
+	if(hdr->ramsize!=0){
+		char buf[256];
+		char *fname;
+		if(ramname == NULL){
+			strncpy(buf, romname, 256);
+			strncat(buf, ".save", 256-strlen(buf));
+			fname=buf;
+		}else{
+			fname=ramname;
+		}
+		time_t t;
+
+		int ramsize = ramsize_table[hdr->ramsize];
+		if(hdr->carttype==CARTTYPE_MBC2 || hdr->carttype==CARTTYPE_MBC2_BATT)
+			ramsize = 512;
+
+		uint8_t *ram = open_ram(fname, ramsize, &t);
+		if(ram == NULL){
+			puts("open_ram failed");
+			return NULL;
+		}
+		cart_setram(cart, ram, t);
+	}
+
+	return cart;
+}
+
 static int sdl_init() {
 	if( SDL_Init( SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_AUDIO | SDL_INIT_GAMECONTROLLER ) < 0 ){
 		printf( "SDL Init failed : %s\n", SDL_GetError() );
@@ -107,6 +175,18 @@ static int sdl_init() {
 			printf( "SDL_CreateRenderer failed : %s\n", SDL_GetError() );
 			return -1;
 		}
+
+		//160x144の論理サイズを整数倍(-zの値)で拡大して表示
+		SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0");
+		SDL_RenderSetLogicalSize(window_renderer, 160, 144);
+		SDL_RenderSetIntegerScale(window_renderer, SDL_TRUE);
+
+		//表示用のテクスチャ(毎フレーム作り直さない)
+		screen_texture = SDL_CreateTexture(window_renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 160, 144);
+		if(screen_texture == NULL){
+			printf( "SDL_CreateTexture failed : %s\n", SDL_GetError() );
+			return -1;
+		}
 	}
 
 	SDL_Joystick *joystick = NULL;
@@ -116,21 +196,204 @@ static int sdl_init() {
 
 	if(joystick == NULL){
 		printf("Keyboard mode\n");
-		joypad_init(NULL);
 	}else{
 		printf("Gamepad mode\n");
-		joypad_init(joystick);
+	}
+	if(input_init(joystick) < 0){
+		printf("input_init failed\n");
+		return -1;
 	}
 
 	return 0;
 }
 
 
-#define INC_LY ((++INTERNAL_IO[IO_LY_R]==INTERNAL_IO[IO_LYC_R] && INTERNAL_IO[IO_STAT_R]&0x40)?cpu_request_interrupt(INT_LCDSTAT):0)
-#define RST_LY (((INTERNAL_IO[IO_LY_R]=0)==INTERNAL_IO[IO_LYC_R] && INTERNAL_IO[IO_STAT_R]&0x40)?cpu_request_interrupt(INT_LCDSTAT):0)
-
 extern int logging_enabled;
 
+static struct triplebuf frames;
+static atomic_int emu_quit;
+static atomic_int emu_frame_count;
+static atomic_int emu_skip_count;
+static int frameskip_max = 0; //0ならフレームスキップしない
+static struct gb *console = NULL; //表示するインスタンス(準備ができたらエミュレーションスレッドへ渡す)
+static struct gb *peer = NULL; //同じプロセスでつないだ相手(表示はしない)
+static int input_rate = 1; //1フレームに入力をラッチする回数
+
+//ステートセーブ・ロードはホットキーで要求し、エミュレーションスレッドがフレームの区切りで行う
+#define STATE_REQUEST_SAVE 1
+#define STATE_REQUEST_LOAD 2
+static atomic_int state_request;
+static char state_path[512];
+static int state_disabled = 0; //通信中・入力の記録中は使えない
+static atomic_int rewinding; //巻き戻しキーが押されている
+
+//早送り(キーを押している間か、切り替えでオンの間)
+#define FAST_FORWARD_HELD 1
+#define FAST_FORWARD_TOGGLED 2
+static atomic_int fast_forward;
+static double fast_forward_speed = 0; //実機に対する倍率、0なら無制限
+
+static void handle_state_request(int req) {
+	uint64_t start = pacing_now_ns();
+	int ret = req == STATE_REQUEST_SAVE ? state_save_file(state_path) : state_load_file(state_path);
+	if(ret == 0)
+		printf("state: %s %s (%.0f us)\n", req == STATE_REQUEST_SAVE ? "saved" : "loaded",
+				state_path, (pacing_now_ns() - start) / 1e3);
+}
+
+//1フレーム実行する。相手がいれば自分のフレームが終わるまで2台を交互に進める
+static void run_frame(uint32_t *framebuf) {
+	if(peer == NULL){
+		runahead_run_frame(framebuf, input_rate);
+		return;
+	}
+	joypad_update();
+	uint32_t *fb[2] = {framebuf, NULL};
+	while(serial_pair_run(fb) != 0)
+		;
+}
+
+//エミュレーションスレッド
+//表示スレッドとは独立に、Game Boyのフレームレートでフレームを生成する
+static int emu_thread(void *unused) {
+	(void)unused;
+	gb_switch(console);
+	if(peer != NULL){
+		struct gb *self = gb_current();
+		gb_switch(peer);
+		machine_wait_lcd_on();
+		gb_switch(self);
+		serial_pair(self, peer);
+	}
+	machine_wait_lcd_on();
+
+	int skipped = 0;
+	int ff = 0;
+	uint64_t last_publish_ns = 0;
+	while(!atomic_load(&emu_quit)){
+		if((atomic_load(&fast_forward) != 0) != ff){
+			ff = !ff;
+			pacing_set_fast_forward(ff ? fast_forward_speed : -1);
+			audio_set_fast_forward(ff);
+		}
+		int req = atomic_exchange(&state_request, 0);
+		if(req != 0)
+			handle_state_request(req);
+		//巻き戻し中は1フレーム前の状態に戻してからそのフレームを実行して表示する
+		if(!atomic_load(&rewinding) || rewind_step() < 0)
+			rewind_capture();
+		//早送り中は実時間で1フレーム分経つごとに1回だけ描画して表示する
+		//(表示側の速さに関係なく、CPUコアの速さだけで進む)
+		if(ff){
+			uint64_t now = pacing_now_ns();
+			if(now - last_publish_ns >= 1000000000ULL * 70224 / 4194304){
+				run_frame(triplebuf_back(&frames));
+				triplebuf_publish(&frames);
+				last_publish_ns = now;
+			}else{
+				run_frame(NULL);
+			}
+		//期限に遅れていれば描画と表示だけを省略する(連続frameskip_maxフレームまで)
+		}else if(skipped < frameskip_max && pacing_lateness_ns() > PACING_LATE_THRESHOLD_NS){
+			run_frame(NULL);
+			skipped++;
+			atomic_fetch_add(&emu_skip_count, 1);
+		}else{
+			run_frame(triplebuf_back(&frames));
+			triplebuf_publish(&frames);
+			skipped = 0;
+		}
+		atomic_fetch_add(&emu_frame_count, 1);
+		pacing_wait();
+	}
+
+	gb_switch(NULL);
+	return 0;
+}
+
+enum {
+	OPT_SYNC = 0x100,
+	OPT_FRAMESKIP,
+	OPT_HEADLESS,
+	OPT_INPUT_SCRIPT,
+	OPT_DUMP_EVERY,
+	OPT_DUMP_FORMAT,
+	OPT_DUMP_PREFIX,
+	OPT_SPEED,
+	OPT_FRAMES,
+	OPT_AUDIO_BUFFER,
+	OPT_NO_AUDIO,
+	OPT_AUDIO_CAPTURE,
+	OPT_LINK_LEAD,
+	OPT_LINK,
+	OPT_LINK_PEER,
+	OPT_PEER_SAVE,
+	OPT_PEER_INPUT_SCRIPT,
+	OPT_INPUT_RATE,
+	OPT_MOVIE_RECORD,
+	OPT_MOVIE_PLAY,
+	OPT_LOAD_STATE,
+	OPT_SAVE_STATE,
+	OPT_REWIND,
+	OPT_RUN_AHEAD,
+	OPT_FAST_FORWARD,
+};
+
+//音のキャプチャ(エミュレーションスレッドで合成したブロックをそのまま書き出す)
+static void capture_tap(const int16_t *const channels[4], const int16_t *mixed, int count, void *unused) {
+	(void)channels; (void)unused;
+	wavwriter_write(mixed, count);
+}
+
+static int capture_start(const char *path) {
+	if(sound_sample_rate() == 0 && sound_init(SOUND_SAMPLE_RATE) < 0)
+		return -1;
+	const char *ext = strrchr(path, '.');
+	int raw = ext != NULL && (strcmp(ext, ".raw") == 0 || strcmp(ext, ".pcm") == 0);
+	if(wavwriter_open(path, sound_sample_rate(), raw) < 0)
+		return -1;
+	sound_set_tap(capture_tap, NULL);
+	return 0;
+}
+
+static int capture_stop() {
+	sound_set_tap(NULL, NULL);
+	if(wavwriter_close() < 0){
+		puts("audio capture failed: the file is incomplete");
+		return -1;
+	}
+	return 0;
+}
+
+static const struct option long_options[] = {
+	{"sync", required_argument, NULL, OPT_SYNC},
+	{"frameskip", required_argument, NULL, OPT_FRAMESKIP},
+	{"headless", no_argument, NULL, OPT_HEADLESS},
+	{"input-script", required_argument, NULL, OPT_INPUT_SCRIPT},
+	{"dump-every", required_argument, NULL, OPT_DUMP_EVERY},
+	{"dump-format", required_argument, NULL, OPT_DUMP_FORMAT},
+	{"dump-prefix", required_argument, NULL, OPT_DUMP_PREFIX},
+	{"speed", required_argument, NULL, OPT_SPEED},
+	{"frames", required_argument, NULL, OPT_FRAMES},
+	{"audio-buffer", required_argument, NULL, OPT_AUDIO_BUFFER},
+	{"no-audio", no_argument, NULL, OPT_NO_AUDIO},
+	{"audio-capture", required_argument, NULL, OPT_AUDIO_CAPTURE},
+	{"link-lead", required_argument, NULL, OPT_LINK_LEAD},
+	{"link", required_argument, NULL, OPT_LINK},
+	{"link-peer", required_argument, NULL, OPT_LINK_PEER},
+	{"peer-save", required_argument, NULL, OPT_PEER_SAVE},
+	{"peer-input-script", required_argument, NULL, OPT_PEER_INPUT_SCRIPT},
+	{"input-rate", required_argument, NULL, OPT_INPUT_RATE},
+	{"movie-record", required_argument, NULL, OPT_MOVIE_RECORD},
+	{"movie-play", required_argument, NULL, OPT_MOVIE_PLAY},
+	{"load-state", required_argument, NULL, OPT_LOAD_STATE},
+	{"save-state", required_argument, NULL, OPT_SAVE_STATE},
+	{"rewind", required_argument, NULL, OPT_REWIND},
+	{"run-ahead", required_argument, NULL, OPT_RUN_AHEAD},
+	{"fast-forward", required_argument, NULL, OPT_FAST_FORWARD},
+	{NULL, 0, NULL, 0}
+};
+
 extern char	*optarg;
 extern int	optind, opterr;
 int main(int argc, char *argv[]) {
@@ -141,8 +404,21 @@ int main(int argc, char *argv[]) {
 	int port = 35902, zoom = 1;
 	int has_ram=0, has_host = 0;
 	int tcpmode = 0; //0..使用しない/1..サーバ/2..クライアント
+	int transport = SERIAL_TRANSPORT_TCP;
 	int force_dmg = 0;
-	while((result=getopt(argc, argv, "dlcs:p:h:z:"))!=-1){
+	uint32_t link_lead = SERIAL_LEAD_DEFAULT;
+	const char *movie_record_path = NULL, *movie_play_path = NULL;
+	const char *load_state_path = NULL, *save_state_path = NULL;
+	int rewind_mb = 0;
+	int run_ahead = 0;
+	int sync_mode = PACING_SYNC_TIMER;
+	int audio_buffer = AUDIO_BUFFER_DEFAULT;
+	int no_audio = 0;
+	const char *audio_capture = NULL;
+	char *peer_rom = NULL, *peer_save = NULL;
+	int headless = 0;
+	struct headless_config hcfg = {NULL, 0, DUMP_FORMAT_PPM, "frame_", 0, 0, NULL, NULL};
+	while((result=getopt_long(argc, argv, "dlcs:p:h:z:", long_options, NULL))!=-1){
 		switch(result){
 		case 'l':
 			//tcp listen(server)
@@ -174,6 +450,138 @@ int main(int argc, char *argv[]) {
 			//DMG mode(monochrome)
 			force_dmg = 1;
 			break;
+		case OPT_SYNC:
+			//フレームの同期先(timer/audio/display)
+			if((sync_mode = pacing_parse_mode(optarg)) < 0){
+				printf("unknown sync mode: %s\n", optarg);
+				exit(-1);
+			}
+			break;
+		case OPT_FRAMESKIP:
+			//連続して描画を省略してよい最大フレーム数
+			frameskip_max = atoi(optarg);
+			break;
+		case OPT_HEADLESS:
+			//ウィンドウ・オーディオ・入力デバイスを使わずに実行
+			headless = 1;
+			break;
+		case OPT_INPUT_SCRIPT:
+			hcfg.input_script = optarg;
+			break;
+		case OPT_DUMP_EVERY:
+			hcfg.dump_every = atoi(optarg);
+			break;
+		case OPT_DUMP_FORMAT:
+			if((hcfg.dump_format = headless_parse_dump_format(optarg)) < 0){
+				printf("unknown dump format: %s\n", optarg);
+				exit(-1);
+			}
+			break;
+		case OPT_DUMP_PREFIX:
+			hcfg.dump_prefix = optarg;
+			break;
+		case OPT_SPEED:
+			//実機に対する速度の倍率(0なら最高速)
+			hcfg.speed = atof(optarg);
+			break;
+		case OPT_FRAMES:
+			hcfg.frames = atol(optarg);
+			break;
+		case OPT_AUDIO_BUFFER:
+			//オーディオデバイスのバッファのサンプル数
+			audio_buffer = atoi(optarg);
+			if(audio_buffer < 64 || audio_buffer > 16384 || (audio_buffer & (audio_buffer-1))){
+				printf("audio buffer must be a power of two between 64 and 16384: %s\n", optarg);
+				exit(-1);
+			}
+			break;
+		case OPT_NO_AUDIO:
+			//オーディオデバイスを開かず、音の合成もしない
+			no_audio = 1;
+			break;
+		case OPT_AUDIO_CAPTURE:
+			//音をファイルに書き出す(.raw/.pcmならヘッダなし、それ以外はWAV)
+			audio_capture = optarg;
+			break;
+		case OPT_LINK_LEAD:
+			//通信相手より先に進んでよいサイクル数(両方で同じ値にする)
+			{
+				long lead = atol(optarg);
+				if(lead < 1024 || lead > 0x10000000){
+					printf("link lead must be between 1024 and 268435456 cycles: %s\n", optarg);
+					exit(-1);
+				}
+				serial_set_lead(lead);
+				link_lead = lead;
+			}
+			break;
+		case OPT_LINK:
+			//通信路(unix/shmは同じマシン上のみ。-hは不要)
+			transport = serial_parse_transport(optarg);
+			if(transport < 0){
+				printf("unknown link transport: %s\n", optarg);
+				exit(-1);
+			}
+			serial_set_transport(transport);
+			break;
+		case OPT_LINK_PEER:
+			//同じプロセスでもう1台を動かし、通信ケーブルでつなぐ
+			peer_rom = optarg;
+			break;
+		case OPT_PEER_SAVE:
+			peer_save = optarg;
+			break;
+		case OPT_PEER_INPUT_SCRIPT:
+			hcfg.peer_input_script = optarg;
+			break;
+		case OPT_INPUT_RATE:
+			//1フレームに入力をラッチする回数
+			input_rate = atoi(optarg);
+			if(input_rate < 1 || input_rate > 154){
+				printf("input rate must be between 1 and 154: %s\n", optarg);
+				exit(-1);
+			}
+			break;
+		case OPT_MOVIE_RECORD:
+			//入力を記録する
+			movie_record_path = optarg;
+			break;
+		case OPT_MOVIE_PLAY:
+			//記録した入力を再生する
+			movie_play_path = optarg;
+			break;
+		case OPT_LOAD_STATE:
+			//起動時に状態を読み込む
+			load_state_path = optarg;
+			break;
+		case OPT_SAVE_STATE:
+			//終了時に状態を書き出す
+			save_state_path = optarg;
+			break;
+		case OPT_REWIND:
+			//巻き戻しの記録に使うメモリ(MB)
+			rewind_mb = atoi(optarg);
+			if(rewind_mb < 0 || rewind_mb > 4096){
+				printf("rewind buffer must be between 0 and 4096 MB: %s\n", optarg);
+				exit(-1);
+			}
+			break;
+		case OPT_RUN_AHEAD:
+			//先読みするフレーム数
+			run_ahead = atoi(optarg);
+			if(run_ahead < 0 || run_ahead > 8){
+				printf("run-ahead must be between 0 and 8 frames: %s\n", optarg);
+				exit(-1);
+			}
+			break;
+		case OPT_FAST_FORWARD:
+			//早送りの倍率
+			fast_forward_speed = atof(optarg);
+			if(fast_forward_speed < 0 || (fast_forward_speed > 0 && fast_forward_speed < 1)){
+				printf("fast-forward must be 0 (unlimited) or at least 1: %s\n", optarg);
+				exit(-1);
+			}
+			break;
 		case ':':
 		case '?':
 			exit(-1);
@@ -187,58 +595,61 @@ int main(int argc, char *argv[]) {
 		return -1;
 	}
 	romname = argv[0];
-
-
-	SCREEN_HEIGHT *= zoom;
-	SCREEN_WIDTH *= zoom;
-
-	uint8_t *rom = open_rom(romname);
-	if(rom==NULL){
-		printf("open_rom failed\n");
+	if(peer_rom != NULL && tcpmode != 0){
+		puts("--link-peer cannot be used with -l/-c");
 		return -1;
 	}
-
-	struct cartridge *cart = cart_init(rom);
-	if(cart == NULL){
-		printf("cart_init failed\n");
+	//2台を交互に進めるserial_pair_runは入力をラッチしない(フレームの初めに1回読むだけ)
+	if(peer_rom != NULL && input_rate != 1){
+		puts("--input-rate cannot be used with --link-peer");
 		return -1;
 	}
+	//ヘッドレスの入力はスクリプトがフレームの初めに与えるだけで、ラッチする入力元がない
+	if(headless && input_rate != 1){
+		puts("--input-rate cannot be used with --headless");
+		return -1;
+	}
+	if(movie_record_path != NULL && movie_play_path != NULL){
+		puts("--movie-record and --movie-play cannot be used together");
+		return -1;
+	}
+	if((movie_record_path != NULL || movie_play_path != NULL) && (tcpmode != 0 || peer_rom != NULL)){
+		puts("movies cannot be used with -l/-c/--link-peer");
+		return -1;
+	}
+	if(movie_play_path != NULL && hcfg.input_script != NULL){
+		puts("--movie-play cannot be used with --input-script");
+		return -1;
+	}
+	state_disabled = tcpmode != 0 || peer_rom != NULL || movie_record_path != NULL || movie_play_path != NULL;
+	if(state_disabled && (load_state_path != NULL || save_state_path != NULL || rewind_mb > 0 || run_ahead > 0)){
+		puts("save states, rewind and run-ahead cannot be used with -l/-c/--link-peer or movies");
+		return -1;
+	}
+	snprintf(state_path, sizeof(state_path), "%s.state", romname);
 
-	static const int ramsize_table[] = {0,2048,8192,8192*4,8192*16,8192*8};
-	struct gb_carthdr *hdr = cart_header(cart);
-
-  char title[0xb + 1] = {'\0'};
-  for(int i = 0; i < 0xb; i++)
-    if(isprint(hdr->title[i]))
-      title[i] = hdr->title[i];
-    else
-      break;
-
-  printf("title: %.16s\ncgbflag: 0x%X\ncarttype: 0x%X\nromsize: 0x%X\nramsize: 0x%X(%dKB)\n",
-   title, hdr->cgbflag, hdr->carttype, hdr->romsize, hdr->ramsize, ramsize_table[hdr->ramsize]);
 
-	if(hdr->ramsize!=0){
-		char buf[256];
-		char *fname;
-		if(!has_ram){
-			strncpy(buf, romname, 256);
-			strncat(buf, ".save", 256-strlen(buf));
-			fname=buf;
-		}else{
-			fname=ramname;
-		}
-		time_t t;
+	SCREEN_HEIGHT *= zoom;
+	SCREEN_WIDTH *= zoom;
 
-		int ramsize = ramsize_table[hdr->ramsize];
-		if(hdr->carttype==CARTTYPE_MBC2 || hdr->carttype==CARTTYPE_MBC2_BATT)
-			ramsize = 512;
+	//状態はスレッドごとにあるので、インスタンスを作ってエミュレーションスレッドへ渡せるようにする
+	if((console = gb_new()) == NULL)
+		return -1;
+	char title[0xb + 1];
+	struct cartridge *cart = load_cartridge(romname, has_ram ? ramname : NULL, title);
+	if(cart == NULL)
+		return -1;
 
-		uint8_t *ram = open_ram(fname, ramsize, &t);
-		if(ram == NULL){
-			puts("open_ram failed");
+	//記録・再生するときは電源投入時の状態を揃える(セーブデータ・RTC・DMGモード・通信の待ち時間)
+	if(movie_record_path != NULL &&
+			movie_record(movie_record_path, cart, force_dmg ? MOVIE_FLAG_DMG : 0, input_rate, link_lead) < 0)
+		return -1;
+	if(movie_play_path != NULL){
+		int flags;
+		if(movie_play(movie_play_path, cart, &flags, &input_rate, &link_lead) < 0)
 			return -1;
-		}
-		cart_setram(cart, ram, t);
+		force_dmg = flags & MOVIE_FLAG_DMG;
+		serial_set_lead(link_lead);
 	}
 
 	if(memory_init(cart)){
@@ -259,7 +670,7 @@ int main(int argc, char *argv[]) {
 		break;
 	case 2:
 		//client
-		if(has_host){
+		if(has_host || transport != SERIAL_TRANSPORT_TCP){
 			if(serial_clientinit(hostname, port) < 0){
 				puts("network error");
 			}
@@ -271,30 +682,103 @@ int main(int argc, char *argv[]) {
 
 	startup();
 
-	static Uint32 bitmap[160*144];
-	SDL_Surface *bitmap_surface=SDL_CreateRGBSurfaceFrom((void *)bitmap, 160, 144, 32, 160*4,
-	       0x00ff0000,0x0000ff00,0x000000ff,0xff000000);
-	lcd_init(bitmap_surface);
+	if(peer_rom != NULL){
+		//同じセーブデータを2台で共有しないようにする
+		char buf[256];
+		if(peer_save == NULL && strcmp(peer_rom, romname) == 0){
+			snprintf(buf, sizeof(buf), "%s.peer.save", peer_rom);
+			peer_save = buf;
+		}
+		struct gb *self = gb_current();
+		char peer_title[0xb + 1];
+		struct cartridge *peer_cart = load_cartridge(peer_rom, peer_save, peer_title);
+		if(peer_cart == NULL)
+			return -1;
+		if((peer = gb_new()) == NULL)
+			return -1;
+		if(memory_init(peer_cart)){
+			puts("memory_init failed");
+			return -1;
+		}
+		if(force_dmg)
+			CGBMODE = 0;
+		startup();
+		gb_switch(self);
+		hcfg.peer = peer;
+	}
+
+	if(load_state_path != NULL && state_load_file(load_state_path) < 0)
+		return -1;
+	if(rewind_mb > 0 && rewind_init((size_t)rewind_mb << 20) < 0)
+		return -1;
+	runahead_set_frames(run_ahead);
+
+	if(headless){
+		lcd_init();
+		if(audio_capture != NULL && capture_start(audio_capture) < 0)
+			return -1;
+		int ret = headless_run(&hcfg);
+		if(save_state_path != NULL && state_save_file(save_state_path) < 0)
+			ret = -1;
+		rewind_print_stats();
+		rewind_free();
+		runahead_print_stats();
+		if(movie_close() < 0)
+			ret = -1;
+		if(audio_capture != NULL && capture_stop() < 0)
+			ret = -1;
+		memory_free();
+		if(tcpmode>0){
+			serial_print_stats();
+			serial_close();
+		}
+		return ret;
+	}
 
 	SDL_Event e;
-	Uint32 fps_timer;
-	int frame_count=0;
 
 	if(sdl_init() < 0){
 		printf("sdl_init failed: %s\n", SDL_GetError());
 		return -1;
 	}
 
-	sound_init();
+	lcd_init();
+
+	if(triplebuf_init(&frames, 160, 144) < 0){
+		puts("triplebuf_init failed");
+		return -1;
+	}
+
+	if(no_audio){
+		if(sync_mode == PACING_SYNC_AUDIO){
+			puts("--sync=audio cannot be used with --no-audio");
+			return -1;
+		}
+	}else if(audio_init(audio_buffer) < 0){
+		//オーディオの時計がないと同期できない。それ以外は音なしで続ける
+		if(sync_mode == PACING_SYNC_AUDIO){
+			puts("--sync=audio needs an audio device");
+			return -1;
+		}
+		puts("audio: no device, continuing as with --no-audio");
+		no_audio = 1;
+	}
+	if(audio_capture != NULL && capture_start(audio_capture) < 0)
+		return -1;
 
-	TIMER_START(fps_timer);
+	pacing_init(sync_mode);
 
-	while(!(INTERNAL_IO[IO_LCDC_R]&0x80)){
-		cpu_exec(4);
+	gb_switch(NULL);
+	SDL_Thread *emu = SDL_CreateThread(emu_thread, "emu_thread", NULL);
+	if(emu == NULL){
+		printf("SDL_CreateThread failed: %s\n", SDL_GetError());
+		return -1;
 	}
 
+	//表示スレッド: イベント処理と描画のみ行う
 	int quit = 0;
-	int over=0;
+	int last_count = 0;
+	int title_frames = 0, title_skips = 0;
 	while(!quit){
 		while(SDL_PollEvent(&e)!=0){
 			switch(e.type){
@@ -303,120 +787,118 @@ int main(int argc, char *argv[]) {
 				break;
 			case SDL_KEYDOWN:
 				switch(e.key.keysym.sym){
-				case RIGHT_KEY:
-				case LEFT_KEY:
-				case UP_KEY:
-				case DOWN_KEY:
-					if((INTERNAL_IO[IO_P1_R]&0x10)==0)
-						cpu_request_interrupt(INT_JOYPAD);
-					break;
-				case A_KEY:
-				case B_KEY:
-				case SELECT_KEY:
-				case START_KEY:
-					if((INTERNAL_IO[IO_P1_R]&0x20)==0)
-						cpu_request_interrupt(INT_JOYPAD);
-					break;
 				case SCREENSHOT_KEY:
-					SDL_SaveBMP(bitmap_surface, "screenshot.bmp");
+					{
+						SDL_Surface *shot = SDL_CreateRGBSurfaceWithFormatFrom(triplebuf_front(&frames), 160, 144, 32, 160*4, SDL_PIXELFORMAT_ARGB8888);
+						if(shot != NULL){
+							SDL_SaveBMP(shot, "screenshot.bmp");
+							SDL_FreeSurface(shot);
+						}
+					}
 					break;
 				case LOGGING_KEY:
 					logging_enabled = 1;
 					break;
+				case SAVE_STATE_KEY:
+				case LOAD_STATE_KEY:
+					//ROM名.stateに保存・読み込み
+					if(state_disabled)
+						puts("state: not available while linked or using a movie");
+					else
+						atomic_store(&state_request, e.key.keysym.sym == SAVE_STATE_KEY ? STATE_REQUEST_SAVE : STATE_REQUEST_LOAD);
+					break;
+				case REWIND_KEY:
+					if(!e.key.repeat)
+						atomic_store(&rewinding, 1);
+					break;
+				case FAST_FORWARD_KEY:
+					if(e.key.repeat)
+						break;
+					if(e.key.keysym.mod & KMOD_SHIFT)
+						atomic_fetch_xor(&fast_forward, FAST_FORWARD_TOGGLED);
+					else
+						atomic_fetch_or(&fast_forward, FAST_FORWARD_HELD);
+					break;
+				case MUTE_CH1_KEY:
+				case MUTE_CH2_KEY:
+				case MUTE_CH3_KEY:
+				case MUTE_CH4_KEY:
+					//チャンネルごとのミュートを切り替える
+					sound_set_mute(sound_get_mute() ^ 1<<(e.key.keysym.sym - MUTE_CH1_KEY));
+					break;
 				default:
 					break;
 				}
 				break;
-			case SDL_JOYAXISMOTION:
-				if(abs(e.jaxis.value) > JOYSTICK_DEAD_ZONE)
-					cpu_request_interrupt(INT_JOYPAD);
-				break;
-			case SDL_JOYBUTTONDOWN:
-				switch(e.jbutton.button){
-				case JOYSTICK_BUTTON_A:
-				case JOYSTICK_BUTTON_B:
-				case JOYSTICK_BUTTON_SELECT:
-				case JOYSTICK_BUTTON_START:
-					cpu_request_interrupt(INT_JOYPAD);
-				}
+			case SDL_KEYUP:
+				if(e.key.keysym.sym == REWIND_KEY)
+					atomic_store(&rewinding, 0);
+				if(e.key.keysym.sym == FAST_FORWARD_KEY)
+					atomic_fetch_and(&fast_forward, ~FAST_FORWARD_HELD);
 				break;
 			}
+			input_handle_event(&e);
 		}
 
 		if(quit) break;
 
-		int avgfps=frame_count/(TIMER_GET(fps_timer)/1000+1);
-		if(frame_count%60==0){
-			static char wndtitle[64];
-			snprintf(wndtitle, 64, "%.16s  FPS = %d %s", title, avgfps, serial_linked()?"Linked":"");
+		int frame_count = atomic_load(&emu_frame_count);
+		if(frame_count/60 != last_count/60){
+			struct pacing_stats st;
+			pacing_get_stats(&st);
+			int skip_count = atomic_load(&emu_skip_count);
+			static char wndtitle[128];
+			if(frameskip_max > 0)
+				snprintf(wndtitle, 128, "%.16s  FPS = %.2f jitter %.2fms skip %d/%d %s%s", title, st.fps, st.interval_stddev_ns/1e6,
+						skip_count - title_skips, frame_count - title_frames, serial_linked()?"Linked":"", atomic_load(&fast_forward)?" >>":"");
+			else
+				snprintf(wndtitle, 128, "%.16s  FPS = %.2f jitter %.2fms %s%s", title, st.fps, st.interval_stddev_ns/1e6,
+						serial_linked()?"Linked":"", atomic_load(&fast_forward)?" >>":"");
 			SDL_SetWindowTitle(main_window, wndtitle);
+			title_frames = frame_count;
+			title_skips = skip_count;
 		}
 
-		SDL_SetRenderDrawColor(window_renderer, 0xff, 0xff, 0xff, 0xff);
-		SDL_RenderClear(window_renderer);
-
-		if(INTERNAL_IO[IO_LCDC_R]&0x80){
-			//LCDがON
-			RST_LY;
-			lcd_clear(bitmap);
-			while(INTERNAL_IO[IO_LY_R]<=143){
-				lcd_change_mode(2); over=cpu_exec(80-over);
-				lcd_change_mode(3); over=cpu_exec(172-over);
-
-				if(INTERNAL_IO[IO_LCDC_R]&0x1)
-					lcd_draw_background_oneline(bitmap);
-
-				if(INTERNAL_IO[IO_LCDC_R]&0x20)
-					lcd_draw_window_oneline(bitmap);
-				if(INTERNAL_IO[IO_LCDC_R]&0x2)
-					lcd_draw_sprite_oneline(bitmap);
-
-
-				lcd_change_mode(0); over=cpu_exec(204-over);
-
-				//H-Blank DMA
-				if(CGBMODE && (INTERNAL_IO[IO_HDMA5_R]&0x80) == 0){
-					uint16_t src=(INTERNAL_IO[IO_HDMA1_R]<<8) | INTERNAL_IO[IO_HDMA2_R];
-					uint16_t dst=(INTERNAL_IO[IO_HDMA3_R]<<8) | INTERNAL_IO[IO_HDMA4_R];
-					//transfer 0x10 bytes
-					for(int i=0; i<0x10; i++,src++,dst++)
-						memory_write8(dst, memory_read8(src));
-					int remaining = (INTERNAL_IO[IO_HDMA5_R]&0x7f)/0x10-1;
-					remaining -= 0x10;
-					if(remaining == 0)
-						INTERNAL_IO[IO_HDMA5_R] = 0xff;
-					else
-						INTERNAL_IO[IO_HDMA5_R] = (remaining+1)*0x10;
-					INTERNAL_IO[IO_HDMA1_R] = src>>8;
-					INTERNAL_IO[IO_HDMA2_R] = src&0xff;
-					INTERNAL_IO[IO_HDMA3_R] = dst>>8;
-					INTERNAL_IO[IO_HDMA4_R] = dst&0xff;
-				}
-
-				INC_LY;
-			}
-			SDL_Texture *texture = SDL_CreateTextureFromSurface(window_renderer, bitmap_surface);
-			SDL_RenderCopy(window_renderer, texture, NULL, NULL);
-			SDL_DestroyTexture(texture);
-
-			lcd_change_mode(LCDMODE_VBLANK);
-		}else{
-			over=cpu_exec(70224-over);
+		if(triplebuf_consume(&frames)){
+			SDL_UpdateTexture(screen_texture, NULL, triplebuf_front(&frames), 160*4);
+		}else if(frame_count == last_count){
+			//新しいフレームがなければ少し待つ
+			SDL_Delay(1);
+			continue;
 		}
+		last_count = frame_count;
 
+		SDL_SetRenderDrawColor(window_renderer, 0xff, 0xff, 0xff, 0xff);
+		SDL_RenderClear(window_renderer);
+		SDL_RenderCopy(window_renderer, screen_texture, NULL, NULL);
 		SDL_RenderPresent(window_renderer);
-		frame_count++;
-
-		if(INTERNAL_IO[IO_LCDC_R]&0x80){
-			while(INTERNAL_IO[IO_LY_R]<=153){
-				over=cpu_exec(/*456*/468-over); //464 ... for street fighter 2
-				INC_LY;
-			}
-		}
+		pacing_display_presented();
 	}
 
-	joypad_close();
-
+	atomic_store(&emu_quit, 1);
+	pacing_stop();
+	serial_shutdown();
+	SDL_WaitThread(emu, NULL);
+	gb_switch(console);
+	int ret = 0;
+	if(save_state_path != NULL && state_save_file(save_state_path) < 0)
+		ret = -1;
+	if(audio_capture != NULL && capture_stop() < 0)
+		ret = -1;
+	pacing_print_stats();
+	rewind_print_stats();
+	runahead_print_stats();
+	rewind_free();
+	if(!no_audio)
+		audio_print_stats();
+	if(frameskip_max > 0)
+		printf("frameskip: %d of %d frames skipped\n", atomic_load(&emu_skip_count), atomic_load(&emu_frame_count));
+
+	input_close();
+
+	triplebuf_free(&frames);
+	SDL_DestroyTexture(screen_texture);
+	screen_texture = NULL;
 	SDL_DestroyRenderer(window_renderer);
 	window_renderer = NULL;
 	SDL_DestroyWindow(main_window);
@@ -424,10 +906,14 @@ int main(int argc, char *argv[]) {
 
 	SDL_Quit();
 
+	if(movie_close() < 0)
+		ret = -1;
 	memory_free();
 
-	if(tcpmode>0)
+	if(tcpmode>0){
+		serial_print_stats();
 		serial_close();
+	}
 
-	return 0;
+	return ret;
 }
@@ -5,38 +5,132 @@
 #include "joypad.h"
 #include "sound.h"
 #include "serial.h"
+#include "state.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
-#include "SDL2/SDL_keyboard.h"
-#include "SDL2/SDL_scancode.h"
-#include "SDL2/SDL_gamecontroller.h"
 
 #define IO_DIV_R 0x04
 #define IO_TIMA_R 0x05
 
 #define MAX(x,y) ((x)<(y)?(y):(x))
 
-uint8_t*			INTERNAL_VRAM = NULL;
-static uint8_t*		INTERNAL_VRAM_VARIABLE = NULL;
-static uint8_t*		INTERNAL_WRAM = NULL;
-static uint8_t*		INTERNAL_WRAM_VARIABLE = NULL;
-uint8_t*			INTERNAL_OAM = NULL;
-static uint8_t*		INTERNAL_RESERVED = NULL;
-uint8_t*			INTERNAL_IO = NULL;
-static uint8_t*		INTERNAL_STACK = NULL;
-uint8_t*			COLORPALETTE_BG = NULL;
-uint8_t*			COLORPALETTE_SP = NULL;
+GB_LOCAL uint8_t*			INTERNAL_VRAM = NULL;
+static GB_LOCAL uint8_t*		INTERNAL_VRAM_VARIABLE = NULL;
+static GB_LOCAL uint8_t*		INTERNAL_WRAM = NULL;
+static GB_LOCAL uint8_t*		INTERNAL_WRAM_VARIABLE = NULL;
+GB_LOCAL uint8_t*			INTERNAL_OAM = NULL;
+static GB_LOCAL uint8_t*		INTERNAL_RESERVED = NULL;
+GB_LOCAL uint8_t*			INTERNAL_IO = NULL;
+static GB_LOCAL uint8_t*		INTERNAL_STACK = NULL;
+GB_LOCAL uint8_t*			COLORPALETTE_BG = NULL;
+GB_LOCAL uint8_t*			COLORPALETTE_SP = NULL;
 
-uint32_t DIV;
-uint16_t TIMA;
-int CGBMODE;
-int SERIALSTATE = 0;
-int timer_remaining, timer_interval;
-int serial_remaining, serial_interval = 0;
+GB_LOCAL uint32_t DIV;
+GB_LOCAL uint16_t TIMA;
+GB_LOCAL int CGBMODE;
+GB_LOCAL int SERIALSTATE = 0;
+GB_LOCAL int timer_remaining, timer_interval;
+GB_LOCAL int serial_interval = 0;
 
 
-static struct cartridge *cart;
+static GB_LOCAL struct cartridge *cart;
 
+//インスタンスごとの状態(gb_switchで入れ替える)
+//メモリ本体は確保したポインタを入れ替えるだけ
+struct memory_context {
+	uint8_t *vram, *vram_variable, *wram, *wram_variable, *oam, *reserved, *io, *stack;
+	uint8_t *palette_bg, *palette_sp;
+	uint32_t div;
+	uint16_t tima;
+	int cgbmode, serialstate, timer_remaining, timer_interval, serial_interval;
+	struct cartridge *cart;
+};
+
+struct memory_context *memory_context_new() {
+	return calloc(1, sizeof(struct memory_context));
+}
+
+void memory_context_save(struct memory_context *ctx) {
+	ctx->vram = INTERNAL_VRAM; ctx->vram_variable = INTERNAL_VRAM_VARIABLE;
+	ctx->wram = INTERNAL_WRAM; ctx->wram_variable = INTERNAL_WRAM_VARIABLE;
+	ctx->oam = INTERNAL_OAM; ctx->reserved = INTERNAL_RESERVED;
+	ctx->io = INTERNAL_IO; ctx->stack = INTERNAL_STACK;
+	ctx->palette_bg = COLORPALETTE_BG; ctx->palette_sp = COLORPALETTE_SP;
+	ctx->div = DIV; ctx->tima = TIMA;
+	ctx->cgbmode = CGBMODE; ctx->serialstate = SERIALSTATE;
+	ctx->timer_remaining = timer_remaining; ctx->timer_interval = timer_interval;
+	ctx->serial_interval = serial_interval;
+	ctx->cart = cart;
+}
+
+void memory_context_load(const struct memory_context *ctx) {
+	INTERNAL_VRAM = ctx->vram; INTERNAL_VRAM_VARIABLE = ctx->vram_variable;
+	INTERNAL_WRAM = ctx->wram; INTERNAL_WRAM_VARIABLE = ctx->wram_variable;
+	INTERNAL_OAM = ctx->oam; INTERNAL_RESERVED = ctx->reserved;
+	INTERNAL_IO = ctx->io; INTERNAL_STACK = ctx->stack;
+	COLORPALETTE_BG = ctx->palette_bg; COLORPALETTE_SP = ctx->palette_sp;
+	DIV = ctx->div; TIMA = ctx->tima;
+	CGBMODE = ctx->cgbmode; SERIALSTATE = ctx->serialstate;
+	timer_remaining = ctx->timer_remaining; timer_interval = ctx->timer_interval;
+	serial_interval = ctx->serial_interval;
+	cart = ctx->cart;
+}
+
+//ステートセーブ
+//バンクを切り替える領域は先頭からの位置で書く。配列の大きさは確保したとき(CGBかどうか)で決まる
+#define STATE_ARRAYS(X) \
+	X(INTERNAL_VRAM, cgb ? 0x4000 : 0x2000) \
+	X(INTERNAL_WRAM, cgb ? 0x8000 : 0x2000) \
+	X(INTERNAL_OAM, 0xa0) \
+	X(INTERNAL_RESERVED, 0x60) \
+	X(INTERNAL_IO, 0x100) \
+	X(INTERNAL_STACK, 0x7f) \
+	X(COLORPALETTE_BG, cgb ? 0x40 : 0) \
+	X(COLORPALETTE_SP, cgb ? 0x40 : 0)
+
+void memory_state_save(struct state_buf *b) {
+	int cgb = COLORPALETTE_BG != NULL;
+	uint32_t vram_bank = INTERNAL_VRAM_VARIABLE - INTERNAL_VRAM;
+	uint32_t wram_bank = INTERNAL_WRAM_VARIABLE - INTERNAL_WRAM;
+	state_put(b, &DIV, sizeof(DIV));
+	state_put(b, &TIMA, sizeof(TIMA));
+	state_put(b, &CGBMODE, sizeof(CGBMODE));
+	state_put(b, &SERIALSTATE, sizeof(SERIALSTATE));
+	state_put(b, &timer_remaining, sizeof(timer_remaining));
+	state_put(b, &timer_interval, sizeof(timer_interval));
+	state_put(b, &serial_interval, sizeof(serial_interval));
+	state_put(b, &vram_bank, sizeof(vram_bank));
+	state_put(b, &wram_bank, sizeof(wram_bank));
+#define PUT_ARRAY(p, size) state_put(b, p, size);
+	STATE_ARRAYS(PUT_ARRAY)
+#undef PUT_ARRAY
+}
+
+void memory_state_load(struct state_buf *b) {
+	int cgb = COLORPALETTE_BG != NULL;
+	uint32_t vram_bank, wram_bank;
+	state_get(b, &DIV, sizeof(DIV));
+	state_get(b, &TIMA, sizeof(TIMA));
+	state_get(b, &CGBMODE, sizeof(CGBMODE));
+	state_get(b, &SERIALSTATE, sizeof(SERIALSTATE));
+	state_get(b, &timer_remaining, sizeof(timer_remaining));
+	state_get(b, &timer_interval, sizeof(timer_interval));
+	state_get(b, &serial_interval, sizeof(serial_interval));
+	state_get(b, &vram_bank, sizeof(vram_bank));
+	state_get(b, &wram_bank, sizeof(wram_bank));
+	INTERNAL_VRAM_VARIABLE = INTERNAL_VRAM + vram_bank;
+	INTERNAL_WRAM_VARIABLE = INTERNAL_WRAM + wram_bank;
+#define GET_ARRAY(p, size) state_get(b, p, size);
+	STATE_ARRAYS(GET_ARRAY)
+#undef GET_ARRAY
+}
+
+struct cartridge *memory_cart() {
+	return cart;
+}
+
+//RAMは0で埋めておく(同じプロセスでインスタンスを作り直しても起動時の状態が変わらないように)
 int memory_init(struct cartridge *c) {
 	cart = c;
 
@@ -45,19 +139,19 @@ int memory_init(struct cartridge *c) {
 	else
 		CGBMODE = 1;
 
-	if((INTERNAL_OAM = malloc(sizeof(uint8_t) * 0xa0)) == NULL) goto err;
-	if((INTERNAL_RESERVED = malloc(sizeof(uint8_t) * 0x60)) == NULL) goto err;
-	if((INTERNAL_IO = malloc(sizeof(uint8_t) * 0x100)) == NULL) goto err;
-	if((INTERNAL_STACK = malloc(sizeof(uint8_t) * 0x7f)) == NULL) goto err;
+	if((INTERNAL_OAM = calloc(0xa0, sizeof(uint8_t))) == NULL) goto err;
+	if((INTERNAL_RESERVED = calloc(0x60, sizeof(uint8_t))) == NULL) goto err;
+	if((INTERNAL_IO = calloc(0x100, sizeof(uint8_t))) == NULL) goto err;
+	if((INTERNAL_STACK = calloc(0x7f, sizeof(uint8_t))) == NULL) goto err;
 
 	if(CGBMODE){
-		if((INTERNAL_VRAM = malloc(sizeof(uint8_t) * 0x2000 * 2)) == NULL) goto err;
-		if((INTERNAL_WRAM = malloc(sizeof(uint8_t) * 0x8000)) == NULL) goto err;
-		if((COLORPALETTE_BG = malloc(sizeof(uint8_t) * 0x40)) == NULL) goto err;
-		if((COLORPALETTE_SP = malloc(sizeof(uint8_t) * 0x40)) == NULL) goto err;
+		if((INTERNAL_VRAM = calloc(0x2000 * 2, sizeof(uint8_t))) == NULL) goto err;
+		if((INTERNAL_WRAM = calloc(0x8000, sizeof(uint8_t))) == NULL) goto err;
+		if((COLORPALETTE_BG = calloc(0x40, sizeof(uint8_t))) == NULL) goto err;
+		if((COLORPALETTE_SP = calloc(0x40, sizeof(uint8_t))) == NULL) goto err;
 	}else{
-		if((INTERNAL_VRAM = malloc(sizeof(uint8_t) * 0x2000)) == NULL) goto err;
-		if((INTERNAL_WRAM = malloc(sizeof(uint8_t) * 0x2000)) == NULL) goto err;
+		if((INTERNAL_VRAM = calloc(0x2000, sizeof(uint8_t))) == NULL) goto err;
+		if((INTERNAL_WRAM = calloc(0x2000, sizeof(uint8_t))) == NULL) goto err;
 	}
 	INTERNAL_VRAM_VARIABLE = INTERNAL_VRAM;
 	INTERNAL_WRAM_VARIABLE = INTERNAL_WRAM + 0x1000;
@@ -243,8 +337,10 @@ uint8_t memory_write8(uint16_t dst, uint8_t value) {
 			break;
 		default:
 			//wave ramのために
-			if(dst>=0xff30 && dst<=0xff3f)
+			if(dst>=0xff30 && dst<=0xff3f){
 				INTERNAL_IO[dst-V_INTERNAL_IO]=value;
+				sound_waveram_writereg(dst-V_INTERNAL_IO, value);
+			}
 			break;
 		}
 	}else if(dst < V_INTERNAL_INTMASK){
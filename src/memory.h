@@ -1,22 +1,23 @@
 #pragma once
 
 #include <inttypes.h>
+#include "gb.h"
 
 
-extern uint32_t DIV;
-extern uint16_t TIMA;
-extern int CGBMODE;
+extern GB_LOCAL uint32_t DIV;
+extern GB_LOCAL uint16_t TIMA;
+extern GB_LOCAL int CGBMODE;
 /*extern int SERIALSTATE;*/
-extern int timer_remaining;
-extern int timer_interval;
+extern GB_LOCAL int timer_remaining;
+extern GB_LOCAL int timer_interval;
 /*extern int serial_remaining;
 extern int serial_interval;*/
 
-extern uint8_t*		INTERNAL_VRAM;
-extern uint8_t*		INTERNAL_OAM;
-extern uint8_t*		INTERNAL_IO;
-extern uint8_t*		COLORPALETTE_BG;
-extern uint8_t*		COLORPALETTE_SP;
+extern GB_LOCAL uint8_t*		INTERNAL_VRAM;
+extern GB_LOCAL uint8_t*		INTERNAL_OAM;
+extern GB_LOCAL uint8_t*		INTERNAL_IO;
+extern GB_LOCAL uint8_t*		COLORPALETTE_BG;
+extern GB_LOCAL uint8_t*		COLORPALETTE_SP;
 
 
 #define V_CART_ROM0 		0x0000
@@ -148,6 +149,15 @@ extern uint8_t*		COLORPALETTE_SP;
 
 struct cartridge;
 
+struct state_buf;
+struct memory_context;
+
+struct memory_context *memory_context_new(void);
+void memory_context_save(struct memory_context *ctx);
+void memory_context_load(const struct memory_context *ctx);
+void memory_state_save(struct state_buf *b);
+void memory_state_load(struct state_buf *b);
+struct cartridge *memory_cart(void);
 int memory_init(struct cartridge *c);
 void memory_free(void);
 uint8_t memory_write8(uint16_t dst, uint8_t value);
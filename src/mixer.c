@@ -0,0 +1,88 @@
+#include "mixer.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define MIXER_SIMD_WIDTH 4
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define MIXER_SIMD_WIDTH 4
+#else
+#define MIXER_SIMD_WIDTH 1
+#endif
+
+//先頭からcount/MIXER_SIMD_WIDTH*MIXER_SIMD_WIDTHサンプルを混ぜる
+//戻り値は処理したサンプル数
+static int mix_simd(const int16_t *const ch[MIXER_CHANNELS], const int16_t gl[MIXER_CHANNELS],
+		const int16_t gr[MIXER_CHANNELS], int16_t *out, int count) {
+#if defined(__SSE2__)
+	//2チャンネルずつ組にしてpmaddwdで積和する
+	const __m128i gl01 = _mm_set_epi16(gl[1], gl[0], gl[1], gl[0], gl[1], gl[0], gl[1], gl[0]);
+	const __m128i gl23 = _mm_set_epi16(gl[3], gl[2], gl[3], gl[2], gl[3], gl[2], gl[3], gl[2]);
+	const __m128i gr01 = _mm_set_epi16(gr[1], gr[0], gr[1], gr[0], gr[1], gr[0], gr[1], gr[0]);
+	const __m128i gr23 = _mm_set_epi16(gr[3], gr[2], gr[3], gr[2], gr[3], gr[2], gr[3], gr[2]);
+	int i;
+	for(i=0; i+4<=count; i+=4){
+		__m128i c0 = _mm_loadl_epi64((const __m128i *)(ch[0]+i));
+		__m128i c1 = _mm_loadl_epi64((const __m128i *)(ch[1]+i));
+		__m128i c2 = _mm_loadl_epi64((const __m128i *)(ch[2]+i));
+		__m128i c3 = _mm_loadl_epi64((const __m128i *)(ch[3]+i));
+		__m128i c01 = _mm_unpacklo_epi16(c0, c1);
+		__m128i c23 = _mm_unpacklo_epi16(c2, c3);
+		__m128i l = _mm_add_epi32(_mm_madd_epi16(c01, gl01), _mm_madd_epi16(c23, gl23));
+		__m128i r = _mm_add_epi32(_mm_madd_epi16(c01, gr01), _mm_madd_epi16(c23, gr23));
+		l = _mm_srai_epi32(l, MIXER_GAIN_SHIFT);
+		r = _mm_srai_epi32(r, MIXER_GAIN_SHIFT);
+		__m128i lr = _mm_packs_epi32(_mm_unpacklo_epi32(l, r), _mm_unpackhi_epi32(l, r));
+		_mm_storeu_si128((__m128i *)(out+i*2), lr);
+	}
+	return i;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	int i;
+	for(i=0; i+4<=count; i+=4){
+		int32x4_t l = vdupq_n_s32(0), r = vdupq_n_s32(0);
+		for(int c=0; c<MIXER_CHANNELS; c++){
+			int16x4_t x = vld1_s16(ch[c]+i);
+			l = vmlal_n_s16(l, x, gl[c]);
+			r = vmlal_n_s16(r, x, gr[c]);
+		}
+		int16x4x2_t lr;
+		lr.val[0] = vqshrn_n_s32(l, MIXER_GAIN_SHIFT);
+		lr.val[1] = vqshrn_n_s32(r, MIXER_GAIN_SHIFT);
+		vst2_s16(out+i*2, lr);
+	}
+	return i;
+#else
+	(void)ch; (void)gl; (void)gr; (void)out; (void)count;
+	return 0;
+#endif
+}
+
+static int16_t saturate(int32_t v) {
+	return v > 32767 ? 32767 : v < -32768 ? -32768 : v;
+}
+
+void mixer_mix(const int16_t *const channels[MIXER_CHANNELS], const int16_t gain_left[MIXER_CHANNELS],
+		const int16_t gain_right[MIXER_CHANNELS], struct dc_block *dc, int16_t *out, int count) {
+	int i = mix_simd(channels, gain_left, gain_right, out, count);
+
+	//端数(SIMDが無ければ全部)
+	for(; i<count; i++){
+		int32_t l = 0, r = 0;
+		for(int c=0; c<MIXER_CHANNELS; c++){
+			l += channels[c][i] * gain_left[c];
+			r += channels[c][i] * gain_right[c];
+		}
+		out[i*2] = saturate(l >> MIXER_GAIN_SHIFT);
+		out[i*2+1] = saturate(r >> MIXER_GAIN_SHIFT);
+	}
+
+	//直流カット y[n] = x[n] - x[n-1] + (1-2^-9)y[n-1] (44.1kHzで約14Hz)
+	//前のサンプルに依存するので左右の2系統をそのまま順に処理する
+	for(i=0; i<count*2; i++){
+		int lr = i & 1;
+		int32_t x = out[i];
+		dc->acc[lr] += ((int64_t)(x - dc->prev_x[lr]) << 16) - (dc->acc[lr] >> 9);
+		dc->prev_x[lr] = x;
+		out[i] = saturate(dc->acc[lr] >> 16);
+	}
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+#define MIXER_CHANNELS 4
+#define MIXER_GAIN_SHIFT 6 //出力 = Σ(チャンネル * ゲイン) >> MIXER_GAIN_SHIFT
+
+//直流カット(1次のハイパスフィルタ)の状態
+struct dc_block {
+	int32_t prev_x[2];
+	int64_t acc[2]; //Q16
+};
+
+//チャンネルごとのモノラルのブロックを、チャンネルごとの左右のゲインで
+//インターリーブされたステレオに混ぜ、直流をカットする
+//SSE2/NEONが使えればそちらを使う
+void mixer_mix(const int16_t *const channels[MIXER_CHANNELS], const int16_t gain_left[MIXER_CHANNELS],
+		const int16_t gain_right[MIXER_CHANNELS], struct dc_block *dc, int16_t *out, int count);
@@ -0,0 +1,306 @@
+#include "movie.h"
+#include "cartridge.h"
+#include "cpu.h"
+#include "gb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//ファイルの形式(数値はすべてリトルエンディアン)
+//  "GBMV" version(4) ROMのハッシュ(8) flags(4) input_rate(4) lead(4)
+//  RTCの起点(8) セーブデータの時刻(8) セーブデータの大きさ(4) セーブデータ
+//  以降、ボタンが変わるたびに フレーム(4) サイクル(8) ボタン(1)
+//  最後に記録を終えたときのフレーム・サイクル・ボタンをもう1つ書く
+#define MOVIE_VERSION 1
+#define EVENT_SIZE 13
+
+#define MOVIE_OFF 0
+#define MOVIE_RECORD 1
+#define MOVIE_PLAY 2
+
+struct movie_event {
+	uint32_t frame;
+	uint64_t cycle;
+	uint8_t buttons;
+};
+
+static GB_LOCAL int mode = MOVIE_OFF;
+static GB_LOCAL FILE *fp = NULL;
+static GB_LOCAL uint32_t frame = 0;
+static GB_LOCAL uint8_t last = 0; //記録中は最後に記録したボタン、再生中は今のボタン
+static GB_LOCAL int rate = 1;
+static GB_LOCAL struct movie_event *events = NULL;
+static GB_LOCAL size_t events_len = 0, events_pos = 0; //最後の1つは終わりの印なので入力には使わない
+static GB_LOCAL int desynced = 0;
+static GB_LOCAL int write_error = 0; //記録中に書き込みに失敗した(movie_closeで知らせる)
+
+//インスタンスごとの状態(gb_switchで入れ替える)
+//ファイルと読み込んだイベントはmovie_closeで閉じる・解放する
+struct movie_context {
+	int mode;
+	FILE *fp;
+	uint32_t frame;
+	uint8_t last;
+	int rate;
+	struct movie_event *events;
+	size_t events_len, events_pos;
+	int desynced;
+	int write_error;
+};
+
+struct movie_context *movie_context_new() {
+	struct movie_context *ctx = calloc(1, sizeof(struct movie_context));
+	if(ctx != NULL){
+		ctx->mode = MOVIE_OFF;
+		ctx->rate = 1;
+	}
+	return ctx;
+}
+
+void movie_context_save(struct movie_context *ctx) {
+	ctx->mode = mode;
+	ctx->fp = fp;
+	ctx->frame = frame;
+	ctx->last = last;
+	ctx->rate = rate;
+	ctx->events = events;
+	ctx->events_len = events_len;
+	ctx->events_pos = events_pos;
+	ctx->desynced = desynced;
+	ctx->write_error = write_error;
+}
+
+void movie_context_load(const struct movie_context *ctx) {
+	mode = ctx->mode;
+	fp = ctx->fp;
+	frame = ctx->frame;
+	last = ctx->last;
+	rate = ctx->rate;
+	events = ctx->events;
+	events_len = ctx->events_len;
+	events_pos = ctx->events_pos;
+	desynced = ctx->desynced;
+	write_error = ctx->write_error;
+}
+
+//FNV-1a
+static uint64_t rom_hash(struct cartridge *cart) {
+	int size;
+	const uint8_t *rom = cart_getrom(cart, &size);
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for(int i=0; i<size; i++)
+		h = (h ^ rom[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+static void put_le(uint8_t *p, uint64_t v, int n) {
+	for(int i=0; i<n; i++)
+		p[i] = v >> (8*i);
+}
+
+static uint64_t get_le(const uint8_t *p, int n) {
+	uint64_t v = 0;
+	for(int i=0; i<n; i++)
+		v |= (uint64_t)p[i] << (8*i);
+	return v;
+}
+
+static void write_event(const struct movie_event *ev) {
+	uint8_t buf[EVENT_SIZE];
+	put_le(buf, ev->frame, 4);
+	put_le(buf+4, ev->cycle, 8);
+	buf[12] = ev->buttons;
+	if(fwrite(buf, 1, EVENT_SIZE, fp) != EVENT_SIZE && !write_error){
+		perror("movie");
+		write_error = 1;
+	}
+}
+
+int movie_record(const char *path, struct cartridge *cart, int flags, int input_rate, uint32_t lead) {
+	if((fp = fopen(path, "wb")) == NULL){
+		perror(path);
+		return -1;
+	}
+
+	int ramsize;
+	time_t ram_time;
+	uint8_t *ram = cart_getram(cart, &ramsize, &ram_time);
+	if(ram == NULL)
+		ramsize = 0;
+	time_t base = time(NULL);
+
+	uint8_t hdr[48];
+	memcpy(hdr, "GBMV", 4);
+	put_le(hdr+4, MOVIE_VERSION, 4);
+	put_le(hdr+8, rom_hash(cart), 8);
+	put_le(hdr+16, flags, 4);
+	put_le(hdr+20, input_rate, 4);
+	put_le(hdr+24, lead, 4);
+	put_le(hdr+28, base, 8);
+	put_le(hdr+36, ram_time, 8);
+	put_le(hdr+44, ramsize, 4);
+	if(fwrite(hdr, 1, sizeof(hdr), fp) != sizeof(hdr) || (ramsize > 0 && fwrite(ram, 1, ramsize, fp) != (size_t)ramsize)){
+		perror(path);
+		fclose(fp);
+		fp = NULL;
+		return -1;
+	}
+
+	cart_set_virtual_rtc(cart, base);
+	mode = MOVIE_RECORD;
+	frame = 0;
+	last = 0;
+	rate = input_rate;
+	write_error = 0;
+	return 0;
+}
+
+//セーブデータは動画の中身をmallocでコピーしたものに差し替える(ファイルには書き戻さない)
+//元のセーブデータ(mmapしたファイルなど)はそのまま残し、外さない。呼び出し元が確保したものなので呼び出し元が解放する
+//差し替えたコピーも、使い終わったら呼び出し元がcart_getramで取り出して解放する
+int movie_play(const char *path, struct cartridge *cart, int *flags, int *input_rate, uint32_t *lead) {
+	FILE *in = fopen(path, "rb");
+	if(in == NULL){
+		perror(path);
+		return -1;
+	}
+
+	uint8_t hdr[48];
+	if(fread(hdr, 1, sizeof(hdr), in) != sizeof(hdr) || memcmp(hdr, "GBMV", 4) != 0
+			|| get_le(hdr+4, 4) != MOVIE_VERSION){
+		printf("%s: not a movie file\n", path);
+		fclose(in);
+		return -1;
+	}
+	if(get_le(hdr+8, 8) != rom_hash(cart)){
+		printf("%s: recorded with a different ROM\n", path);
+		fclose(in);
+		return -1;
+	}
+
+	int ramsize;
+	time_t ram_time;
+	if(cart_getram(cart, &ramsize, &ram_time) == NULL)
+		ramsize = 0;
+	if(get_le(hdr+44, 4) != (uint64_t)ramsize){
+		printf("%s: save data size mismatch\n", path);
+		fclose(in);
+		return -1;
+	}
+	if(ramsize > 0){
+		uint8_t *ram = malloc(ramsize);
+		if(ram == NULL || fread(ram, 1, ramsize, in) != (size_t)ramsize){
+			printf("%s: truncated save data\n", path);
+			free(ram);
+			fclose(in);
+			return -1;
+		}
+		cart_setram(cart, ram, get_le(hdr+36, 8));
+	}
+
+	size_t capacity = 0;
+	uint8_t buf[EVENT_SIZE];
+	while(fread(buf, 1, EVENT_SIZE, in) == EVENT_SIZE){
+		if(events_len == capacity){
+			capacity = capacity ? capacity*2 : 256;
+			struct movie_event *p = realloc(events, capacity*sizeof(struct movie_event));
+			if(p == NULL){
+				fclose(in);
+				return -1;
+			}
+			events = p;
+		}
+		struct movie_event *ev = &events[events_len++];
+		ev->frame = get_le(buf, 4);
+		ev->cycle = get_le(buf+4, 8);
+		ev->buttons = buf[12];
+	}
+	fclose(in);
+	if(events_len == 0){
+		printf("%s: truncated movie\n", path);
+		return -1;
+	}
+
+	*flags = get_le(hdr+16, 4);
+	*input_rate = rate = get_le(hdr+20, 4);
+	*lead = get_le(hdr+24, 4);
+	cart_set_virtual_rtc(cart, get_le(hdr+28, 8));
+	mode = MOVIE_PLAY;
+	frame = 0;
+	last = 0;
+	events_pos = 0;
+	desynced = 0;
+	printf("movie: %zu input changes, %u frames\n", events_len-1, events[events_len-1].frame);
+	return 0;
+}
+
+int movie_playing() {
+	return mode == MOVIE_PLAY;
+}
+
+int movie_input_rate() {
+	return rate;
+}
+
+//入力をラッチするたびに呼ぶ。記録中は変化を書き、再生中は記録されたボタンを返す
+//再生は記録と同じ間隔でラッチするので、変化はちょうどそのサイクルで起きるはず
+uint8_t movie_input(uint8_t buttons) {
+	switch(mode){
+	case MOVIE_RECORD:
+		if(buttons != last){
+			struct movie_event ev = {frame, cpu_cycles, buttons};
+			write_event(&ev);
+			last = buttons;
+		}
+		return buttons;
+	case MOVIE_PLAY:
+		while(events_pos+1 < events_len && events[events_pos].cycle <= cpu_cycles){
+			if(events[events_pos].cycle != cpu_cycles && !desynced){
+				printf("movie: desync at frame %u (recorded at cycle %llu, now %llu)\n", frame,
+						(unsigned long long)events[events_pos].cycle, (unsigned long long)cpu_cycles);
+				desynced = 1;
+			}
+			last = events[events_pos++].buttons;
+		}
+		return last;
+	}
+	return buttons;
+}
+
+//再生が終わったら入力は元に戻す
+void movie_end_frame() {
+	frame++;
+	if(mode == MOVIE_PLAY && frame >= events[events_len-1].frame){
+		printf("movie: playback finished at frame %u\n", frame);
+		mode = MOVIE_OFF;
+	}
+}
+
+//記録中に書き込みに失敗していれば-1を返す(途中までのファイルが残る)
+int movie_close() {
+	int ret = 0;
+	if(mode == MOVIE_RECORD){
+		struct movie_event ev = {frame, cpu_cycles, last};
+		write_event(&ev);
+	}
+	if(fp != NULL && fclose(fp) != 0 && !write_error){
+		perror("movie");
+		write_error = 1;
+	}
+	if(mode == MOVIE_RECORD){
+		if(write_error){
+			printf("movie: recording failed, the file is incomplete (%u frames)\n", frame);
+			ret = -1;
+		}else{
+			printf("movie: recorded %u frames\n", frame);
+		}
+	}
+	fp = NULL;
+	free(events);
+	events = NULL;
+	events_len = events_pos = 0;
+	mode = MOVIE_OFF;
+	write_error = 0;
+	return ret;
+}
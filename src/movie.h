@@ -0,0 +1,25 @@
+#pragma once
+
+#include <inttypes.h>
+
+struct cartridge;
+struct movie_context;
+
+//入力の記録と再生
+//電源投入時の状態(セーブデータ・RTCの起点・DMGモード等)とボタンの変化をサイクル単位で記録する
+//記録中・再生中はRTCを実時間から切り離す。通信はつながない
+//再生はカートリッジのセーブデータを動画の中身のコピーに差し替える(元のものは外さず、どちらも呼び出し元が解放する)
+
+#define MOVIE_FLAG_DMG 0x1 //-dでDMGモードにした
+
+struct movie_context *movie_context_new(void);
+void movie_context_save(struct movie_context *ctx);
+void movie_context_load(const struct movie_context *ctx);
+
+int movie_record(const char *path, struct cartridge *cart, int flags, int input_rate, uint32_t lead);
+int movie_play(const char *path, struct cartridge *cart, int *flags, int *input_rate, uint32_t *lead);
+int movie_playing(void);
+int movie_input_rate(void);
+uint8_t movie_input(uint8_t buttons);
+void movie_end_frame(void);
+int movie_close(void);
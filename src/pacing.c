@@ -0,0 +1,255 @@
+#include "pacing.h"
+#include "audio.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define GB_CLOCK 4194304
+#define FRAME_CYCLES 70224
+#define NSEC 1000000000ULL
+
+#define RESYNC_FRAMES 4           //これ以上遅れたら追いつこうとせず基準時刻を取り直す
+#define DISPLAY_TIMEOUT_FRAMES 4  //Presentを待つ上限
+#define SPIN_MARGIN_MIN_NS 100000
+#define SPIN_MARGIN_MAX_NS 2000000
+#define AUDIO_STALL_NS 100000000  //オーディオの時計がこれだけ止まっていたら実時間で進める
+
+static int mode = PACING_SYNC_TIMER;
+static double speed = 1.0;     //実機に対する速度の倍率
+static int fast_forward = 0;    //早送り中(表示・オーディオには合わせず、タイマーでff_speed倍か待たずに進める)
+static double ff_speed;
+static uint64_t base_ns;        //frames=0に対応する時刻
+static uint64_t frames;         //base_ns以降のフレーム数
+static uint64_t total_frames;
+static uint64_t last_wake_ns;
+static int64_t spin_margin_ns = SPIN_MARGIN_MAX_NS;
+static atomic_ullong presented;
+static atomic_int stopped;      //終了するので待たない
+
+//オーディオの時計が止まった(デバイスがコールバックを呼ばなくなった)ときの代わり
+//止まっていた間の実時間をaudio_offset_nsに足して進め、再開したらそこから続ける
+static uint64_t audio_last, audio_last_ns, audio_offset_ns;
+static int audio_stalled;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pacing_stats stats;
+static double interval_m2, lateness_sum;
+
+uint64_t pacing_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+int pacing_parse_mode(const char *name) {
+	if(strcmp(name, "timer") == 0) return PACING_SYNC_TIMER;
+	if(strcmp(name, "audio") == 0) return PACING_SYNC_AUDIO;
+	if(strcmp(name, "display") == 0) return PACING_SYNC_DISPLAY;
+	return -1;
+}
+
+//nフレーム分の時間(ns)。70224/4194304秒を誤差なく積み上げる
+static uint64_t frames_to_ns(uint64_t n) {
+	uint64_t c = n * FRAME_CYCLES;
+	return c / GB_CLOCK * NSEC + (c % GB_CLOCK) * NSEC / GB_CLOCK;
+}
+
+//base_nsからnフレーム目の期限までの時間
+static uint64_t deadline_offset(uint64_t n) {
+	double s = fast_forward ? ff_speed : speed;
+	if(s == 1.0)
+		return frames_to_ns(n);
+	return (uint64_t)(frames_to_ns(n) / s);
+}
+
+static uint64_t clock_ns() {
+	if(mode != PACING_SYNC_AUDIO || fast_forward)
+		return pacing_now_ns();
+	uint64_t t = audio_clock_ns();
+	uint64_t now = pacing_now_ns();
+	if(t != audio_last){
+		audio_last = t;
+		audio_last_ns = now;
+		audio_stalled = 0;
+	}else if(audio_stalled || now - audio_last_ns > AUDIO_STALL_NS){
+		if(!audio_stalled)
+			puts("pacing: audio clock stalled, falling back to the system clock");
+		audio_stalled = 1;
+		audio_offset_ns += now - audio_last_ns;
+		audio_last_ns = now;
+	}
+	return t + audio_offset_ns;
+}
+
+void pacing_init(int m) {
+	mode = m;
+	frames = 0;
+	total_frames = 0;
+	base_ns = clock_ns();
+	last_wake_ns = pacing_now_ns();
+	atomic_store(&presented, 0);
+	memset(&stats, 0, sizeof(stats));
+	interval_m2 = 0;
+	lateness_sum = 0;
+}
+
+//実機の何倍の速さで進めるか(基準時刻を取り直す)
+void pacing_set_speed(double ratio) {
+	if(ratio <= 0)
+		return;
+	speed = ratio;
+	base_ns = clock_ns();
+	frames = 0;
+}
+
+//早送り: ratioが正なら実機のratio倍、0なら待たずに進める。負なら元の同期に戻す
+//戻すときは基準時刻を取り直し、表示の同期では早送り中に進んだ分のPresentを待たないようにする
+void pacing_set_fast_forward(double ratio) {
+	if(ratio < 0){
+		fast_forward = 0;
+		total_frames = atomic_load(&presented);
+	}else{
+		fast_forward = 1;
+		ff_speed = ratio;
+	}
+	base_ns = clock_ns();
+	frames = 0;
+}
+
+static void sleep_ns(uint64_t ns) {
+	struct timespec ts = {ns / NSEC, ns % NSEC};
+	nanosleep(&ts, NULL);
+}
+
+//deadlineまでsleepし、残りspin_margin_nsはスピンで待つ
+//sleepの寝過ごし量を見てマージンを調整する
+static void wait_until(uint64_t deadline) {
+	while(!atomic_load(&stopped)){
+		uint64_t now = clock_ns();
+		if(now >= deadline)
+			return;
+		int64_t remaining = deadline - now;
+		if(remaining > spin_margin_ns){
+			uint64_t req = remaining - spin_margin_ns;
+			uint64_t before = pacing_now_ns();
+			sleep_ns(req);
+			int64_t oversleep = (int64_t)(pacing_now_ns() - before) - (int64_t)req;
+			int64_t target = oversleep * 2;
+			if(target < SPIN_MARGIN_MIN_NS) target = SPIN_MARGIN_MIN_NS;
+			if(target > SPIN_MARGIN_MAX_NS) target = SPIN_MARGIN_MAX_NS;
+			spin_margin_ns += (target - spin_margin_ns) / 8;
+		}else{
+			sched_yield();
+		}
+	}
+}
+
+//終了するときに表示スレッドから呼び、エミュレーションスレッドが待っていれば戻す
+void pacing_stop() {
+	atomic_store(&stopped, 1);
+}
+
+//待ちきれなかったら0を返す
+static int wait_presented() {
+	uint64_t limit = pacing_now_ns() + frames_to_ns(DISPLAY_TIMEOUT_FRAMES);
+	while(atomic_load(&presented) + 1 < total_frames && !atomic_load(&stopped)){
+		if(pacing_now_ns() >= limit)
+			return 0;
+		sleep_ns(200000);
+	}
+	return 1;
+}
+
+static void update_stats(uint64_t wake, int64_t lateness, int resynced, int timed_out) {
+	pthread_mutex_lock(&stats_lock);
+	stats.resyncs += resynced;
+	stats.display_timeouts += timed_out;
+	double interval = (double)(wake - last_wake_ns);
+	stats.frames++;
+	double delta = interval - stats.interval_mean_ns;
+	stats.interval_mean_ns += delta / stats.frames;
+	interval_m2 += delta * (interval - stats.interval_mean_ns);
+	stats.interval_stddev_ns = stats.frames > 1 ? sqrt(interval_m2 / (stats.frames - 1)) : 0;
+	if(interval > 0){
+		double fps = NSEC / interval;
+		stats.fps = stats.fps == 0 ? fps : stats.fps + (fps - stats.fps) / 32;
+	}
+	if(lateness < 0) lateness = 0;
+	lateness_sum += lateness;
+	stats.lateness_mean_ns = lateness_sum / stats.frames;
+	if(lateness > stats.lateness_max_ns)
+		stats.lateness_max_ns = lateness;
+	if(lateness > PACING_LATE_THRESHOLD_NS)
+		stats.late_frames++;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+//エミュレーションスレッドが1フレームごとに呼ぶ
+void pacing_wait() {
+	uint64_t deadline;
+	int resynced = 0;
+	total_frames++;
+
+	if(fast_forward && ff_speed == 0){
+		uint64_t wake = pacing_now_ns();
+		update_stats(wake, 0, 0, 0);
+		last_wake_ns = wake;
+		return;
+	}
+	if(mode == PACING_SYNC_DISPLAY && !fast_forward){
+		int timed_out = !wait_presented();
+		uint64_t wake = pacing_now_ns();
+		update_stats(wake, 0, 0, timed_out);
+		last_wake_ns = wake;
+		return;
+	}
+
+	frames++;
+	deadline = base_ns + deadline_offset(frames);
+	uint64_t now = clock_ns();
+	if(now > deadline + deadline_offset(RESYNC_FRAMES)){
+		//追いつけないほど遅れている: バーストさせずに基準を取り直す
+		base_ns = now;
+		frames = 0;
+		resynced = 1;
+		deadline = now;
+	}
+	wait_until(deadline);
+
+	uint64_t wake = pacing_now_ns();
+	update_stats(wake, (int64_t)(clock_ns() - deadline), resynced, 0);
+	last_wake_ns = wake;
+}
+
+//直前のフレームの期限からどれだけ遅れているか(ns)
+//PACING_SYNC_DISPLAYと待たない早送りでは期限を持たないので常に0
+int64_t pacing_lateness_ns() {
+	if((mode == PACING_SYNC_DISPLAY && !fast_forward) || (fast_forward && ff_speed == 0))
+		return 0;
+	return (int64_t)(clock_ns() - (base_ns + deadline_offset(frames)));
+}
+
+//表示スレッドがPresentするたびに呼ぶ
+void pacing_display_presented() {
+	atomic_fetch_add(&presented, 1);
+}
+
+void pacing_get_stats(struct pacing_stats *st) {
+	pthread_mutex_lock(&stats_lock);
+	*st = stats;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void pacing_print_stats() {
+	struct pacing_stats st;
+	pacing_get_stats(&st);
+	printf("pacing: %" PRIu64 " frames, interval %.3f ms (stddev %.3f ms), lateness mean %.3f ms max %.3f ms, "
+			"late %" PRIu64 ", resync %" PRIu64 ", display timeout %" PRIu64 "\n",
+			st.frames, st.interval_mean_ns / 1e6, st.interval_stddev_ns / 1e6,
+			st.lateness_mean_ns / 1e6, st.lateness_max_ns / 1e6,
+			st.late_frames, st.resyncs, st.display_timeouts);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <inttypes.h>
+
+#define PACING_SYNC_TIMER   0 //高分解能タイマーに合わせる
+#define PACING_SYNC_AUDIO   1 //オーディオデバイスの再生位置に合わせる
+#define PACING_SYNC_DISPLAY 2 //表示スレッドのPresentに合わせる
+
+#define PACING_LATE_THRESHOLD_NS 1000000 //これ以上遅れたら期限に間に合わなかったとみなす
+
+struct pacing_stats {
+	uint64_t frames;
+	uint64_t late_frames;       //1ms以上遅れて起床したフレーム数
+	uint64_t resyncs;           //大きく遅れて基準時刻を取り直した回数
+	uint64_t display_timeouts;  //PACING_SYNC_DISPLAYでPresentを待ちきれなかった回数
+	double fps;                 //直近のフレームレート
+	double interval_mean_ns;
+	double interval_stddev_ns;
+	double lateness_mean_ns;
+	double lateness_max_ns;
+};
+
+uint64_t pacing_now_ns(void);
+int pacing_parse_mode(const char *name);
+void pacing_init(int mode);
+void pacing_set_speed(double ratio);
+void pacing_set_fast_forward(double ratio);
+void pacing_wait(void);
+void pacing_stop(void);
+int64_t pacing_lateness_ns(void);
+void pacing_display_presented(void);
+void pacing_get_stats(struct pacing_stats *st);
+void pacing_print_stats(void);
@@ -0,0 +1,25 @@
+#pragma once
+
+//gb_bench用の区分ごとの計測(-DGB_PROFILEを付けたビルドだけで有効、通常のビルドでは何もしない)
+//実行中の区分をprof_sectionに書いておき、gb_benchが一定間隔のSIGPROFでそれを数える
+#define PROF_OTHER 0
+#define PROF_CPU 1
+#define PROF_MEMORY 2
+#define PROF_PPU 3
+#define PROF_APU 4
+#define PROF_SECTIONS 5
+
+#ifdef GB_PROFILE
+#include <inttypes.h>
+#include <signal.h>
+extern volatile sig_atomic_t prof_section;
+extern uint64_t prof_instructions;
+//入れ子になってもよいよう、抜けるときは元の区分に戻す
+#define PROF_BEGIN(s) sig_atomic_t prof_prev = prof_section; prof_section = (s)
+#define PROF_END() (prof_section = prof_prev)
+#define PROF_INSTRUCTION() (prof_instructions++)
+#else
+#define PROF_BEGIN(s)
+#define PROF_END()
+#define PROF_INSTRUCTION()
+#endif
@@ -0,0 +1,202 @@
+#include "rewind.h"
+#include "state.h"
+#include "pacing.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+//差分の圧縮形式: 「変化のないバイト数(varint) 変化したバイト数(varint) 変化したバイトのXOR」の繰り返し
+//状態の大半は毎フレーム変わらないので、ほとんどが0の並びになる
+#define MAX_RECORDS 65536 //60fpsで約18分
+
+struct record {
+	size_t offset;
+	size_t len;
+};
+
+static uint8_t *pool = NULL; //圧縮した差分を置くリング
+static size_t pool_size = 0;
+static struct record records[MAX_RECORDS]; //古い順
+static unsigned int rec_head = 0, rec_count = 0;
+
+static struct state_buf cur;  //一番新しい状態
+static struct state_buf next; //今回書き出した状態
+static uint8_t *packed = NULL;
+static size_t packed_cap = 0;
+
+static uint64_t capture_count = 0, capture_ns = 0, captured_bytes = 0;
+static uint64_t evicted = 0;
+
+int rewind_init(size_t cap_bytes) {
+	pool = malloc(cap_bytes);
+	if(pool == NULL){
+		perror("rewind");
+		return -1;
+	}
+	pool_size = cap_bytes;
+	rec_head = rec_count = 0;
+	cur.len = 0;
+	return 0;
+}
+
+static uint8_t *put_varint(uint8_t *p, size_t v) {
+	while(v >= 0x80){
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static const uint8_t *get_varint(const uint8_t *p, size_t *v) {
+	size_t n = 0;
+	int shift = 0;
+	while(*p & 0x80){
+		n |= (size_t)(*p++ & 0x7f) << shift;
+		shift += 7;
+	}
+	*v = n | (size_t)*p++ << shift;
+	return p;
+}
+
+//a^bを圧縮する
+static size_t pack_xor(const uint8_t *a, const uint8_t *b, size_t n, uint8_t *out) {
+	uint8_t *p = out;
+	size_t i = 0;
+	while(i < n){
+		size_t start = i;
+		while(i < n && a[i] == b[i])
+			i++;
+		size_t same = i - start;
+		start = i;
+		//短い一致は区切らずに変化した側に含める
+		while(i < n && (a[i] != b[i] || (i+1 < n && a[i+1] != b[i+1]) || (i+2 < n && a[i+2] != b[i+2])))
+			i++;
+		p = put_varint(p, same);
+		p = put_varint(p, i - start);
+		for(size_t k=start; k<i; k++)
+			*p++ = a[k] ^ b[k];
+	}
+	return p - out;
+}
+
+//dstに差分を当てる(XORなので前後どちら向きにも使える)
+static void unpack_xor(uint8_t *dst, size_t n, const uint8_t *in, size_t len) {
+	const uint8_t *end = in + len;
+	size_t i = 0;
+	while(in < end && i < n){
+		size_t same, diff;
+		in = get_varint(in, &same);
+		in = get_varint(in, &diff);
+		i += same;
+		for(size_t k=0; k<diff && i<n; k++)
+			dst[i++] ^= *in++;
+	}
+}
+
+static struct record *oldest() {
+	return &records[(rec_head + MAX_RECORDS - rec_count) % MAX_RECORDS];
+}
+
+//記録rが[offset, offset+len)に重なるか
+static int overlaps(const struct record *r, size_t offset, size_t len) {
+	return r->offset < offset + len && offset < r->offset + r->len;
+}
+
+static void push_record(const uint8_t *data, size_t len) {
+	if(len > pool_size)
+		return;
+	//書き込み位置より後ろにあるのは古い順に並んだ記録なので、古い方から捨てていけばよい
+	size_t offset = 0;
+	if(rec_count > 0){
+		struct record *newest = &records[(rec_head + MAX_RECORDS - 1) % MAX_RECORDS];
+		size_t end = newest->offset + newest->len;
+		offset = end;
+		if(offset + len > pool_size){
+			//先頭に戻る。末尾に残っている一番古い記録は先に捨てる
+			offset = 0;
+			while(rec_count > 0 && oldest()->offset >= end){
+				rec_count--;
+				evicted++;
+			}
+		}
+	}
+	while(rec_count > 0 && (rec_count == MAX_RECORDS || overlaps(oldest(), offset, len))){
+		rec_count--;
+		evicted++;
+	}
+	memcpy(pool + offset, data, len);
+	records[rec_head].offset = offset;
+	records[rec_head].len = len;
+	rec_head = (rec_head + 1) % MAX_RECORDS;
+	rec_count++;
+}
+
+//フレームの始めに呼ぶ
+void rewind_capture() {
+	if(pool == NULL)
+		return;
+	uint64_t start = pacing_now_ns();
+
+	state_save(&next);
+	if(cur.len == next.len){
+		if(packed_cap < next.len + next.len/64 + 32){
+			packed_cap = next.len + next.len/64 + 32;
+			free(packed);
+			if((packed = malloc(packed_cap)) == NULL){
+				perror("rewind");
+				exit(-1);
+			}
+		}
+		//区切りは3バイト以上の一致ごとなので、最悪でも元の大きさ+len/64+数バイトに収まる
+		size_t len = pack_xor(cur.data, next.data, next.len, packed);
+		push_record(packed, len);
+		captured_bytes += len;
+	}else{
+		//最初のフレーム、または状態の大きさが変わった(別のROMなど)
+		rec_count = 0;
+	}
+	struct state_buf t = cur;
+	cur = next;
+	next = t;
+
+	capture_ns += pacing_now_ns() - start;
+	capture_count++;
+}
+
+//1フレーム前の状態に戻す。戻れる記録がなければ一番古い状態に留まる
+int rewind_step() {
+	if(pool == NULL || cur.len == 0)
+		return -1;
+	if(rec_count > 0){
+		rec_head = (rec_head + MAX_RECORDS - 1) % MAX_RECORDS;
+		rec_count--;
+		struct record *r = &records[rec_head];
+		unpack_xor(cur.data, cur.len, pool + r->offset, r->len);
+	}
+	return state_load(cur.data, cur.len);
+}
+
+void rewind_print_stats() {
+	if(pool == NULL || capture_count == 0)
+		return;
+	size_t used = 0;
+	for(unsigned int i=0; i<rec_count; i++)
+		used += records[(rec_head + MAX_RECORDS - 1 - i) % MAX_RECORDS].len;
+	double per_frame = (double)captured_bytes / capture_count;
+	printf("rewind: %u frames (%.1f s) in %.1f KB of %.1f MB, %.2f us/frame, %.1f KB per second of history, state %zu bytes, evicted %" PRIu64 "\n",
+			rec_count, rec_count / (4194304.0/70224.0), used / 1024.0, pool_size / 1048576.0,
+			capture_ns / 1e3 / capture_count, per_frame * (4194304.0/70224.0) / 1024.0, cur.len, evicted);
+}
+
+void rewind_free() {
+	free(pool);
+	pool = NULL;
+	free(packed);
+	packed = NULL;
+	packed_cap = 0;
+	state_buf_free(&cur);
+	state_buf_free(&next);
+	rec_count = 0;
+}
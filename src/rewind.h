@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stddef.h>
+
+//巻き戻し
+//毎フレームの状態を1つ前との差分(XOR)にして圧縮し、確保済みのリングに積む
+//一番新しい状態だけは圧縮せずに持ち、1フレーム戻すときは差分を1つ当てるだけにする
+//(古い方から捨てても残りはそのまま使えるので、キーフレームは要らない)
+
+int rewind_init(size_t cap_bytes);
+void rewind_capture(void);
+int rewind_step(void);
+void rewind_print_stats(void);
+void rewind_free(void);
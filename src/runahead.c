@@ -0,0 +1,66 @@
+#include "runahead.h"
+#include "machine.h"
+#include "sound.h"
+#include "state.h"
+#include <stdio.h>
+#include <time.h>
+
+static int frames = 0;
+static struct state_buf saved;
+
+static uint64_t run_count = 0, extra_ns = 0, extra_max_ns = 0;
+
+//SDLのフロントエンド(pacing.c)なしでも使えるよう時計は自前で読む
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void runahead_set_frames(int n) {
+	frames = n;
+}
+
+int runahead_frames() {
+	return frames;
+}
+
+//1フレーム進め、framebufにはframesフレーム先の画面を描く
+//input_rateが0なら入力をラッチしない(入力スクリプトのように外から与えるとき)
+//先読みの間は入力をラッチし直さず、このフレームの入力のまま進める
+int runahead_run_frame(uint32_t *framebuf, int input_rate) {
+	if(frames == 0 || framebuf == NULL){
+		if(input_rate > 0)
+			return machine_run_frame_latched(framebuf, input_rate);
+		return machine_run_frame(framebuf);
+	}
+
+	if(input_rate > 0)
+		machine_run_frame_latched(NULL, input_rate);
+	else
+		machine_run_frame(NULL);
+
+	uint64_t start = now_ns();
+	state_save(&saved);
+	sound_set_speculative(1);
+	for(int i=1; i<frames; i++)
+		machine_run_frame(NULL);
+	int ret = machine_run_frame(framebuf);
+	//戻してから合成を再開する(先読みした分が出力に混ざらないように)
+	state_load(saved.data, saved.len);
+	sound_set_speculative(0);
+
+	uint64_t ns = now_ns() - start;
+	extra_ns += ns;
+	if(ns > extra_max_ns)
+		extra_max_ns = ns;
+	run_count++;
+	return ret;
+}
+
+void runahead_print_stats() {
+	if(run_count == 0)
+		return;
+	printf("runahead: %d frames ahead, extra work mean %.1f us max %.1f us per frame (%" PRIu64 " frames)\n",
+			frames, extra_ns / 1e3 / run_count, extra_max_ns / 1e3, run_count);
+}
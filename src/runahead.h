@@ -0,0 +1,12 @@
+#pragma once
+
+#include <inttypes.h>
+
+//run-ahead
+//実際のフレームを進めたあと状態を保存し、同じ入力でNフレーム先まで実行してその画面を表示し、状態を戻す
+//入力から画面に現れるまでの遅れがNフレーム縮む(先読みの分だけ毎フレームの処理が増える)
+
+void runahead_set_frames(int n);
+int runahead_frames(void);
+int runahead_run_frame(uint32_t *framebuf, int input_rate);
+void runahead_print_stats(void);
@@ -1,80 +1,737 @@
 #include "serial.h"
 #include "memory.h"
+#include "cpu.h"
+#include "spsc.h"
+#include "gb.h"
+#include "machine.h"
+#include "state.h"
 #include <inttypes.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <time.h>
+#include <signal.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
-#include <SDL2/SDL.h>
-
-static int sock = -1;
-static SDL_Thread *serial_recv_thread;
-
-#define SERIAL_DELAY_CYCLE 40000 
-int serial_received = 0;
-int serial_sent = 0;
-int serial_remaining = 0;
-uint8_t serial_recv_buffer = 0;
-
-static int recv_thread(void *ptr) {
-	while(1){
-		if(sock<0) break;
-		if(recv(sock, &serial_recv_buffer, 1, 0)!=1){
-			perror("recv");
-			close(sock);
-			sock = -1;
-			serial_recv_buffer = 0xff;
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+//通信はI/Oスレッド1つがpollで行い、エミュレーションスレッドとはSPSCキューでやりとりする
+//ソケットを触るのはI/Oスレッドだけ(接続時のみ起動し、未接続ならスレッドは使わない)
+//ソケットはTCPかUNIXドメイン。共有メモリのときはI/Oスレッドを使わず、
+//エミュレーションスレッドどうしが共有メモリ上のリングで直接やりとりする(待つときはfutex)
+//
+//ロックステップ: メッセージには送信側のcpu_cyclesを付ける
+//相手から届いたメッセージはスタンプ+leadサイクルの時点で反映する
+//相手のサイクルがleadより遅れているときは追いつくまで待つので、
+//反映が遅れることはなく、通信の遅延によらず結果が決まる
+//マスターの転送はスタンプT → 相手がT+leadで受けて返信 → こちらがT+2leadで完了
+
+#define MSG_SYNC 1  //ここまで進んだ(これより前のスタンプのメッセージは送信済み)
+#define MSG_XFER 2  //マスターとして転送を開始した
+#define MSG_REPLY 3 //相手の転送を受けた(dataはそのときのSB)
+#define MSG_SIZE 10 //type, data, cycle(LE 8byte)
+
+#define LINK_MAGIC "GBL1"
+#define SERIAL_QUEUE_SIZE 4096
+#define PACKET_MAX_MSGS 512
+#define QUEUE_WAIT_MS 100 //キューが一杯のとき、終了・切断を確かめる間隔
+
+struct link_msg {
+	uint64_t cycle;
+	uint8_t type;
+	uint8_t data;
+};
+
+static int sock = -1; //I/Oスレッドが動いている間はI/Oスレッドだけが触る
+static pthread_t io_thread;
+static int io_running = 0;
+static int wake_pipe[2] = {-1, -1}; //I/Oスレッドを起こす(送信データあり・終了)
+static sem_t rx_sem; //メッセージが届いた・切断した
+static sem_t rx_space_sem; //受信キューが空いた(エミュレーション→I/Oスレッド)
+static sem_t tx_space_sem; //送信キューが空いた(I/Oスレッド→エミュレーション)
+static atomic_int rx_space_waiting, tx_space_waiting; //待っているときだけ知らせる
+static atomic_int linked;
+static atomic_int io_quit;
+static struct spsc rx_queue; //受信したメッセージ(I/Oスレッド→エミュレーション)
+static struct spsc tx_queue; //送信するメッセージ(エミュレーション→I/Oスレッド)
+static uint32_t link_lead = SERIAL_LEAD_DEFAULT;
+static int transport = SERIAL_TRANSPORT_TCP;
+
+//共有メモリのリング(プロセスごとにアドレスが違うのでポインタを持たない)
+#define SHM_RING_SIZE 4096
+#define SHM_WAITING 0 //サーバーがクライアントを待っている
+#define SHM_CONNECTED 1
+#define SHM_CLOSED 2
+struct shm_ring {
+	_Alignas(64) atomic_uint head; //書き込み位置(送り手のみ更新)
+	_Alignas(64) atomic_uint tail; //読み出し位置(受け手のみ更新)
+	_Alignas(64) atomic_uint seq;  //futexで待つ値(送り手が起こすときに増やす)
+	atomic_int waiting;            //受け手がfutexで寝ている
+	struct link_msg msgs[SHM_RING_SIZE];
+};
+struct shm_link {
+	char magic[4];
+	uint32_t lead;
+	int32_t pid[2];                 //相手が落ちたかどうかを待ちのタイムアウトで調べる
+	_Alignas(64) atomic_uint state; //futexで待つ値
+	struct shm_ring ring[2];        //[0]: サーバー→クライアント, [1]: クライアント→サーバー
+};
+static struct shm_link *shm = NULL;
+static int shm_tx = 0; //自分が送る方のring
+static void shm_close(void);
+
+//以下はエミュレーションスレッドだけが触る
+GB_LOCAL int serial_sent = 0;
+GB_LOCAL uint64_t serial_next_check = UINT64_MAX; //cpu_cyclesがここに達したらserial_update()
+static GB_LOCAL int active = 0;          //相手とロックステップ中
+static GB_LOCAL uint64_t peer_cycle = 0; //相手がここまで進んだ(これより前のスタンプのメッセージは受信済み)
+static GB_LOCAL uint64_t next_announce = 0;
+static GB_LOCAL int xfer_pending = 0;    //こちらがマスターで返信待ち
+static GB_LOCAL int local_pending = 0;   //未接続のマスター転送
+static GB_LOCAL uint64_t local_done = 0;
+static struct link_msg events[SERIAL_QUEUE_SIZE]; //受信済みで反映待ちの転送
+static unsigned int events_head = 0, events_tail = 0;
+static unsigned long long stall_count = 0;
+static uint64_t stall_ns = 0;
+//ネットワークのロックステップ(events等)はプロセスで1台だけが使う
+
+//同じプロセスの2つのインスタンスをつなぐケーブル
+//ソケットもスレッドも使わず、serial_pair_run()が2台をPAIR_SLICEサイクルずつ交互に進め、
+//マスターの転送が終わるサイクルには両方をそろえてからSBを交換する
+#define PAIR_TRANSFER_CYCLE 4096 //8bit x 512サイクル(8192Hz)
+#define PAIR_SLICE 2048          //転送時間より短くする(相手が交換のサイクルを追い越さないように)
+static struct {
+	struct gb *gb[2];
+	uint64_t done[2];  //マスターとしての転送が終わるサイクル(0なら転送していない)
+	uint64_t stop;     //2台をここまで進める
+	uint64_t cycles[2];
+} cable;
+
+//インスタンスごとの状態(gb_switchで入れ替える)
+struct serial_context {
+	int sent;
+	uint64_t next_check;
+	int active;
+	uint64_t peer_cycle;
+	uint64_t next_announce;
+	int xfer_pending;
+	int local_pending;
+	uint64_t local_done;
+};
+
+struct serial_context *serial_context_new() {
+	struct serial_context *ctx = calloc(1, sizeof(struct serial_context));
+	if(ctx != NULL)
+		ctx->next_check = UINT64_MAX;
+	return ctx;
+}
+
+void serial_context_save(struct serial_context *ctx) {
+	ctx->sent = serial_sent;
+	ctx->next_check = serial_next_check;
+	ctx->active = active;
+	ctx->peer_cycle = peer_cycle;
+	ctx->next_announce = next_announce;
+	ctx->xfer_pending = xfer_pending;
+	ctx->local_pending = local_pending;
+	ctx->local_done = local_done;
+}
+
+void serial_context_load(const struct serial_context *ctx) {
+	serial_sent = ctx->sent;
+	serial_next_check = ctx->next_check;
+	active = ctx->active;
+	peer_cycle = ctx->peer_cycle;
+	next_announce = ctx->next_announce;
+	xfer_pending = ctx->xfer_pending;
+	local_pending = ctx->local_pending;
+	local_done = ctx->local_done;
+}
+
+//ステートセーブ
+void serial_state_save(struct state_buf *b) {
+	struct serial_context ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	serial_context_save(&ctx);
+	state_put(b, &ctx, sizeof(ctx));
+}
+
+void serial_state_load(struct state_buf *b) {
+	struct serial_context ctx;
+	state_get(b, &ctx, sizeof(ctx));
+	serial_context_load(&ctx);
+}
+
+static void sleep_ms(int ms) {
+	struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+	nanosleep(&ts, NULL);
+}
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//sem_timedwaitはCLOCK_REALTIMEの時刻で指定する
+static void sem_wait_ms(sem_t *sem, int ms) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000L;
+	if(ts.tv_nsec >= 1000000000L){
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	while(sem_timedwait(sem, &ts) < 0 && errno == EINTR)
+		;
+}
+
+static void io_disconnect(const char *what) {
+	if(what != NULL)
+		perror(what);
+	close(sock);
+	sock = -1;
+	atomic_store(&linked, 0);
+	sem_post(&rx_sem);
+}
+
+static int send_all(const uint8_t *buf, size_t len) {
+	while(len > 0){
+		ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+		if(n < 0){
+			if(errno == EINTR)
+				continue;
+			return -1;
 		}
-		//printf("r %X\n", serial_recv_buffer);
-		//SDL_Delay(1);
-		serial_remaining = SERIAL_DELAY_CYCLE;
-		serial_received = 1;
+		buf += n;
+		len -= n;
 	}
 	return 0;
 }
 
-static int noconn_recv_thread(void *ptr) {
-	//SDL_Delay(1);
-	serial_remaining = SERIAL_DELAY_CYCLE;
-	serial_recv_buffer = 0xff;
-	serial_received = 1;
+static int recv_all(uint8_t *buf, size_t len) {
+	while(len > 0){
+		ssize_t n = recv(sock, buf, len, 0);
+		if(n <= 0){
+			if(n < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
 	return 0;
 }
 
-void serial_send(uint8_t data) {
-	if(sock<0 || send(sock, &data, 1, MSG_NOSIGNAL|MSG_DONTWAIT)!=1){
-		if(sock>0){
-			perror("send");
-			close(sock);
-			sock = -1;
+//送信キューにあるメッセージをまとめて1つのパケットにする
+//パケット: ペイロード長(LE 2byte) + メッセージの並び
+static int io_flush() {
+	static uint8_t packet[2 + PACKET_MAX_MSGS*MSG_SIZE];
+	struct link_msg m;
+	for(;;){
+		int n = 0;
+		while(n < PACKET_MAX_MSGS && spsc_pop(&tx_queue, &m)){
+			if(n == 0 && atomic_exchange(&tx_space_waiting, 0))
+				sem_post(&tx_space_sem);
+			uint8_t *p = packet + 2 + n*MSG_SIZE;
+			p[0] = m.type;
+			p[1] = m.data;
+			for(int i=0; i<8; i++)
+				p[2+i] = m.cycle >> (i*8);
+			n++;
+		}
+		if(n == 0)
+			return 0;
+		packet[0] = n*MSG_SIZE;
+		packet[1] = (n*MSG_SIZE) >> 8;
+		if(send_all(packet, 2 + n*MSG_SIZE) < 0)
+			return -1;
+	}
+}
+
+//受信したバイト列からパケットを切り出してメッセージを受信キューへ
+//戻り値は消費したバイト数。壊れたパケット(長さがメッセージの倍数でない)なら-1
+static ssize_t io_parse(const uint8_t *buf, size_t len) {
+	size_t pos = 0;
+	while(len - pos >= 2){
+		size_t plen = buf[pos] | buf[pos+1]<<8;
+		if(plen % MSG_SIZE != 0)
+			return -1;
+		if(len - pos - 2 < plen)
+			break;
+		for(const uint8_t *p = buf+pos+2; p < buf+pos+2+plen; p += MSG_SIZE){
+			struct link_msg m = {0, p[0], p[1]};
+			for(int i=0; i<8; i++)
+				m.cycle |= (uint64_t)p[2+i] << (i*8);
+			//捨てると同期が壊れるので空くまで待つ(終了するときは捨てる)
+			while(!spsc_push(&rx_queue, &m) && !atomic_load(&io_quit)){
+				atomic_store(&rx_space_waiting, 1);
+				sem_post(&rx_sem);
+				sem_wait_ms(&rx_space_sem, QUEUE_WAIT_MS);
+			}
 		}
-		SDL_Thread *noconn_thread = SDL_CreateThread(noconn_recv_thread, "noconn_thread", 
-		(void*)NULL);
-		if(noconn_thread == NULL)
-			printf("\nSDL_CreateThread failed: %s\n", SDL_GetError());
-		else
-			SDL_DetachThread(noconn_thread);
+		pos += 2 + plen;
+	}
+	sem_post(&rx_sem);
+	return pos;
+}
+
+static void *io_main(void *unused) {
+	(void)unused;
+	static uint8_t buf[2 + 0xffff + 4096];
+	size_t buflen = 0;
+	while(!atomic_load(&io_quit)){
+		struct pollfd fds[2] = {
+			{sock, POLLIN, 0},
+			{wake_pipe[0], POLLIN, 0},
+		};
+		if(poll(fds, 2, -1) < 0){
+			if(errno == EINTR)
+				continue;
+			io_disconnect("poll");
+			break;
+		}
+
+		if(fds[1].revents & POLLIN){
+			char c[64];
+			while(read(wake_pipe[0], c, sizeof(c)) > 0)
+				;
+		}
+
+		if(fds[0].revents & (POLLIN|POLLHUP|POLLERR)){
+			ssize_t n = recv(sock, buf+buflen, sizeof(buf)-buflen, 0);
+			if(n <= 0){
+				io_disconnect(n < 0 ? "recv" : NULL);
+				if(n == 0)
+					puts("serial: disconnected");
+				break;
+			}
+			buflen += n;
+			ssize_t used = io_parse(buf, buflen);
+			if(used < 0){
+				puts("serial: malformed packet");
+				io_disconnect(NULL);
+				break;
+			}
+			memmove(buf, buf+used, buflen-used);
+			buflen -= used;
+		}
+
+		if(io_flush() < 0){
+			io_disconnect("send");
+			break;
+		}
+	}
+	//serial_shutdown()で止められたときは、ここで切断して相手とエミュレーションスレッドに知らせる
+	if(sock >= 0)
+		io_disconnect(NULL);
+	return NULL;
+}
+
+//接続直後に互いのleadを確かめる(違うと結果が一致しない)
+static int serial_handshake() {
+	uint8_t hello[8], peer[8];
+	memcpy(hello, LINK_MAGIC, 4);
+	for(int i=0; i<4; i++)
+		hello[4+i] = link_lead >> (i*8);
+	if(send_all(hello, sizeof(hello)) < 0 || recv_all(peer, sizeof(peer)) < 0){
+		perror("handshake");
+		return -1;
+	}
+	uint32_t lead = peer[4] | peer[5]<<8 | peer[6]<<16 | (uint32_t)peer[7]<<24;
+	if(memcmp(peer, LINK_MAGIC, 4) != 0){
+		puts("serial: peer is not speaking the link protocol");
+		return -1;
+	}
+	if(lead != link_lead){
+		printf("serial: link lead mismatch (local %u, peer %u)\n", link_lead, lead);
+		return -1;
+	}
+	return 0;
+}
+
+static void link_begin() {
+	active = 1;
+	peer_cycle = 0;
+	next_announce = 0;
+	serial_next_check = 0;
+}
+
+static int serial_start_io_thread() {
+	if(serial_handshake() < 0){
+		close(sock);
+		sock = -1;
+		return -1;
+	}
+	if(spsc_init(&rx_queue, SERIAL_QUEUE_SIZE, sizeof(struct link_msg)) < 0 || spsc_init(&tx_queue, SERIAL_QUEUE_SIZE, sizeof(struct link_msg)) < 0){
+		puts("serial: spsc_init failed");
+		return -1;
+	}
+	if(pipe(wake_pipe) < 0){
+		perror("pipe");
+		return -1;
+	}
+	fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+	sem_init(&rx_sem, 0, 0);
+	sem_init(&rx_space_sem, 0, 0);
+	sem_init(&tx_space_sem, 0, 0);
+	atomic_store(&io_quit, 0);
+	atomic_store(&linked, 1);
+	int err = pthread_create(&io_thread, NULL, io_main, NULL);
+	if(err != 0){
+		printf("\npthread_create failed: %s\n", strerror(err));
+		atomic_store(&linked, 0);
+		sem_destroy(&rx_sem);
+		sem_destroy(&rx_space_sem);
+		sem_destroy(&tx_space_sem);
+		return -1;
+	}
+	io_running = 1;
+	link_begin();
+	return 0;
+}
+
+static void io_wake() {
+	char c = 0;
+	if(write(wake_pipe[1], &c, 1) < 0)
+		perror("write");
+}
+
+static long futex(atomic_uint *addr, int op, unsigned int val, const struct timespec *timeout) {
+	return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static int shm_push(struct shm_ring *r, const struct link_msg *m) {
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	if(head - atomic_load_explicit(&r->tail, memory_order_acquire) == SHM_RING_SIZE)
+		return 0;
+	r->msgs[head % SHM_RING_SIZE] = *m;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	return 1;
+}
+
+static int shm_pop(struct shm_ring *r, struct link_msg *m) {
+	unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	if(tail == atomic_load_explicit(&r->head, memory_order_acquire))
+		return 0;
+	*m = r->msgs[tail % SHM_RING_SIZE];
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+	return 1;
+}
+
+//受け手が寝ていれば起こす
+static void shm_kick(struct shm_ring *r) {
+	atomic_fetch_add(&r->seq, 1);
+	if(atomic_load(&r->waiting))
+		futex(&r->seq, FUTEX_WAKE, 1, NULL);
+}
+
+//何か届くか切断されるまで(最長ms)寝る
+static void shm_wait(struct shm_ring *r, int ms) {
+	unsigned int seq = atomic_load(&r->seq);
+	atomic_store(&r->waiting, 1);
+	if(atomic_load(&r->head) == atomic_load(&r->tail) && atomic_load(&shm->state) == SHM_CONNECTED){
+		struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+		if(futex(&r->seq, FUTEX_WAIT, seq, &ts)<0 && errno == ETIMEDOUT
+				&& kill(shm->pid[!shm_tx], 0)<0 && errno == ESRCH)
+			atomic_store(&shm->state, SHM_CLOSED);
+	}
+	atomic_store(&r->waiting, 0);
+}
+
+//以下の4つで転送路の違いを吸収する
+static int tx_put(const struct link_msg *m) {
+	if(shm != NULL)
+		return shm_push(&shm->ring[shm_tx], m);
+	return spsc_push(&tx_queue, m);
+}
+
+static void tx_kick() {
+	if(shm != NULL)
+		shm_kick(&shm->ring[shm_tx]);
+	else
+		io_wake();
+}
+
+static int rx_get(struct link_msg *m) {
+	if(shm != NULL)
+		return shm_pop(&shm->ring[!shm_tx], m);
+	return spsc_pop(&rx_queue, m);
+}
+
+//送り出しを促して送信キューが空くのを待つ
+//共有メモリは相手のプロセスが取り出すので知らせがなく、少しずつ待つ
+static void tx_wait() {
+	if(shm != NULL){
+		tx_kick();
+		sleep_ms(1);
 	}else{
-		//printf("w %X\n", data);
+		atomic_store(&tx_space_waiting, 1); //起こす前に立てておく(知らせを取りこぼさないように)
+		io_wake();
+		sem_wait_ms(&tx_space_sem, QUEUE_WAIT_MS);
+	}
+}
+
+static void rx_wait(int ms) {
+	if(shm != NULL)
+		shm_wait(&shm->ring[!shm_tx], ms);
+	else
+		sem_wait_ms(&rx_sem, ms);
+}
+
+static int link_up() {
+	if(shm != NULL && atomic_load(&linked) && atomic_load(&shm->state) != SHM_CONNECTED){
+		atomic_store(&linked, 0);
+		puts("serial: disconnected");
+	}
+	return atomic_load(&linked);
+}
+
+static void link_push(uint8_t type, uint8_t data) {
+	struct link_msg m = {cpu_cycles, type, data};
+	while(!tx_put(&m)){
+		if(!link_up())
+			return;
+		tx_wait();
+	}
+}
+
+//自分の現在のサイクルを知らせる(溜まっている転送もここでまとめて送られる)
+static void link_announce() {
+	link_push(MSG_SYNC, 0);
+	tx_kick();
+	next_announce = cpu_cycles + link_lead/2;
+}
+
+static void transfer_done(uint8_t data) {
+	INTERNAL_IO[IO_SB_R] = data;
+	INTERNAL_IO[IO_SC_R] &= ~0x80;
+	serial_sent = 0;
+	cpu_request_interrupt(INT_SERIAL);
+}
+
+//同期が保てなくなった: 接続を切る(ソケットはI/Oスレッドが閉じる)
+//link_up()が0になるので、呼び出し元の待ちは抜けてlink_lost()に進む
+static void link_drop(const char *why) {
+	printf("serial: %s, disconnecting\n", why);
+	atomic_store(&linked, 0);
+	if(shm != NULL)
+		shm_close();
+	else{
+		atomic_store(&io_quit, 1);
+		io_wake();
+	}
+}
+
+static void link_receive() {
+	struct link_msg m;
+	int got = 0;
+	while(rx_get(&m)){
+		got = 1;
+		if(m.type == MSG_SYNC)
+			peer_cycle = m.cycle;
+		else if(m.type == MSG_XFER || m.type == MSG_REPLY){
+			if(events_tail - events_head == SERIAL_QUEUE_SIZE){
+				//捨てると相手とずれるので続けられない
+				link_drop("too many pending transfers");
+				break;
+			}
+			events[events_tail++ % SERIAL_QUEUE_SIZE] = m;
+		}
+	}
+	if(got && shm == NULL && atomic_exchange(&rx_space_waiting, 0))
+		sem_post(&rx_space_sem);
+}
+
+static void link_lost() {
+	active = 0;
+	events_head = events_tail = 0;
+	if(xfer_pending){
+		xfer_pending = 0;
+		transfer_done(0xff);
+	}
+}
+
+//相手がcpu_cycles-leadを越えるまで待つ
+static void link_wait() {
+	uint64_t start = now_ns();
+	stall_count++;
+	link_announce();
+	while(cpu_cycles >= peer_cycle + link_lead){
+		if(!link_up())
+			break;
+		rx_wait(100);
+		link_receive();
+	}
+	stall_ns += now_ns() - start;
+}
+
+static void link_apply(const struct link_msg *m) {
+	if(m->type == MSG_XFER){
+		//相手がマスター: そのときのSBを返して受け取る
+		//両方が同時にマスターなら返信だけして、自分の転送は相手の返信で終える
+		uint8_t sb = INTERNAL_IO[IO_SB_R];
+		link_push(MSG_REPLY, sb);
+		if(!xfer_pending)
+			transfer_done(m->data);
+	}else if(xfer_pending){
+		xfer_pending = 0;
+		transfer_done(m->data);
 	}
 }
 
-static void serial_start_recv_thread() {
-	serial_recv_thread = SDL_CreateThread(recv_thread, "serial_recv_thread", 
-		(void*)NULL);
-	if(serial_recv_thread == NULL){
-		printf("\nSDL_CreateThread failed: %s\n", SDL_GetError());
+static void update_next_check() {
+	uint64_t next = UINT64_MAX;
+	if(local_pending)
+		next = local_done;
+	if(active){
+		if(peer_cycle + link_lead < next)
+			next = peer_cycle + link_lead;
+		if(next_announce < next)
+			next = next_announce;
+		if(events_head != events_tail && events[events_head % SERIAL_QUEUE_SIZE].cycle + link_lead < next)
+			next = events[events_head % SERIAL_QUEUE_SIZE].cycle + link_lead;
+	}
+	serial_next_check = next;
+}
+
+//tick()からcpu_cycles >= serial_next_checkのときだけ呼ばれる
+void serial_update() {
+	if(local_pending && cpu_cycles >= local_done){
+		local_pending = 0;
+		transfer_done(0xff);
+	}
+
+	if(active){
+		link_receive();
+		if(cpu_cycles >= peer_cycle + link_lead)
+			link_wait();
+		if(!link_up()){
+			link_lost();
+		}else{
+			while(events_head != events_tail && events[events_head % SERIAL_QUEUE_SIZE].cycle + link_lead <= cpu_cycles){
+				link_apply(&events[events_head % SERIAL_QUEUE_SIZE]);
+				events_head++;
+			}
+			if(cpu_cycles >= next_announce)
+				link_announce();
+		}
+	}
+	update_next_check();
+}
+
+static int pair_index() {
+	struct gb *gb = gb_current();
+	if(gb == NULL)
+		return -1;
+	return cable.gb[0] == gb ? 0 : cable.gb[1] == gb ? 1 : -1;
+}
+
+//SCに0x81が書かれた(マスターとして転送開始)
+void serial_send(uint8_t data) {
+	int i = pair_index();
+	if(i >= 0){
+		cable.done[i] = cpu_cycles + PAIR_TRANSFER_CYCLE;
+		return;
+	}
+	if(active && link_up()){
+		link_push(MSG_XFER, data);
+		xfer_pending = 1;
 	}else{
-		SDL_DetachThread(serial_recv_thread);
+		//未接続: マスターの転送と同じ時間のあと0xffを受け取ったことにする
+		local_pending = 1;
+		local_done = cpu_cycles + 2*(uint64_t)link_lead;
+		update_next_check();
 	}
 }
 
-int serial_serverinit(int port) {
+//期限の来たマスターの転送を行う(両方のインスタンスがcable.stopに達している)
+static void pair_exchange() {
+	for(int i=0; i<2; i++){
+		if(cable.done[i] == 0 || cable.done[i] > cable.stop)
+			continue;
+		int j = 1 - i;
+		cable.done[i] = 0;
+		gb_switch(cable.gb[i]);
+		uint8_t sb_i = INTERNAL_IO[IO_SB_R];
+		gb_switch(cable.gb[j]);
+		uint8_t sb_j = INTERNAL_IO[IO_SB_R];
+		//相手も同時にマスターなら、相手の転送は相手の期限に終える(ネットワークのときと同じ)
+		if(cable.done[j] == 0)
+			transfer_done(sb_i);
+		gb_switch(cable.gb[i]);
+		transfer_done(sb_j);
+	}
+}
+
+//同じプロセスの2つのインスタンスをつなぐ
+void serial_pair(struct gb *a, struct gb *b) {
+	cable.gb[0] = a;
+	cable.gb[1] = b;
+	cable.done[0] = cable.done[1] = 0;
+	cable.stop = 0;
+	cable.cycles[0] = cable.cycles[1] = 0;
+}
+
+//つないだ2台をどちらかのフレームが終わるまで進める
+//フレームが終わった方の番号(0か1)を返し、そのインスタンスに切り替えた状態で戻る
+int serial_pair_run(uint32_t *framebuf[2]) {
+	for(;;){
+		for(int i=0; i<2; i++){
+			if(cable.cycles[i] >= cable.stop)
+				continue;
+			gb_switch(cable.gb[i]);
+			while(cpu_cycles < cable.stop){
+				if(machine_run(framebuf[i], cable.stop)){
+					cable.cycles[i] = cpu_cycles;
+					return i;
+				}
+			}
+			cable.cycles[i] = cpu_cycles;
+		}
+
+		pair_exchange();
+		cable.stop += PAIR_SLICE;
+		for(int i=0; i<2; i++)
+			if(cable.done[i] != 0 && cable.done[i] < cable.stop)
+				cable.stop = cable.done[i];
+	}
+}
+
+void serial_set_lead(uint32_t cycles) {
+	link_lead = cycles;
+}
+
+void serial_set_transport(int t) {
+	transport = t;
+}
+
+int serial_parse_transport(const char *name) {
+	if(strcmp(name, "tcp")==0)
+		return SERIAL_TRANSPORT_TCP;
+	if(strcmp(name, "unix")==0)
+		return SERIAL_TRANSPORT_UNIX;
+	if(strcmp(name, "shm")==0)
+		return SERIAL_TRANSPORT_SHM;
+	return -1;
+}
+
+static int tcp_serverinit(int port) {
 	int sock0;
 	struct sockaddr_in addr;
 	struct sockaddr_in client;
@@ -111,11 +768,10 @@ int serial_serverinit(int port) {
 			inet_ntoa(client.sin_addr), ntohs(client.sin_port));
 
 	close(sock0);
-	serial_start_recv_thread();	
-	return 0;
+	return serial_start_io_thread();
 }
 
-int serial_clientinit(char *host, int port) {
+static int tcp_clientinit(char *host, int port) {
 	struct sockaddr_in server;
 	if((sock = socket(AF_INET, SOCK_STREAM, 0))<0){
 		perror("socket");
@@ -143,17 +799,227 @@ int serial_clientinit(char *host, int port) {
 		return -1;
 	}
 
-	serial_start_recv_thread();
+	return serial_start_io_thread();
+}
+
+//同じマシン上ではポート番号からソケットのパスを決める
+static void unix_addr(struct sockaddr_un *addr, int port) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	snprintf(addr->sun_path, sizeof(addr->sun_path), "/tmp/gb_emu.%d.sock", port);
+}
+
+static int unix_serverinit(int port) {
+	int sock0;
+	struct sockaddr_un addr;
+
+	if((sock0 = socket(AF_UNIX, SOCK_STREAM, 0))<0){
+		perror("socket");
+		return -1;
+	}
+	unix_addr(&addr, port);
+	unlink(addr.sun_path);
+	if(bind(sock0, (struct sockaddr *)&addr, sizeof(addr))<0){
+		perror("bind");
+		close(sock0);
+		return -1;
+	}
+	if(listen(sock0, 0)<0){
+		perror("listen");
+		close(sock0);
+		unlink(addr.sun_path);
+		return -1;
+	}
+
+	printf("Waiting for connection on %s...\n", addr.sun_path);
+	sock = accept(sock0, NULL, NULL);
+	close(sock0);
+	unlink(addr.sun_path);
+	if(sock < 0){
+		perror("accept");
+		return -1;
+	}
+	printf("Connection on %s\n", addr.sun_path);
+	return serial_start_io_thread();
+}
+
+static int unix_clientinit(int port) {
+	struct sockaddr_un addr;
+	if((sock = socket(AF_UNIX, SOCK_STREAM, 0))<0){
+		perror("socket");
+		return -1;
+	}
+	unix_addr(&addr, port);
+	if(connect(sock, (struct sockaddr *)&addr, sizeof(addr))<0){
+		perror("connect");
+		close(sock);
+		sock = -1;
+		return -1;
+	}
+	return serial_start_io_thread();
+}
+
+//共有メモリはサーバーが作り、クライアントがつないだら名前を消す
+static int shm_serverinit(int port) {
+	char name[64];
+	snprintf(name, sizeof(name), "/gb_emu.%d", port);
+	shm_unlink(name);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if(fd < 0){
+		perror("shm_open");
+		return -1;
+	}
+	if(ftruncate(fd, sizeof(struct shm_link))<0){
+		perror("ftruncate");
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+	struct shm_link *l = mmap(NULL, sizeof(struct shm_link), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(l == MAP_FAILED){
+		perror("mmap");
+		shm_unlink(name);
+		return -1;
+	}
+	//ftruncateで0埋めされているのでリングは空
+	l->lead = link_lead;
+	l->pid[0] = getpid();
+	memcpy(l->magic, "GBL1", 4);
+	atomic_store(&l->state, SHM_WAITING);
+
+	printf("Waiting for connection on %s...\n", name);
+	while(atomic_load(&l->state) == SHM_WAITING)
+		futex(&l->state, FUTEX_WAIT, SHM_WAITING, NULL);
+	shm_unlink(name);
+	if(atomic_load(&l->state) != SHM_CONNECTED){
+		munmap(l, sizeof(struct shm_link));
+		return -1;
+	}
+	printf("Connection on %s\n", name);
+
+	shm = l;
+	shm_tx = 0;
+	atomic_store(&linked, 1);
+	link_begin();
 	return 0;
 }
 
+static int shm_clientinit(int port) {
+	char name[64];
+	snprintf(name, sizeof(name), "/gb_emu.%d", port);
+	int fd = shm_open(name, O_RDWR, 0600);
+	if(fd < 0){
+		perror("shm_open");
+		return -1;
+	}
+	struct stat st;
+	if(fstat(fd, &st)<0 || st.st_size < (off_t)sizeof(struct shm_link)){
+		printf("serial: %s is not ready\n", name);
+		close(fd);
+		return -1;
+	}
+	struct shm_link *l = mmap(NULL, sizeof(struct shm_link), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(l == MAP_FAILED){
+		perror("mmap");
+		return -1;
+	}
+	if(memcmp(l->magic, "GBL1", 4)!=0 || atomic_load(&l->state) != SHM_WAITING){
+		printf("serial: bad handshake on %s\n", name);
+		munmap(l, sizeof(struct shm_link));
+		return -1;
+	}
+	if(l->lead != link_lead){
+		printf("serial: link lead mismatch (local %u, peer %u)\n", link_lead, l->lead);
+		munmap(l, sizeof(struct shm_link));
+		return -1;
+	}
+	l->pid[1] = getpid();
+	atomic_store(&l->state, SHM_CONNECTED);
+	futex(&l->state, FUTEX_WAKE, 1, NULL);
+
+	shm = l;
+	shm_tx = 1;
+	atomic_store(&linked, 1);
+	link_begin();
+	return 0;
+}
+
+int serial_serverinit(int port) {
+	switch(transport){
+	case SERIAL_TRANSPORT_UNIX:
+		return unix_serverinit(port);
+	case SERIAL_TRANSPORT_SHM:
+		return shm_serverinit(port);
+	default:
+		return tcp_serverinit(port);
+	}
+}
+
+int serial_clientinit(char *host, int port) {
+	switch(transport){
+	case SERIAL_TRANSPORT_UNIX:
+		return unix_clientinit(port);
+	case SERIAL_TRANSPORT_SHM:
+		return shm_clientinit(port);
+	default:
+		return tcp_clientinit(host, port);
+	}
+}
+
+//相手にも切断を知らせ、寝ていれば起こす
+static void shm_close() {
+	atomic_store(&shm->state, SHM_CLOSED);
+	for(int i=0; i<2; i++){
+		atomic_fetch_add(&shm->ring[i].seq, 1);
+		futex(&shm->ring[i].seq, FUTEX_WAKE, 1, NULL);
+	}
+}
+
 int serial_linked() {
-	if(sock<0) return 0;
-	else return 1;
+	return atomic_load(&linked);
+}
+
+//終了時にロックステップの待ちから抜けられるよう接続を切る
+//ソケットはI/Oスレッドのものなので、ここでは止めるよう頼むだけ(閉じるのはI/Oスレッド)
+void serial_shutdown() {
+	if(shm != NULL)
+		shm_close();
+	else if(io_running){
+		atomic_store(&io_quit, 1);
+		io_wake();
+	}
+}
+
+void serial_print_stats() {
+	if(!io_running && shm == NULL)
+		return;
+	printf("link: lead %u cycles, %llu stalls, %.1fms waiting\n", link_lead, stall_count, stall_ns/1e6);
 }
 
 void serial_close() {
-	close(sock);
+	if(io_running){
+		atomic_store(&io_quit, 1);
+		io_wake();
+		pthread_join(io_thread, NULL);
+		io_running = 0;
+		close(wake_pipe[0]);
+		close(wake_pipe[1]);
+		sem_destroy(&rx_sem);
+		sem_destroy(&rx_space_sem);
+		sem_destroy(&tx_space_sem);
+		spsc_free(&rx_queue);
+		spsc_free(&tx_queue);
+	}
+	if(shm != NULL){
+		shm_close();
+		munmap(shm, sizeof(struct shm_link));
+		shm = NULL;
+	}
+	if(sock >= 0)
+		close(sock);
 	sock = -1;
+	atomic_store(&linked, 0);
+	active = 0;
 }
-
@@ -1,15 +1,39 @@
 #pragma once
 
 #include <inttypes.h>
+#include "gb.h"
 
-extern int serial_received;
-extern int serial_sent;
-extern int serial_remaining;
-extern uint8_t serial_recv_buffer;
+//相手より先に進んでよいサイクル数の既定値(マスターの転送はこの2倍かかる)
+#define SERIAL_LEAD_DEFAULT 20000
 
+//通信路(UNIXと共有メモリは同じマシン上のみ。名前はポート番号から決まる)
+#define SERIAL_TRANSPORT_TCP	0
+#define SERIAL_TRANSPORT_UNIX	1
+#define SERIAL_TRANSPORT_SHM	2
+
+extern GB_LOCAL int serial_sent;
+extern GB_LOCAL uint64_t serial_next_check;
+
+struct gb;
+struct state_buf;
+struct serial_context;
+
+struct serial_context *serial_context_new(void);
+void serial_context_save(struct serial_context *ctx);
+void serial_context_load(const struct serial_context *ctx);
+void serial_state_save(struct state_buf *b);
+void serial_state_load(struct state_buf *b);
+void serial_pair(struct gb *a, struct gb *b);
+int serial_pair_run(uint32_t *framebuf[2]);
 void serial_send(uint8_t data);
+void serial_update(void);
+void serial_set_lead(uint32_t cycles);
+void serial_set_transport(int transport);
+int serial_parse_transport(const char *name);
 int serial_recv(void);
 int serial_serverinit(int port);
 int serial_clientinit(char *host, int port);
 int serial_linked(void);
+void serial_shutdown(void);
+void serial_print_stats(void);
 void serial_close(void);
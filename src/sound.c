@@ -1,34 +1,53 @@
 #include "sound.h"
 #include "memory.h"
-#include "SDL2/SDL.h"
-#include <math.h>
+#include "cpu.h"
+#include "mixer.h"
+#include "state.h"
+#include "prof.h"
+#include "gb.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//レジスタへの書き込みはCPUサイクルのタイムスタンプ付きでログに積むだけにして、
+//フレームの終わりにまとめて正しい時刻で波形を合成する(band-limited step合成)
+//合成はエミュレーションスレッドで行い、出来上がったサンプルはsound_set_outputの送り先(audio.c)へ渡す
+
+//デューティ比ごとの8ステップの波形
+static const uint8_t duty_table[4][8] = {
+	{0,0,0,0,0,0,0,1}, //12.5%
+	{1,0,0,0,0,0,0,1}, //25%
+	{1,0,0,0,0,1,1,1}, //50%
+	{0,1,1,1,1,1,1,0}, //75%
+};
+
+//ノイズのLFSRを1回進める周期(CPUサイクル) = noise_divisor[ratio] << shiftclk_freq
+static const int noise_divisor[8] = {8, 16, 32, 48, 64, 80, 96, 112};
 
-const double duty_table[4] = {0.125, 0.25, 0.5, 0.75};
+#define GB_CLOCK 4194304
+#define SEQUENCER_PERIOD (GB_CLOCK/512) //フレームシーケンサの周期(サイクル)
 
 struct rect_channel {
 	int sweep_diff;
 	int sweep_dir;
 	int sweep_time;
-	int sweep_steps;
 	int length;
 	int duty_num;
 	int envelope_time;
 	int envelope_dir;
 	int envelope_init_volume;
-	int envelope_steps;
 	int freq;
-	double real_freq;
 	int counter_enabled;
 	int right_enabled;
 	int left_enabled;
 	int status;
-	int prev;
-	int sweep_countdown;
 	int volume;
-	int restart;
-	unsigned int step;
-	int remaining_time; //ms
-	int ms_countdown;
+	int timer;           //次にデューティのステップを進めるまでのサイクル数
+	int duty_pos;
+	int length_counter;  //1/256秒単位
+	int envelope_counter;
+	int sweep_counter;
 };
 
 struct wave_channel {
@@ -40,12 +59,9 @@ struct wave_channel {
 	int right_enabled;
 	int left_enabled;
 	int status;
-	unsigned int step;
-	int remaining_time;
-	int restart;
-	int ms_countdown;
-	int wave_index;
-	double precalc;
+	int timer;
+	int pos;             //波形RAMの何サンプル目か(0-31)
+	int length_counter;
 };
 
 struct noise_channel {
@@ -60,15 +76,11 @@ struct noise_channel {
 	int right_enabled;
 	int left_enabled;
 	int status;
-	unsigned int step;
-	int restart;
 	int volume;
-	int gen_steps;
+	int timer;
 	uint16_t shiftreg;
-	int prng_out;
-	int envelope_steps;
-	int remaining_time;
-	int ms_countdown;
+	int length_counter;
+	int envelope_counter;
 };
 
 struct master_volume {
@@ -80,24 +92,500 @@ struct master_volume {
 };
 
 
-static SDL_AudioSpec Desired;
-static SDL_AudioSpec Obtained;
+static GB_LOCAL struct rect_channel ch1, ch2;
+static GB_LOCAL struct wave_channel ch3;
+static GB_LOCAL struct noise_channel ch4;
+static GB_LOCAL struct master_volume master;
+static GB_LOCAL uint8_t wave_ram[16]; //合成側から見た波形RAM
+
+static GB_LOCAL int sample_rate = 0; //0ならオーディオ無効(波形は合成せず、読み出せる状態だけを遅延評価で進める)
+static GB_LOCAL int speculative_rate = 0; //先読み中に止めているsample_rate
 
-static struct rect_channel ch1, ch2;
-static struct wave_channel ch3;
-static struct noise_channel ch4;
-static struct master_volume master;
+//512Hzのフレームシーケンサ(長さ256Hz, スイープ128Hz, エンベロープ64Hz)
+static GB_LOCAL int seq_timer = SEQUENCER_PERIOD;
+static GB_LOCAL int seq_step;
 
-static int obtfreq_div1000;
+//レジスタ書き込みのログ
+struct reg_write {
+	uint64_t cycle;
+	uint8_t ioreg;
+	uint8_t value;
+};
+#define REG_LOG_SIZE 4096
+static GB_LOCAL struct reg_write reg_log_default[REG_LOG_SIZE]; //インスタンスを作らずに使うときのログ
+static GB_LOCAL struct reg_write *reg_log = NULL;
+static GB_LOCAL int reg_log_count = 0;
+
+static GB_LOCAL uint64_t synth_cycle = 0; //ここまで合成した(CPUサイクル)
+
+//band-limited step合成のバッファ(チャンネルごとにモノラル)
+//振幅の変化をサンプル間の位置に応じた帯域制限済みインパルスとして足し込み、読み出し時に積分する
+#define BLIP_PHASES 32    //サンプル間の位置の分解能
+#define BLIP_WIDTH 16     //カーネルのタップ数
+#define BLIP_SIZE 4096    //1度に溜められるサンプル数
+#define BLIP_UNIT_BITS 15 //カーネルの各行の合計 = 1<<BLIP_UNIT_BITS
+struct blip {
+	int32_t buf[BLIP_SIZE + BLIP_WIDTH];
+	int32_t integrator;
+};
+//窓付きsincを各位相についてタップの合計がちょうど1になるように量子化したもの
+//ホストの浮動小数点・libmによらず同じ波形になるよう、tools/blip_kernel.pyで作った表を入れておく
+static const int16_t blip_kernel[BLIP_PHASES][BLIP_WIDTH] = {
+	{18, -110, 359, -843, 1561, -2371, 3025, 29490, 3025, -2371, 1561, -843, 359, -110, 18, 0},
+	{17, -108, 347, -795, 1421, -2025, 2117, 29452, 3974, -2714, 1693, -887, 369, -111, 18, 0},
+	{17, -105, 332, -742, 1276, -1679, 1252, 29332, 4960, -3051, 1818, -925, 376, -110, 17, 0},
+	{16, -102, 315, -686, 1128, -1335, 434, 29131, 5981, -3378, 1932, -956, 380, -109, 17, 0},
+	{16, -98, 297, -627, 977, -997, -336, 28853, 7031, -3693, 2036, -982, 381, -106, 16, 0},
+	{15, -93, 277, -566, 824, -665, -1055, 28499, 8106, -3992, 2127, -999, 378, -103, 15, 0},
+	{14, -87, 256, -503, 672, -343, -1721, 28067, 9203, -4273, 2204, -1009, 372, -97, 13, 0},
+	{13, -82, 234, -439, 522, -34, -2334, 27565, 10317, -4531, 2266, -1011, 362, -91, 11, 0},
+	{12, -76, 211, -375, 374, 262, -2891, 26992, 11444, -4765, 2311, -1004, 348, -83, 8, 0},
+	{10, -69, 188, -311, 229, 543, -3394, 26350, 12577, -4970, 2339, -987, 330, -73, 6, 0},
+	{9, -63, 165, -248, 90, 807, -3840, 25646, 13712, -5144, 2348, -962, 308, -62, 2, 0},
+	{8, -56, 142, -186, -44, 1052, -4231, 24877, 14845, -5283, 2338, -926, 282, -50, -1, 1},
+	{7, -50, 119, -126, -171, 1277, -4566, 24057, 15970, -5386, 2307, -881, 251, -36, -5, 1},
+	{6, -44, 96, -68, -291, 1482, -4846, 23182, 17081, -5448, 2255, -825, 217, -21, -10, 2},
+	{5, -37, 74, -12, -403, 1666, -5072, 22257, 18174, -5467, 2182, -760, 178, -4, -15, 2},
+	{4, -31, 53, 41, -506, 1828, -5246, 21289, 19243, -5441, 2086, -685, 136, 14, -20, 3},
+	{3, -25, 33, 90, -600, 1968, -5368, 20283, 20283, -5368, 1968, -600, 90, 33, -25, 3},
+	{3, -20, 14, 136, -685, 2086, -5441, 19243, 21289, -5246, 1828, -506, 41, 53, -31, 4},
+	{2, -15, -4, 178, -760, 2182, -5467, 18174, 22257, -5072, 1666, -403, -12, 74, -37, 5},
+	{2, -10, -21, 217, -825, 2255, -5448, 17081, 23182, -4846, 1482, -291, -68, 96, -44, 6},
+	{1, -5, -36, 251, -881, 2307, -5386, 15970, 24057, -4566, 1277, -171, -126, 119, -50, 7},
+	{1, -1, -50, 282, -926, 2338, -5283, 14845, 24877, -4231, 1052, -44, -186, 142, -56, 8},
+	{0, 2, -62, 308, -962, 2348, -5144, 13712, 25646, -3840, 807, 90, -248, 165, -63, 9},
+	{0, 6, -73, 330, -987, 2339, -4970, 12577, 26350, -3394, 543, 229, -311, 188, -69, 10},
+	{0, 8, -83, 348, -1004, 2311, -4765, 11444, 26992, -2891, 262, 374, -375, 211, -76, 12},
+	{0, 11, -91, 362, -1011, 2266, -4531, 10317, 27565, -2334, -34, 522, -439, 234, -82, 13},
+	{0, 13, -97, 372, -1009, 2204, -4273, 9203, 28067, -1721, -343, 672, -503, 256, -87, 14},
+	{0, 15, -103, 378, -999, 2127, -3992, 8106, 28499, -1055, -665, 824, -566, 277, -93, 15},
+	{0, 16, -106, 381, -982, 2036, -3693, 7031, 28853, -336, -997, 977, -627, 297, -98, 16},
+	{0, 17, -109, 380, -956, 1932, -3378, 5981, 29131, 434, -1335, 1128, -686, 315, -102, 16},
+	{0, 17, -110, 376, -925, 1818, -3051, 4960, 29332, 1252, -1679, 1276, -742, 332, -105, 17},
+	{0, 18, -111, 369, -887, 1693, -2714, 3974, 29452, 2117, -2025, 1421, -795, 347, -108, 17},
+};
+static GB_LOCAL struct blip *blip_ch; //[MIXER_CHANNELS] 合成するときだけ確保する
+static GB_LOCAL uint64_t blip_pos;    //バッファ先頭からの位置(サンプル, 32.32固定小数点)
+static GB_LOCAL uint64_t blip_factor; //1サイクルあたりのサンプル数(32.32固定小数点)
+static GB_LOCAL int out_level[MIXER_CHANNELS]; //最後に足し込んだ各チャンネルの出力レベル
+#define CHANNEL_UNIT 256 //チャンネルの出力レベル1あたりの振幅
+
+//ミキサー
+static GB_LOCAL int16_t channel_block[MIXER_CHANNELS][BLIP_SIZE];
+static GB_LOCAL struct dc_block dc;
+static atomic_uint mute_mask; //bit0-3: ch1-4をミュート(全インスタンスで共有)
+static GB_LOCAL sound_tap_func tap_func;
+static GB_LOCAL void *tap_userdata;
+static GB_LOCAL sound_output_func output_func;
+static GB_LOCAL void *output_userdata;
+
+
+static void catch_up(uint64_t cycle);
+static void blip_flush(void);
+
+//インスタンスごとの状態(gb_switchで入れ替える)
+//出力先もインスタンスごとで、ミュートの設定だけが共有。合成はsample_rateが0でないインスタンスだけが行う
+struct sound_context {
+	struct rect_channel ch1, ch2;
+	struct wave_channel ch3;
+	struct noise_channel ch4;
+	struct master_volume master;
+	uint8_t wave_ram[16];
+	int sample_rate, speculative_rate;
+	int seq_timer, seq_step;
+	struct reg_write *reg_log;
+	int reg_log_count;
+	uint64_t synth_cycle;
+	struct blip *blip_ch;
+	uint64_t blip_pos, blip_factor;
+	int out_level[MIXER_CHANNELS];
+	struct dc_block dc;
+	sound_tap_func tap_func;
+	void *tap_userdata;
+	sound_output_func output_func;
+	void *output_userdata;
+};
 
-#define REAL_FREQ(freq) (131072.0 / (2048.0 - (freq)))
+struct sound_context *sound_context_new() {
+	struct sound_context *ctx = calloc(1, sizeof(struct sound_context));
+	if(ctx == NULL)
+		return NULL;
+	ctx->reg_log = malloc(REG_LOG_SIZE * sizeof(struct reg_write));
+	if(ctx->reg_log == NULL){
+		free(ctx);
+		return NULL;
+	}
+	ctx->seq_timer = SEQUENCER_PERIOD;
+	return ctx;
+}
 
-static double rectwave(double t, double duty) {
-  return t - abs(t) < duty ? 1 : -1;
+void sound_context_free(struct sound_context *ctx) {
+	if(ctx == NULL)
+		return;
+	free(ctx->reg_log);
+	free(ctx->blip_ch);
+	free(ctx);
 }
 
+void sound_context_save(struct sound_context *ctx) {
+	ctx->ch1 = ch1; ctx->ch2 = ch2; ctx->ch3 = ch3; ctx->ch4 = ch4;
+	ctx->master = master;
+	memcpy(ctx->wave_ram, wave_ram, sizeof(wave_ram));
+	ctx->sample_rate = sample_rate; ctx->speculative_rate = speculative_rate;
+	ctx->seq_timer = seq_timer; ctx->seq_step = seq_step;
+	ctx->reg_log = reg_log; ctx->reg_log_count = reg_log_count;
+	ctx->synth_cycle = synth_cycle;
+	ctx->blip_ch = blip_ch; ctx->blip_pos = blip_pos; ctx->blip_factor = blip_factor;
+	memcpy(ctx->out_level, out_level, sizeof(out_level));
+	ctx->dc = dc;
+	ctx->tap_func = tap_func; ctx->tap_userdata = tap_userdata;
+	ctx->output_func = output_func; ctx->output_userdata = output_userdata;
+}
 
-void sound_ch1_writereg(uint16_t ioreg, uint8_t value) {
+void sound_context_load(const struct sound_context *ctx) {
+	ch1 = ctx->ch1; ch2 = ctx->ch2; ch3 = ctx->ch3; ch4 = ctx->ch4;
+	master = ctx->master;
+	memcpy(wave_ram, ctx->wave_ram, sizeof(wave_ram));
+	sample_rate = ctx->sample_rate; speculative_rate = ctx->speculative_rate;
+	seq_timer = ctx->seq_timer; seq_step = ctx->seq_step;
+	reg_log = ctx->reg_log; reg_log_count = ctx->reg_log_count;
+	synth_cycle = ctx->synth_cycle;
+	blip_ch = ctx->blip_ch; blip_pos = ctx->blip_pos; blip_factor = ctx->blip_factor;
+	memcpy(out_level, ctx->out_level, sizeof(out_level));
+	dc = ctx->dc;
+	tap_func = ctx->tap_func; tap_userdata = ctx->tap_userdata;
+	output_func = ctx->output_func; output_userdata = ctx->output_userdata;
+}
+
+//出力側(blip・DCカット)の状態
+//読み込んだあとの波形が保存したときの続きになるよう、出力レベル・積分値・カーネルの裾も保存する
+struct blip_state {
+	int32_t tail[MIXER_CHANNELS][BLIP_WIDTH];
+	int32_t integrator[MIXER_CHANNELS];
+	int32_t out_level[MIXER_CHANNELS];
+	uint64_t frac; //サンプル間の位置(32.32固定小数点の小数部)
+	struct dc_block dc;
+};
+
+//ステートセーブの前に書き込みのログを反映して空にしておく(読み出しと同じで、いつ進めても結果は変わらない)
+void sound_sync() {
+	catch_up(cpu_cycles);
+}
+
+//ステートセーブ(先にsound_syncを呼んでおく。ここでは状態を変えない)
+//まだ取り出していないサンプルは積分値に含め、その先の裾だけを書く
+void sound_state_save(struct state_buf *b) {
+	struct blip_state bs;
+	memset(&bs, 0, sizeof(bs));
+	if(blip_ch != NULL){
+		int count = blip_pos >> 32;
+		for(int c=0; c<MIXER_CHANNELS; c++){
+			int32_t acc = blip_ch[c].integrator;
+			for(int i=0; i<count; i++)
+				acc += blip_ch[c].buf[i];
+			bs.integrator[c] = acc;
+			memcpy(bs.tail[c], blip_ch[c].buf + count, sizeof(bs.tail[c]));
+			bs.out_level[c] = out_level[c];
+		}
+		bs.frac = blip_pos & 0xffffffff;
+		bs.dc = dc;
+	}
+	state_put(b, &ch1, sizeof(ch1));
+	state_put(b, &ch2, sizeof(ch2));
+	state_put(b, &ch3, sizeof(ch3));
+	state_put(b, &ch4, sizeof(ch4));
+	state_put(b, &master, sizeof(master));
+	state_put(b, wave_ram, sizeof(wave_ram));
+	state_put(b, &seq_timer, sizeof(seq_timer));
+	state_put(b, &seq_step, sizeof(seq_step));
+	state_put(b, &synth_cycle, sizeof(synth_cycle));
+	state_put(b, &bs, sizeof(bs));
+}
+
+void sound_state_load(struct state_buf *b) {
+	state_get(b, &ch1, sizeof(ch1));
+	state_get(b, &ch2, sizeof(ch2));
+	state_get(b, &ch3, sizeof(ch3));
+	state_get(b, &ch4, sizeof(ch4));
+	state_get(b, &master, sizeof(master));
+	state_get(b, wave_ram, sizeof(wave_ram));
+	state_get(b, &seq_timer, sizeof(seq_timer));
+	state_get(b, &seq_step, sizeof(seq_step));
+	state_get(b, &synth_cycle, sizeof(synth_cycle));
+	reg_log_count = 0;
+
+	struct blip_state bs;
+	state_get(b, &bs, sizeof(bs));
+	//合成を始める前に読み込んだときも、あとで始めたときに続きになるよう用意しておく
+	if(blip_ch == NULL && (blip_ch = calloc(MIXER_CHANNELS, sizeof(struct blip))) == NULL)
+		return;
+	//読み込む前の分は出してしまう(先読み中は合成していないので何もない)
+	if(sample_rate != 0)
+		blip_flush();
+	for(int c=0; c<MIXER_CHANNELS; c++){
+		memset(blip_ch[c].buf, 0, sizeof(blip_ch[c].buf));
+		memcpy(blip_ch[c].buf, bs.tail[c], sizeof(bs.tail[c]));
+		blip_ch[c].integrator = bs.integrator[c];
+		out_level[c] = bs.out_level[c];
+	}
+	blip_pos = bs.frac;
+	dc = bs.dc;
+}
+
+static void blip_add(struct blip *b, int delta) {
+	int index = blip_pos >> 32;
+	const int16_t *k = blip_kernel[(blip_pos >> (32-5)) & (BLIP_PHASES-1)];
+	for(int i=0; i<BLIP_WIDTH; i++)
+		b->buf[index+i] += k[i] * delta;
+}
+
+//countサンプルを積分して取り出す
+static void blip_read(struct blip *b, int16_t *out, int count) {
+	for(int i=0; i<count; i++){
+		b->integrator += b->buf[i];
+		int s = b->integrator >> BLIP_UNIT_BITS;
+		out[i] = s > 32767 ? 32767 : s < -32768 ? -32768 : s;
+	}
+	memmove(b->buf, b->buf + count, BLIP_WIDTH * sizeof(int32_t));
+	memset(b->buf + BLIP_WIDTH, 0, count * sizeof(int32_t));
+}
+
+
+//溜まった完成済みのサンプルをチャンネルごとに取り出し、
+//現在のNR50/NR51/NR52の設定で混ぜてリングバッファへ送る
+static void blip_flush() {
+	static GB_LOCAL int16_t frames[BLIP_SIZE * 2];
+	int count = blip_pos >> 32;
+	if(count == 0)
+		return;
+	for(int c=0; c<MIXER_CHANNELS; c++)
+		blip_read(&blip_ch[c], channel_block[c], count);
+	blip_pos -= (uint64_t)count << 32;
+
+	//ゲイン = マスターボリューム+1 (0~8)
+	const int left_enabled[MIXER_CHANNELS] = {ch1.left_enabled, ch2.left_enabled, ch3.left_enabled, ch4.left_enabled};
+	const int right_enabled[MIXER_CHANNELS] = {ch1.right_enabled, ch2.right_enabled, ch3.right_enabled, ch4.right_enabled};
+	unsigned int mute = atomic_load_explicit(&mute_mask, memory_order_relaxed);
+	int16_t gain_left[MIXER_CHANNELS], gain_right[MIXER_CHANNELS];
+	for(int c=0; c<MIXER_CHANNELS; c++){
+		int on = master.all_enabled && !(mute>>c & 1);
+		gain_left[c] = on && left_enabled[c] ? master.left_volume+1 : 0;
+		gain_right[c] = on && right_enabled[c] ? master.right_volume+1 : 0;
+	}
+	const int16_t *const channels[MIXER_CHANNELS] = {channel_block[0], channel_block[1], channel_block[2], channel_block[3]};
+	mixer_mix(channels, gain_left, gain_right, &dc, frames, count);
+
+	if(tap_func != NULL)
+		tap_func(channels, frames, count, tap_userdata);
+
+	if(output_func != NULL)
+		output_func(frames, count, output_userdata);
+}
+
+static int rect_output(struct rect_channel *ch) {
+	if(!ch->status)
+		return 0;
+	return duty_table[ch->duty_num][ch->duty_pos] ? ch->volume : -ch->volume;
+}
+
+static int wave_output() {
+	if(!ch3.status || !ch3.enabled || !ch3.volume_ratio)
+		return 0;
+	int frame = wave_ram[ch3.pos/2];
+	frame = ch3.pos%2 ? frame&0xf : frame>>4;
+	return frame >> (ch3.volume_ratio-1);
+}
+
+static int noise_output() {
+	if(!ch4.status)
+		return 0;
+	return (~ch4.shiftreg & 1) * ch4.volume;
+}
+
+//現在の状態から各チャンネルの出力レベルを求め、変化があれば差分を足し込む
+//パンやマスターボリュームはミキサーでかける
+static void update_output() {
+	if(sample_rate == 0)
+		return;
+
+	int level[MIXER_CHANNELS] = {rect_output(&ch1), rect_output(&ch2), wave_output(), noise_output()};
+	for(int c=0; c<MIXER_CHANNELS; c++){
+		if(level[c] != out_level[c]){
+			blip_add(&blip_ch[c], (level[c] - out_level[c]) * CHANNEL_UNIT);
+			out_level[c] = level[c];
+		}
+	}
+}
+
+static int rect_period(struct rect_channel *ch) {
+	return (2048 - ch->freq) * 4;
+}
+
+static int wave_period() {
+	return (2048 - ch3.freq) * 2;
+}
+
+static int noise_period() {
+	return noise_divisor[ch4.ratio] << ch4.shiftclk_freq;
+}
+
+static void envelope_trigger(int *volume, int *counter, int init_volume, int time) {
+	*volume = init_volume;
+	*counter = time;
+}
+
+static void envelope_clock(int *volume, int *counter, int time, int dir) {
+	if(time == 0)
+		return;
+	if(--*counter > 0)
+		return;
+	*counter = time;
+	if(dir==1){
+		if(*volume<15) (*volume)++;
+	}else{
+		if(*volume>0) (*volume)--;
+	}
+}
+
+static void length_clock(int *counter, int enabled, int *status) {
+	if(enabled && *counter > 0 && --*counter == 0)
+		*status = 0;
+}
+
+static void sweep_clock() {
+	if(ch1.sweep_time == 0)
+		return;
+	if(--ch1.sweep_counter > 0)
+		return;
+	ch1.sweep_counter = ch1.sweep_time;
+	int delta = ch1.freq >> ch1.sweep_diff;
+	int next = ch1.sweep_dir ? ch1.freq - delta : ch1.freq + delta;
+	if(next > 2047){
+		ch1.status = 0;
+	}else if(ch1.sweep_diff != 0 && next >= 0){
+		ch1.freq = next;
+	}
+}
+
+//512Hzで呼ばれる
+static void sequencer_clock() {
+	if((seq_step & 1) == 0){
+		length_clock(&ch1.length_counter, ch1.counter_enabled, &ch1.status);
+		length_clock(&ch2.length_counter, ch2.counter_enabled, &ch2.status);
+		length_clock(&ch3.length_counter, ch3.counter_enabled, &ch3.status);
+		length_clock(&ch4.length_counter, ch4.counter_enabled, &ch4.status);
+	}
+	if(seq_step == 2 || seq_step == 6)
+		sweep_clock();
+	if(seq_step == 7){
+		envelope_clock(&ch1.volume, &ch1.envelope_counter, ch1.envelope_time, ch1.envelope_dir);
+		envelope_clock(&ch2.volume, &ch2.envelope_counter, ch2.envelope_time, ch2.envelope_dir);
+		envelope_clock(&ch4.volume, &ch4.envelope_counter, ch4.envelope_time, ch4.envelope_dir);
+	}
+	seq_step = (seq_step + 1) & 7;
+}
+
+static void rect_trigger(struct rect_channel *ch) {
+	ch->status = 1;
+	envelope_trigger(&ch->volume, &ch->envelope_counter, ch->envelope_init_volume, ch->envelope_time);
+	ch->length_counter = 64 - ch->length;
+	ch->timer = rect_period(ch);
+}
+
+static void ch3_trigger() {
+	ch3.status = 1;
+	ch3.length_counter = 256 - ch3.length;
+	ch3.pos = 0;
+	ch3.timer = wave_period();
+}
+
+static void ch4_trigger() {
+	ch4.status = 1;
+	envelope_trigger(&ch4.volume, &ch4.envelope_counter, ch4.envelope_init_volume, ch4.envelope_time);
+	ch4.length_counter = 64 - ch4.length;
+	ch4.timer = noise_period();
+	ch4.shiftreg = 0x7fff;
+}
+
+//15bit(cycle=1なら7bit)のLFSRを1回進める
+static void noise_step() {
+	int bit = (ch4.shiftreg ^ (ch4.shiftreg >> 1)) & 1;
+	ch4.shiftreg = (ch4.shiftreg >> 1) | (bit << 14);
+	if(ch4.cycle)
+		ch4.shiftreg = (ch4.shiftreg & ~0x40) | (bit << 6);
+}
+
+//オーディオ無効時はフレームシーケンサだけを進める
+//ゲームから見えるのは長さカウンタ・スイープによる停止・エンベロープ(NR52のステータス)だけなので
+//デューティ・波形RAMの位置・LFSRは進めなくてよい
+static void sequencer_run(uint64_t cycle) {
+	while(cycle - synth_cycle >= (uint64_t)seq_timer){
+		synth_cycle += seq_timer;
+		sequencer_clock();
+		seq_timer = SEQUENCER_PERIOD;
+	}
+	seq_timer -= cycle - synth_cycle;
+	synth_cycle = cycle;
+}
+
+//synth_cycleからcycleまで、次に何かが起きる時刻ごとに区切って合成する
+static void synth_run(uint64_t cycle) {
+	if(sample_rate == 0){
+		if(cycle > synth_cycle)
+			sequencer_run(cycle);
+		return;
+	}
+
+	while(synth_cycle < cycle){
+		uint64_t n = cycle - synth_cycle;
+		if(n > (uint64_t)seq_timer) n = seq_timer;
+		if(ch1.status && n > (uint64_t)ch1.timer) n = ch1.timer;
+		if(ch2.status && n > (uint64_t)ch2.timer) n = ch2.timer;
+		if(ch3.status && n > (uint64_t)ch3.timer) n = ch3.timer;
+		if(ch4.status && n > (uint64_t)ch4.timer) n = ch4.timer;
+		if(blip_factor){
+			//バッファに入り切る分だけ進める
+			uint64_t room = (((uint64_t)BLIP_SIZE << 32) - blip_pos) / blip_factor;
+			if(room == 0){
+				blip_flush();
+				continue;
+			}
+			if(n > room) n = room;
+		}
+
+		synth_cycle += n;
+		blip_pos += n * blip_factor;
+		seq_timer -= n;
+		if(ch1.status) ch1.timer -= n;
+		if(ch2.status) ch2.timer -= n;
+		if(ch3.status) ch3.timer -= n;
+		if(ch4.status) ch4.timer -= n;
+
+		if(ch1.status && ch1.timer == 0){
+			ch1.duty_pos = (ch1.duty_pos + 1) & 7;
+			ch1.timer = rect_period(&ch1);
+		}
+		if(ch2.status && ch2.timer == 0){
+			ch2.duty_pos = (ch2.duty_pos + 1) & 7;
+			ch2.timer = rect_period(&ch2);
+		}
+		if(ch3.status && ch3.timer == 0){
+			ch3.pos = (ch3.pos + 1) & 31;
+			ch3.timer = wave_period();
+		}
+		if(ch4.status && ch4.timer == 0){
+			noise_step();
+			ch4.timer = noise_period();
+		}
+		if(seq_timer == 0){
+			sequencer_clock();
+			seq_timer = SEQUENCER_PERIOD;
+		}
+		update_output();
+	}
+}
+
+static void ch1_write(uint16_t ioreg, uint8_t value) {
 	switch(ioreg){
 	case IO_NR10_R:
 		ch1.sweep_diff=value&0x7;
@@ -115,18 +603,19 @@ void sound_ch1_writereg(uint16_t ioreg, uint8_t value) {
 		break;
 	case IO_NR13_R:
 		ch1.freq=(ch1.freq&0x700)|value;
-		ch1.real_freq = REAL_FREQ(ch1.freq);
 		break;
 	case IO_NR14_R:
 		ch1.freq=(ch1.freq&0xff)|((value&0x7)<<8);
-		ch1.real_freq = REAL_FREQ(ch1.freq);
 		ch1.counter_enabled=value>>6&0x1;
-		ch1.restart=value>>7;
+		if(value>>7){
+			rect_trigger(&ch1);
+			ch1.sweep_counter = ch1.sweep_time;
+		}
 		break;
 	}
 }
 
-void sound_ch2_writereg(uint16_t ioreg, uint8_t value) {
+static void ch2_write(uint16_t ioreg, uint8_t value) {
 	switch(ioreg){
 	case IO_NR21_R:
 		ch2.length=value&0x3f;
@@ -139,18 +628,17 @@ void sound_ch2_writereg(uint16_t ioreg, uint8_t value) {
 		break;
 	case IO_NR23_R:
 		ch2.freq=(ch2.freq&0x700)|value;
-		ch2.real_freq = REAL_FREQ(ch2.freq);
 		break;
 	case IO_NR24_R:
 		ch2.freq=(ch2.freq&0xff)|((value&0x7)<<8);
-		ch2.real_freq = REAL_FREQ(ch2.freq);
 		ch2.counter_enabled=value>>6&0x1;
-		ch2.restart=value>>7;
+		if(value>>7)
+			rect_trigger(&ch2);
 		break;
 	}
 }
 
-void sound_ch3_writereg(uint16_t ioreg, uint8_t value) {
+static void ch3_write(uint16_t ioreg, uint8_t value) {
 	switch(ioreg){
 	case IO_NR30_R:
 		ch3.enabled = value>>7;
@@ -163,18 +651,20 @@ void sound_ch3_writereg(uint16_t ioreg, uint8_t value) {
 		break;
 	case IO_NR33_R:
 		ch3.freq=(ch3.freq&0x700)|value;
-		ch3.precalc = ((65535.0/(2048.0-ch3.freq))*32.0);
 		break;
 	case IO_NR34_R:
 		ch3.freq=(ch3.freq&0xff)|((value&0x7)<<8);
-		ch3.precalc = ((65535.0/(2048.0-ch3.freq))*32.0);
 		ch3.counter_enabled=value>>6&0x1;
-		ch3.restart=value>>7;
+		if(value>>7)
+			ch3_trigger();
+		break;
+	default:
+		wave_ram[ioreg-IO_WAVERAM_BEGIN_R] = value;
 		break;
 	}
 }
 
-void sound_ch4_writereg(uint16_t ioreg, uint8_t value) {
+static void ch4_write(uint16_t ioreg, uint8_t value) {
 	switch(ioreg){
 	case IO_NR41_R:
 		ch4.length=value&0x3f;
@@ -191,12 +681,13 @@ void sound_ch4_writereg(uint16_t ioreg, uint8_t value) {
 		break;
 	case IO_NR44_R:
 		ch4.counter_enabled=value>>6&0x1;
-		ch4.restart=value>>7;
+		if(value>>7)
+			ch4_trigger();
 		break;
 	}
 }
 
-void sound_master_writereg(uint16_t ioreg, uint8_t value) {
+static void master_write(uint16_t ioreg, uint8_t value) {
 	switch(ioreg){
 	case IO_NR50_R:
 		master.right_volume=value&0x7;
@@ -220,7 +711,99 @@ void sound_master_writereg(uint16_t ioreg, uint8_t value) {
 	}
 }
 
+static void apply_write(uint16_t ioreg, uint8_t value) {
+	if(ioreg <= IO_NR14_R)
+		ch1_write(ioreg, value);
+	else if(ioreg <= IO_NR24_R)
+		ch2_write(ioreg, value);
+	else if(ioreg <= IO_NR34_R || ioreg >= IO_WAVERAM_BEGIN_R)
+		ch3_write(ioreg, value);
+	else if(ioreg <= IO_NR44_R)
+		ch4_write(ioreg, value);
+	else{
+		//ミキサーの設定はブロック単位でかかるので、変わる前の分を先に混ぜておく
+		if(sample_rate != 0)
+			blip_flush();
+		master_write(ioreg, value);
+	}
+	update_output();
+}
+
+//ログを順に適用しながらcycleまで合成する
+static void catch_up(uint64_t cycle) {
+	PROF_BEGIN(PROF_APU);
+	for(int i=0; i<reg_log_count; i++){
+		synth_run(reg_log[i].cycle);
+		apply_write(reg_log[i].ioreg, reg_log[i].value);
+	}
+	reg_log_count = 0;
+	synth_run(cycle);
+	PROF_END();
+}
+
+static void log_write(uint16_t ioreg, uint8_t value) {
+	if(reg_log == NULL)
+		reg_log = reg_log_default;
+	if(reg_log_count == REG_LOG_SIZE)
+		catch_up(cpu_cycles);
+	reg_log[reg_log_count].cycle = cpu_cycles;
+	reg_log[reg_log_count].ioreg = ioreg;
+	reg_log[reg_log_count].value = value;
+	reg_log_count++;
+}
+
+void sound_ch1_writereg(uint16_t ioreg, uint8_t value) {
+	log_write(ioreg, value);
+}
+
+void sound_ch2_writereg(uint16_t ioreg, uint8_t value) {
+	log_write(ioreg, value);
+}
+
+void sound_ch3_writereg(uint16_t ioreg, uint8_t value) {
+	log_write(ioreg, value);
+}
+
+void sound_ch4_writereg(uint16_t ioreg, uint8_t value) {
+	log_write(ioreg, value);
+}
+
+void sound_master_writereg(uint16_t ioreg, uint8_t value) {
+	log_write(ioreg, value);
+}
+
+void sound_waveram_writereg(uint16_t ioreg, uint8_t value) {
+	log_write(ioreg, value);
+}
+
+//リングバッファの量から次のフレームのリサンプリングの比を決める
+//1フレーム分の書き込みを合成してリングバッファへ送る
+//オーディオ無効時は何もしない(レジスタの読み出しかログが溢れたときにまとめて進める)
+void sound_end_frame() {
+	if(sample_rate == 0)
+		return;
+	PROF_BEGIN(PROF_APU);
+	catch_up(cpu_cycles);
+	blip_flush();
+	PROF_END();
+}
+
+//先読み(run-ahead)の間は波形を合成せず、読み出せる状態だけを進める
+//先読みした分は状態ごと巻き戻すので、出力側には何も残らない
+//止めているレートはインスタンスごとに持つ(gb_switchで入れ替わる)
+void sound_set_speculative(int on) {
+	if(on){
+		speculative_rate = sample_rate;
+		sample_rate = 0;
+	}else{
+		sample_rate = speculative_rate;
+		speculative_rate = 0;
+	}
+}
+
+//読み出しは合成を現在時刻まで進めてから行う(NR52のステータス等のため)
 uint8_t sound_ch1_readreg(uint16_t ioreg) {
+	catch_up(cpu_cycles);
 	switch(ioreg){
 	case IO_NR10_R:
 		return ch1.sweep_diff | ch1.sweep_dir<<3 | ch1.sweep_time<<4;
@@ -238,6 +821,7 @@ uint8_t sound_ch1_readreg(uint16_t ioreg) {
 }
 
 uint8_t sound_ch2_readreg(uint16_t ioreg) {
+	catch_up(cpu_cycles);
 	switch(ioreg){
 	case IO_NR21_R:
 		return ch2.duty_num<<6;
@@ -253,6 +837,7 @@ uint8_t sound_ch2_readreg(uint16_t ioreg) {
 }
 
 uint8_t sound_ch3_readreg(uint16_t ioreg) {
+	catch_up(cpu_cycles);
 	switch(ioreg){
 	case IO_NR31_R:
 		return ch3.enabled<<7;
@@ -268,6 +853,7 @@ uint8_t sound_ch3_readreg(uint16_t ioreg) {
 }
 
 uint8_t sound_ch4_readreg(uint16_t ioreg) {
+	catch_up(cpu_cycles);
 	switch(ioreg){
 	case IO_NR42_R:
 		return ch4.envelope_time | ch4.envelope_dir<<3 | ch4.envelope_init_volume<<4;
@@ -281,6 +867,7 @@ uint8_t sound_ch4_readreg(uint16_t ioreg) {
 }
 
 uint8_t sound_master_readreg(uint16_t ioreg) {
+	catch_up(cpu_cycles);
 	switch(ioreg){
 	case IO_NR50_R:
 		return master.right_volume | master.right_enabled<<3 | master.left_volume<<4 | master.left_enabled<<7;
@@ -294,208 +881,44 @@ uint8_t sound_master_readreg(uint16_t ioreg) {
 	return 0;
 }
 
-static int ch1_wave() {
-	if(ch1.restart){
-		ch1.volume = ch1.envelope_init_volume;
-		ch1.sweep_steps = Obtained.freq*ch1.sweep_time>>7;
-		ch1.envelope_steps = Obtained.freq*ch1.envelope_time>>6;
-		ch1.sweep_countdown = ch1.sweep_steps;
-		ch1.restart = 0;
-		ch1.status = 1;
-		ch1.prev = -1;
-		if(ch1.counter_enabled)
-			ch1.remaining_time = (64-ch1.length)*1000>>8;
-		ch1.ms_countdown = obtfreq_div1000; //1ms経過までのステップ数
-		ch1.real_freq = REAL_FREQ(ch1.freq);
-	}
-
-	int frame = rectwave(ch1.step * ch1.real_freq /Obtained.freq, duty_table[ch1.duty_num]);
-	int is_edge = ch1.prev != frame;
-	if(ch1.sweep_time!=0 && ch1.sweep_countdown==0 && is_edge && ch1.prev==-1){
-		if(ch1.sweep_dir == 0 && ch1.freq+(ch1.freq>>ch1.sweep_diff)>2048){
-			ch1.status = 0;
-		}else if(!(ch1.sweep_dir == 1 && ch1.freq>>ch1.sweep_diff<0)){
-			ch1.freq += (ch1.sweep_dir?-1:1) * (ch1.freq>>ch1.sweep_diff);
-			ch1.real_freq = REAL_FREQ(ch1.freq);
-			ch1.sweep_countdown = ch1.sweep_steps;
-			ch1.step=0;
-			frame = rectwave(ch1.step * ch1.real_freq/Obtained.freq, duty_table[ch1.duty_num]);
-		}
-	}
-	if(ch1.envelope_time!=0 && ch1.envelope_steps!=0 && ch1.step%ch1.envelope_steps == 0){
-		if(ch1.envelope_dir==1){
-			if(ch1.volume<15) ch1.volume++;
-		}else{
-			if(ch1.volume>0) ch1.volume--;
-		}
-	}
-
-	ch1.prev = frame;
-	ch1.step++;
-
-	if(ch1.sweep_countdown>0)
-		ch1.sweep_countdown--;
-
-	if(ch1.ms_countdown>0){
-		if(--ch1.ms_countdown == 0){
-			ch1.ms_countdown = obtfreq_div1000;
-			ch1.remaining_time--;
-		}
-	}
-	if(ch1.counter_enabled && ch1.remaining_time == 0)
-		ch1.status = 0;
-
-	if(!ch1.status)
-		return 0;
-
-	return ch1.prev * ch1.volume;
+//bit0-3がch1-4に対応
+void sound_set_mute(unsigned int mask) {
+	atomic_store_explicit(&mute_mask, mask, memory_order_relaxed);
 }
 
-static int ch2_wave() {
-	if(ch2.restart){
-		ch2.volume = ch2.envelope_init_volume;
-		ch2.envelope_steps = Desired.freq*ch2.envelope_time>>6;
-		ch2.restart = 0;
-		ch2.status = 1;
-		if(ch2.counter_enabled)
-			ch2.remaining_time = (64-ch2.length)*1000>>8;
-		ch2.ms_countdown = obtfreq_div1000; //1ms経過までのステップ数
-		ch2.real_freq = REAL_FREQ(ch2.freq);
-	}
-
-	if(ch2.envelope_time!=0 && ch2.envelope_steps!=0 && ch2.step%ch2.envelope_steps == 0){
-		if(ch2.envelope_dir==1){
-			if(ch2.volume<15) ch2.volume++;
-		}else{
-			if(ch2.volume>0) ch2.volume--;
-		}
-	}
-
-	if(ch2.ms_countdown>0){
-		if(--ch2.ms_countdown == 0){
-			ch2.ms_countdown = obtfreq_div1000;
-			ch2.remaining_time--;
-		}
-	}
-
-	if(ch2.counter_enabled && ch2.remaining_time == 0)
-		ch2.status = 0;
-
-	if(!ch2.status)
-		return 0;
-
-	return rectwave(ch2.step++ * ch2.real_freq / Obtained.freq, duty_table[ch2.duty_num]) * ch2.volume;
+unsigned int sound_get_mute() {
+	return atomic_load_explicit(&mute_mask, memory_order_relaxed);
 }
 
-static int ch3_wave() {
-	if(ch3.restart){
-		ch3.restart = 0;
-		ch3.status = 1;
-		if(ch3.counter_enabled)
-			ch3.remaining_time = (256-ch3.length)*1000>>8;
-		ch3.ms_countdown = obtfreq_div1000; //1ms経過までのステップ数
-		ch3.wave_index = 0;
-		ch3.precalc = ((65535.0/(2048.0-ch3.freq))*32.0);
-	}
-
-	int frame;
-
-	ch3.wave_index = fmod(ch3.step * ch3.precalc / Obtained.freq, 32);
-
-	if(ch3.wave_index%2)
-		frame = INTERNAL_IO[IO_WAVERAM_BEGIN_R+ch3.wave_index/2]&0xf;
-	else
-		frame = INTERNAL_IO[IO_WAVERAM_BEGIN_R+ch3.wave_index/2]>>4;
-
-	ch3.step++;
-
-	if(ch3.ms_countdown>0){
-		if(--ch3.ms_countdown == 0){
-			ch3.ms_countdown = obtfreq_div1000;
-			ch3.remaining_time--;
-		}
-	}
-
-	if(ch3.counter_enabled && ch3.remaining_time == 0)
-		ch3.status = 0;
-
-	if(!ch3.status)
-		return 0;
-
-	return ch3.volume_ratio&&ch3.enabled ? frame >> (ch3.volume_ratio-1) : 0;
+//合成したブロックごとにエミュレーションスレッドから呼ばれる関数を今のインスタンスに設定する
+void sound_set_tap(sound_tap_func func, void *userdata) {
+	tap_func = func;
+	tap_userdata = userdata;
 }
 
-
-static int ch4_wave() {
-	if(ch4.restart){
-		ch4.volume = ch4.envelope_init_volume;
-		ch4.envelope_steps = Desired.freq*ch4.envelope_time / 64;
-		ch4.gen_steps = Desired.freq / (524288.0/(ch4.ratio?ch4.ratio:0.5)/pow(2, ch4.shiftclk_freq+1));
-		if(ch4.gen_steps==0) ch4.gen_steps++;
-		ch4.restart = 0;
-		ch4.status = 1;
-		if(ch4.counter_enabled)
-			ch4.remaining_time = (64-ch4.length)*1000/256;
-		ch4.ms_countdown = obtfreq_div1000; //1ms経過までのステップ数
-		ch4.shiftreg = 0xffff;
-		ch4.prng_out = 1;
-	}
-
-	if(ch4.step!=0 && ch4.envelope_steps!=0 && ch4.step%ch4.envelope_steps == 0){
-		if(ch4.envelope_dir==1){
-			if(ch4.volume<15) ch4.volume++;
-		}else{
-			if(ch4.volume>0) ch4.volume--;
-		}
-	}
-
-	if(ch4.ms_countdown>0){
-		if(--ch4.ms_countdown == 0){
-			ch4.ms_countdown = obtfreq_div1000;
-			ch4.remaining_time--;
-		}
-	}
-
-	if(ch4.counter_enabled && ch4.remaining_time == 0)
-		ch4.status = 0;
-
-	if(!ch4.status)
-		return 0;
-
-	if(ch4.step!=0 && ch4.gen_steps!=0 && ch4.step%ch4.gen_steps == 0){
-		//擬似乱数の更新
-		ch4.shiftreg = (ch4.shiftreg<<1) + (((ch4.shiftreg>>(ch4.cycle?6:14))^(ch4.shiftreg>>(ch4.cycle?5:13)))&1);
-		ch4.prng_out ^= ch4.shiftreg&1;
-	}
-
-	ch4.step++;
-
-	return ch4.volume * ch4.prng_out;
+//混ぜた後のサンプルの送り先(オーディオデバイスなど)。tapの後に呼ばれる(今のインスタンスだけ)
+void sound_set_output(sound_output_func func, void *userdata) {
+	output_func = func;
+	output_userdata = userdata;
 }
 
-static void callback(void *unused, Uint8 *stream, int len) {
-	Sint16 *frames = (Sint16 *) stream;
-	int framesize = len / 2;
-	for (int i = 0; i < framesize; i+=2) {
-		int ch1_val=ch1_wave(), ch2_val=ch2_wave(), ch3_val=ch3_wave(), ch4_val=ch4_wave();
-        frames[i] = master.all_enabled*32*(ch1.left_enabled*ch1_val+ch2.left_enabled*ch2_val+ch3.left_enabled*ch3_val+ch4.left_enabled*ch4_val);
-        frames[i] = frames[i] + (frames[i] * master.left_enabled);
-        frames[i+1] = master.all_enabled*32*(ch1.right_enabled*ch1_val+ch2.right_enabled*ch2_val+ch3.right_enabled*ch3_val+ch4.right_enabled*ch4_val);
-		frames[i+1] = frames[i+1] + (frames[i+1] * master.right_enabled);
+static int synth_init(int rate) {
+	if(blip_ch == NULL && (blip_ch = calloc(MIXER_CHANNELS, sizeof(struct blip))) == NULL){
+		perror("sound");
+		return -1;
 	}
+	sample_rate = rate;
+	blip_factor = ((uint64_t)sample_rate << 32) / GB_CLOCK;
+	return 0;
 }
 
-void sound_init() {
-	Desired.freq= 44100;
-	Desired.format= AUDIO_S16LSB;
-	Desired.channels= 2;
-	Desired.samples= 1024;
-	Desired.callback= callback;
-	Desired.userdata= NULL;
-
-	SDL_OpenAudio(&Desired, &Obtained);
-	obtfreq_div1000 = Obtained.freq / 1000;
-	SDL_PauseAudio(0);
+//rate(Hz)で音の合成を有効にする
+//出力先はsound_set_tap/sound_set_outputで与える(なければ合成だけして捨てる)
+//失敗したら-1を返し、合成は無効のまま
+int sound_init(int rate) {
+	return synth_init(rate);
+}
 
-	return;
+int sound_sample_rate() {
+	return sample_rate;
 }
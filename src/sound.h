@@ -1,13 +1,41 @@
 #pragma once
 
 #include <inttypes.h>
+#include <stddef.h>
 
-void sound_init(void);
+#define SOUND_SAMPLE_RATE 44100
+
+//合成したブロックを受け取る関数
+//channels: ch1-4のモノラルのサンプル(パン・音量・ミュートをかける前)
+//mixed: 混ぜた後のステレオ(L/Rインターリーブ)
+typedef void (*sound_tap_func)(const int16_t *const channels[4], const int16_t *mixed, int count, void *userdata);
+//混ぜた後のステレオ(L/Rインターリーブ)を受け取る関数
+typedef void (*sound_output_func)(const int16_t *frames, int count, void *userdata);
+
+struct state_buf;
+struct sound_context;
+
+struct sound_context *sound_context_new(void);
+void sound_context_free(struct sound_context *ctx);
+void sound_context_save(struct sound_context *ctx);
+void sound_context_load(const struct sound_context *ctx);
+void sound_sync(void);
+void sound_state_save(struct state_buf *b);
+void sound_state_load(struct state_buf *b);
+int sound_init(int rate);
+int sound_sample_rate(void);
+void sound_end_frame(void);
+void sound_set_speculative(int on);
+void sound_set_mute(unsigned int mask);
+unsigned int sound_get_mute(void);
+void sound_set_tap(sound_tap_func func, void *userdata);
+void sound_set_output(sound_output_func func, void *userdata);
 void sound_ch1_writereg(uint16_t ioreg, uint8_t value);
 void sound_ch2_writereg(uint16_t ioreg, uint8_t value);
 void sound_ch3_writereg(uint16_t ioreg, uint8_t value);
 void sound_ch4_writereg(uint16_t ioreg, uint8_t value);
 void sound_master_writereg(uint16_t ioreg, uint8_t value);
+void sound_waveram_writereg(uint16_t ioreg, uint8_t value);
 uint8_t sound_ch1_readreg(uint16_t ioreg);
 uint8_t sound_ch2_readreg(uint16_t ioreg);
 uint8_t sound_ch3_readreg(uint16_t ioreg);
@@ -0,0 +1,65 @@
+#include "spsc.h"
+#include <stdlib.h>
+#include <string.h>
+
+int spsc_init(struct spsc *q, size_t capacity, size_t elem_size) {
+	if(capacity == 0 || (capacity & (capacity-1)) != 0)
+		return -1;
+	if((q->buf = malloc(capacity * elem_size)) == NULL)
+		return -1;
+	q->mask = capacity - 1;
+	q->elem_size = elem_size;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	return 0;
+}
+
+void spsc_free(struct spsc *q) {
+	free(q->buf);
+	q->buf = NULL;
+}
+
+//書き込めた要素数を返す
+size_t spsc_write(struct spsc *q, const void *src, size_t n) {
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+	size_t space = (q->mask + 1) - (head - tail);
+	if(n > space)
+		n = space;
+
+	size_t pos = head & q->mask;
+	size_t first = q->mask + 1 - pos;
+	if(first > n)
+		first = n;
+	memcpy(q->buf + pos*q->elem_size, src, first*q->elem_size);
+	memcpy(q->buf, (const uint8_t *)src + first*q->elem_size, (n-first)*q->elem_size);
+
+	atomic_store_explicit(&q->head, head + n, memory_order_release);
+	return n;
+}
+
+//読み出せた要素数を返す
+size_t spsc_read(struct spsc *q, void *dst, size_t n) {
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+	if(n > head - tail)
+		n = head - tail;
+
+	size_t pos = tail & q->mask;
+	size_t first = q->mask + 1 - pos;
+	if(first > n)
+		first = n;
+	memcpy(dst, q->buf + pos*q->elem_size, first*q->elem_size);
+	memcpy((uint8_t *)dst + first*q->elem_size, q->buf, (n-first)*q->elem_size);
+
+	atomic_store_explicit(&q->tail, tail + n, memory_order_release);
+	return n;
+}
+
+size_t spsc_count(struct spsc *q) {
+	return atomic_load_explicit(&q->head, memory_order_acquire) - atomic_load_explicit(&q->tail, memory_order_acquire);
+}
+
+size_t spsc_capacity(struct spsc *q) {
+	return q->mask + 1;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+//single-producer/single-consumer のロックフリーリングバッファ
+//容量は2の累乗、要素は固定長
+struct spsc {
+	_Alignas(64) atomic_size_t head; //書き込み位置(producerのみ更新)
+	_Alignas(64) atomic_size_t tail; //読み出し位置(consumerのみ更新)
+	_Alignas(64) size_t mask;
+	size_t elem_size;
+	uint8_t *buf;
+};
+
+int spsc_init(struct spsc *q, size_t capacity, size_t elem_size);
+void spsc_free(struct spsc *q);
+size_t spsc_write(struct spsc *q, const void *src, size_t n);
+size_t spsc_read(struct spsc *q, void *dst, size_t n);
+size_t spsc_count(struct spsc *q);
+size_t spsc_capacity(struct spsc *q);
+
+static inline int spsc_push(struct spsc *q, const void *elem) {
+	return spsc_write(q, elem, 1) == 1;
+}
+
+static inline int spsc_pop(struct spsc *q, void *elem) {
+	return spsc_read(q, elem, 1) == 1;
+}
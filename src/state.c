@@ -0,0 +1,211 @@
+#include "state.h"
+#include "cartridge.h"
+#include "cpu.h"
+#include "memory.h"
+#include "lcd.h"
+#include "joypad.h"
+#include "sound.h"
+#include "serial.h"
+#include "machine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+//形式
+//  "GBST" version(4) カートリッジのヘッダ(タイトル~グローバルチェックサム)
+//  以降セクションが並ぶ: タグ(4) 版(4) 大きさ(4) 中身
+//読み込みは知らないタグを読み飛ばし、版か大きさが違えば何も変えずに失敗する
+//(古い版を今の形に直す処理はまだないので、版はちょうど同じものだけを読む)
+#define STATE_VERSION 1
+#define MEASURE_CAP SIZE_MAX //dataがNULLでcapがこれなら大きさだけを数える
+#define CARTID_OFFSET offsetof(struct gb_carthdr, title)
+#define CARTID_SIZE (sizeof(struct gb_carthdr) - CARTID_OFFSET)
+#define HEADER_SIZE (8 + CARTID_SIZE)
+#define SECTION_HEADER_SIZE 12
+
+static void cart_save(struct state_buf *b) {
+	cart_state_save(memory_cart(), b);
+}
+
+static void cart_load(struct state_buf *b) {
+	cart_state_load(memory_cart(), b);
+}
+
+struct section {
+	char tag[4];
+	uint32_t version;
+	void (*save)(struct state_buf *b);
+	void (*load)(struct state_buf *b);
+};
+
+static const struct section sections[] = {
+	{{'C','P','U',' '}, 1, cpu_state_save, cpu_state_load},
+	{{'M','E','M',' '}, 1, memory_state_save, memory_state_load},
+	{{'C','A','R','T'}, 1, cart_save, cart_load},
+	{{'L','C','D',' '}, 1, lcd_state_save, lcd_state_load},
+	{{'M','A','C','H'}, 1, machine_state_save, machine_state_load},
+	{{'J','O','Y','P'}, 1, joypad_state_save, joypad_state_load},
+	{{'A','P','U',' '}, 2, sound_state_save, sound_state_load},
+	{{'S','E','R','I'}, 1, serial_state_save, serial_state_load},
+};
+#define NUM_SECTIONS (int)(sizeof(sections)/sizeof(sections[0]))
+
+static void reserve(struct state_buf *b, size_t n) {
+	if(b->len + n <= b->cap)
+		return;
+	size_t cap = b->cap ? b->cap : 65536;
+	while(cap < b->len + n)
+		cap *= 2;
+	uint8_t *p = realloc(b->data, cap);
+	if(p == NULL){
+		perror("state");
+		exit(-1);
+	}
+	b->data = p;
+	b->cap = cap;
+}
+
+void state_put(struct state_buf *b, const void *p, size_t n) {
+	reserve(b, n);
+	if(b->data != NULL && n > 0)
+		memcpy(b->data + b->len, p, n);
+	b->len += n;
+}
+
+//大きさは読み込む前に確かめてあるので、足りないのは壊れたときだけ
+void state_get(struct state_buf *b, void *p, size_t n) {
+	if(b->pos + n > b->len){
+		memset(p, 0, n);
+		b->pos = b->len;
+		return;
+	}
+	memcpy(p, b->data + b->pos, n);
+	b->pos += n;
+}
+
+static void put32(struct state_buf *b, uint32_t v) {
+	state_put(b, &v, 4);
+}
+
+static uint32_t get32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+int state_save(struct state_buf *b) {
+	b->len = 0;
+	b->pos = 0;
+	state_put(b, "GBST", 4);
+	put32(b, STATE_VERSION);
+	state_put(b, (const uint8_t *)cart_header(memory_cart()) + CARTID_OFFSET, CARTID_SIZE);
+
+	sound_sync();
+	for(int i=0; i<NUM_SECTIONS; i++){
+		state_put(b, sections[i].tag, 4);
+		put32(b, sections[i].version);
+		size_t size_pos = b->len;
+		put32(b, 0);
+		sections[i].save(b);
+		uint32_t size = b->len - size_pos - 4;
+		memcpy(b->data + size_pos, &size, 4);
+	}
+	return 0;
+}
+
+//各セクションの位置を調べる。なければNULL
+static const uint8_t *find_section(const uint8_t *data, size_t len, const char *tag, uint32_t *version, uint32_t *size) {
+	size_t pos = HEADER_SIZE;
+	while(pos + SECTION_HEADER_SIZE <= len){
+		uint32_t n = get32(data + pos + 8);
+		if(n > len - pos - SECTION_HEADER_SIZE)
+			return NULL;
+		if(memcmp(data + pos, tag, 4) == 0){
+			*version = get32(data + pos + 4);
+			*size = n;
+			return data + pos + SECTION_HEADER_SIZE;
+		}
+		pos += SECTION_HEADER_SIZE + n;
+	}
+	return NULL;
+}
+
+//セクションの今の大きさ(中身は書かず、状態も変えない)
+static size_t section_size(int i) {
+	struct state_buf b = {NULL, 0, 0, MEASURE_CAP};
+	sections[i].save(&b);
+	return b.len;
+}
+
+//ヘッダ・各セクションの版と大きさを確かめてから読み込む
+int state_load(const uint8_t *data, size_t len) {
+	if(len < HEADER_SIZE || memcmp(data, "GBST", 4) != 0 || get32(data+4) != STATE_VERSION){
+		puts("state: not a save state");
+		return -1;
+	}
+	if(memcmp(data + 8, (const uint8_t *)cart_header(memory_cart()) + CARTID_OFFSET, CARTID_SIZE) != 0){
+		puts("state: saved with a different ROM");
+		return -1;
+	}
+
+	const uint8_t *payload[NUM_SECTIONS];
+	uint32_t sizes[NUM_SECTIONS];
+	for(int i=0; i<NUM_SECTIONS; i++){
+		uint32_t version;
+		payload[i] = find_section(data, len, sections[i].tag, &version, &sizes[i]);
+		if(payload[i] == NULL || version != sections[i].version || sizes[i] != section_size(i)){
+			printf("state: incompatible section %.4s\n", sections[i].tag);
+			return -1;
+		}
+	}
+
+	for(int i=0; i<NUM_SECTIONS; i++){
+		struct state_buf b = {(uint8_t *)payload[i], sizes[i], 0, sizes[i]};
+		sections[i].load(&b);
+	}
+	return 0;
+}
+
+int state_save_file(const char *path) {
+	static struct state_buf b;
+	state_save(&b);
+	FILE *fp = fopen(path, "wb");
+	if(fp == NULL){
+		perror(path);
+		return -1;
+	}
+	if(fwrite(b.data, 1, b.len, fp) != b.len){
+		perror(path);
+		fclose(fp);
+		return -1;
+	}
+	if(fclose(fp) != 0){
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+int state_load_file(const char *path) {
+	FILE *fp = fopen(path, "rb");
+	if(fp == NULL){
+		perror(path);
+		return -1;
+	}
+	struct state_buf b = {NULL, 0, 0, 0};
+	uint8_t chunk[4096];
+	size_t n;
+	while((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+		state_put(&b, chunk, n);
+	fclose(fp);
+	int ret = state_load(b.data, b.len);
+	state_buf_free(&b);
+	return ret;
+}
+
+void state_buf_free(struct state_buf *b) {
+	free(b->data);
+	b->data = NULL;
+	b->len = b->pos = b->cap = 0;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include <inttypes.h>
+
+//ステートセーブ
+//マシン全体をモジュールごとのセクション(タグ・版・大きさ付き)に分けてバイナリにする
+//数値はホストのバイト順で、同じ構成(ROM・CGB/DMG)のインスタンスにだけ読み込める
+
+//書き込みは必要に応じて伸ばし、同じバッファを使い回せば確保は最初の1回だけ
+struct state_buf {
+	uint8_t *data;
+	size_t len; //書いた長さ / 読み出せる長さ
+	size_t pos; //読み出し位置
+	size_t cap;
+};
+
+void state_put(struct state_buf *b, const void *p, size_t n);
+void state_get(struct state_buf *b, void *p, size_t n);
+
+int state_save(struct state_buf *b);
+int state_load(const uint8_t *data, size_t len);
+int state_save_file(const char *path);
+int state_load_file(const char *path);
+void state_buf_free(struct state_buf *b);
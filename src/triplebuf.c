@@ -0,0 +1,48 @@
+#include "triplebuf.h"
+#include <stdlib.h>
+
+#define TB_FRESH 0x4
+#define TB_INDEX(v) ((v)&0x3)
+
+int triplebuf_init(struct triplebuf *tb, int width, int height) {
+	for(int i=0; i<3; i++){
+		if((tb->buf[i] = calloc(width*height, sizeof(uint32_t))) == NULL){
+			triplebuf_free(tb);
+			return -1;
+		}
+	}
+	tb->back = 0;
+	atomic_init(&tb->middle, 1);
+	tb->front = 2;
+	return 0;
+}
+
+void triplebuf_free(struct triplebuf *tb) {
+	for(int i=0; i<3; i++){
+		free(tb->buf[i]);
+		tb->buf[i] = NULL;
+	}
+}
+
+uint32_t *triplebuf_back(struct triplebuf *tb) {
+	return tb->buf[tb->back];
+}
+
+//書き終わったbackをmiddleと交換
+void triplebuf_publish(struct triplebuf *tb) {
+	int old = atomic_exchange_explicit(&tb->middle, tb->back | TB_FRESH, memory_order_acq_rel);
+	tb->back = TB_INDEX(old);
+}
+
+uint32_t *triplebuf_front(struct triplebuf *tb) {
+	return tb->buf[tb->front];
+}
+
+//新しいフレームがあればfrontと交換して1を返す
+int triplebuf_consume(struct triplebuf *tb) {
+	if(!(atomic_load_explicit(&tb->middle, memory_order_relaxed) & TB_FRESH))
+		return 0;
+	int old = atomic_exchange_explicit(&tb->middle, tb->front, memory_order_acq_rel);
+	tb->front = TB_INDEX(old);
+	return 1;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+//エミュレーションスレッドが書き、表示スレッドが読むフレームのトリプルバッファ
+struct triplebuf {
+	uint32_t *buf[3];
+	atomic_int middle; //bit0-1: バッファ番号, bit2: 未読フラグ
+	int back;  //producer専用
+	int front; //consumer専用
+};
+
+int triplebuf_init(struct triplebuf *tb, int width, int height);
+void triplebuf_free(struct triplebuf *tb);
+uint32_t *triplebuf_back(struct triplebuf *tb);
+void triplebuf_publish(struct triplebuf *tb);
+uint32_t *triplebuf_front(struct triplebuf *tb);
+int triplebuf_consume(struct triplebuf *tb);
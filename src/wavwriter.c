@@ -0,0 +1,162 @@
+#include "wavwriter.h"
+#include "spsc.h"
+#include "SDL2/SDL.h"
+#include <stdio.h>
+#include <stdatomic.h>
+
+#define WAV_HEADER_SIZE 44
+#define QUEUE_FRAMES 65536 //約1.5秒分
+#define CHUNK_FRAMES 4096
+
+static FILE *fp = NULL;
+static int raw_mode;
+static uint32_t data_bytes;
+static struct spsc queue;
+static SDL_Thread *writer_thread;
+static SDL_sem *wakeup; //キューにサンプルが入った・閉じる(→書き込みスレッド)
+static SDL_sem *space;  //キューが空いた(→エミュレーションスレッド)
+static atomic_int space_waiting; //空くのを待っているときだけ知らせる
+static atomic_int quit;
+static atomic_int write_error;
+
+static void put_le16(uint8_t *p, uint16_t v) {
+	p[0] = v; p[1] = v>>8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+	p[0] = v; p[1] = v>>8; p[2] = v>>16; p[3] = v>>24;
+}
+
+static void make_header(uint8_t *h, int sample_rate, uint32_t bytes) {
+	memcpy(h, "RIFF", 4);
+	put_le32(h+4, 36 + bytes);
+	memcpy(h+8, "WAVEfmt ", 8);
+	put_le32(h+16, 16);             //fmtチャンクのサイズ
+	put_le16(h+20, 1);              //PCM
+	put_le16(h+22, 2);              //ステレオ
+	put_le32(h+24, sample_rate);
+	put_le32(h+28, sample_rate*4);  //バイト/秒
+	put_le16(h+32, 4);              //ブロックサイズ
+	put_le16(h+34, 16);             //ビット数
+	memcpy(h+36, "data", 4);
+	put_le32(h+40, bytes);
+}
+
+//キューに溜まった分をファイルへ書く
+//WAV(とraw)はリトルエンディアンなので、ホストのバイト順によらずバイト列に直してから書く
+static int writer_main(void *unused) {
+	static int16_t chunk[CHUNK_FRAMES*2];
+	static uint8_t bytes[CHUNK_FRAMES*4];
+	(void)unused;
+	for(;;){
+		size_t n = spsc_read(&queue, chunk, CHUNK_FRAMES);
+		if(n > 0){
+			if(atomic_exchange(&space_waiting, 0))
+				SDL_SemPost(space);
+			for(size_t i=0; i<n*2; i++)
+				put_le16(bytes + i*2, chunk[i]);
+			if(fwrite(bytes, 4, n, fp) != n && !atomic_exchange(&write_error, 1))
+				perror("wavwriter");
+			data_bytes += n*4;
+			continue;
+		}
+		if(atomic_load(&quit))
+			break;
+		SDL_SemWaitTimeout(wakeup, 100);
+	}
+	return 0;
+}
+
+int wavwriter_open(const char *path, int sample_rate, int raw) {
+	if((fp = fopen(path, "wb")) == NULL){
+		perror(path);
+		return -1;
+	}
+	raw_mode = raw;
+	data_bytes = 0;
+	if(!raw){
+		uint8_t header[WAV_HEADER_SIZE];
+		make_header(header, sample_rate, 0);
+		if(fwrite(header, 1, WAV_HEADER_SIZE, fp) != WAV_HEADER_SIZE){
+			perror(path);
+			goto err_file;
+		}
+	}
+
+	if(spsc_init(&queue, QUEUE_FRAMES, 4) < 0){
+		puts("wavwriter_open: spsc_init failed");
+		goto err_file;
+	}
+	if((wakeup = SDL_CreateSemaphore(0)) == NULL){
+		printf("wavwriter_open: %s\n", SDL_GetError());
+		goto err_queue;
+	}
+	if((space = SDL_CreateSemaphore(0)) == NULL){
+		printf("wavwriter_open: %s\n", SDL_GetError());
+		goto err_wakeup;
+	}
+	atomic_store(&quit, 0);
+	atomic_store(&write_error, 0);
+	atomic_store(&space_waiting, 0);
+	if((writer_thread = SDL_CreateThread(writer_main, "wav_writer", NULL)) == NULL){
+		printf("wavwriter_open: %s\n", SDL_GetError());
+		SDL_DestroySemaphore(space);
+		goto err_wakeup;
+	}
+	return 0;
+
+err_wakeup:
+	SDL_DestroySemaphore(wakeup);
+err_queue:
+	spsc_free(&queue);
+err_file:
+	fclose(fp);
+	fp = NULL;
+	return -1;
+}
+
+//エミュレーションスレッドから呼ぶ
+//サンプルを落とすとキャプチャが再現できなくなるので、キューが一杯なら書き込みスレッドが空けるまで待つ
+void wavwriter_write(const int16_t *frames, int count) {
+	for(;;){
+		size_t n = spsc_write(&queue, frames, count);
+		frames += n*2;
+		count -= n;
+		if(count == 0)
+			break;
+		atomic_store(&space_waiting, 1); //起こす前に立てておく(知らせを取りこぼさないように)
+		SDL_SemPost(wakeup);
+		SDL_SemWaitTimeout(space, 100);
+	}
+	SDL_SemPost(wakeup);
+}
+
+//書き込みに失敗していれば-1を返す(それまでに書けた分はファイルに残る)
+int wavwriter_close() {
+	if(fp == NULL)
+		return 0;
+	atomic_store(&quit, 1);
+	SDL_SemPost(wakeup);
+	SDL_WaitThread(writer_thread, NULL);
+	SDL_DestroySemaphore(wakeup);
+	SDL_DestroySemaphore(space);
+	spsc_free(&queue);
+
+	int ret = atomic_load(&write_error) ? -1 : 0;
+	if(!raw_mode){
+		//サイズが確定したのでヘッダを書き直す
+		uint8_t size[4];
+		put_le32(size, 36 + data_bytes);
+		if(fseek(fp, 4, SEEK_SET) != 0 || fwrite(size, 1, 4, fp) != 4)
+			ret = -1;
+		put_le32(size, data_bytes);
+		if(fseek(fp, 40, SEEK_SET) != 0 || fwrite(size, 1, 4, fp) != 4)
+			ret = -1;
+	}
+	if(fclose(fp) != 0)
+		ret = -1;
+	if(ret < 0 && !atomic_load(&write_error))
+		perror("wavwriter"); //キューからの書き込みの失敗はwriter_mainで表示済み
+	fp = NULL;
+	return ret;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdint.h>
+
+//16bitステレオのPCMをバックグラウンドのスレッドでファイルに書き出す
+//rawが0ならWAV(ヘッダのサイズは閉じるときに書き直す)、1ならヘッダなし
+int wavwriter_open(const char *path, int sample_rate, int raw);
+void wavwriter_write(const int16_t *frames, int count);
+int wavwriter_close(void);
@@ -0,0 +1,153 @@
+//libgbcoreの回帰テスト: 別々のスレッドで同時に動かしても、1つのインスタンスをスレッドの間で渡しても
+//1スレッドで順に動かしたときと同じ状態(ステートセーブ)と音になること
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "gbcore.h"
+
+#define ROM_SIZE 0x8000
+#define THREADS 4
+#define FRAMES 30
+#define SAMPLE_RATE 48000
+#define STATE_MAX (1 << 20)
+#define AUDIO_MAX (SAMPLE_RATE * 2)
+
+static const uint8_t logo[] = {
+	0xCE, 0xED, 0x66, 0x66, 0xCC, 0x0D, 0x00, 0x0B, 0x03, 0x73, 0x00, 0x83, 0x00, 0x0C, 0x00, 0x0D,
+	0x00, 0x08, 0x11, 0x1F, 0x88, 0x89, 0x00, 0x0E, 0xDC, 0xCC, 0x6E, 0xE6, 0xDD, 0xDD, 0xD9, 0x99,
+	0xBB, 0xBB, 0x67, 0x63, 0x6E, 0x0E, 0xEC, 0xCC, 0xDD, 0xDC, 0x99, 0x9F, 0xBB, 0xB9, 0x33, 0x3E
+};
+
+//0x150から: APUとLCDをONにし、押されているボタンで周波数を変えながら矩形波(ch2)をトリガーし続ける
+static const uint8_t program[] = {
+	0x3E, 0x80, 0xE0, 0x26, //NR52 = 0x80
+	0x3E, 0x77, 0xE0, 0x24, //NR50 = 0x77
+	0x3E, 0xFF, 0xE0, 0x25, //NR51 = 0xff
+	0x3E, 0x91, 0xE0, 0x40, //LCDC = 0x91
+	0x3E, 0x80, 0xE0, 0x16, //NR21 = 0x80 (duty 50%)
+	0x3E, 0xF0, 0xE0, 0x17, //NR22 = 0xf0
+	0x3E, 0x20, 0xE0, 0x00, //P1 = 0x20 (方向キーを選ぶ)
+	//loop:
+	0xF0, 0x00,             //ldh a,(P1)
+	0x80,                   //add a,b
+	0xE0, 0x18,             //NR23 = a
+	0x3E, 0x87, 0xE0, 0x19, //NR24 = 0x87 (trigger)
+	0x04,                   //inc b
+	0x0E, 0x00,             //ld c,0
+	0x0D, 0x20, 0xFD,       //dec c; jr nz,-3
+	0x18, 0xEF,             //jr loop
+};
+
+static uint8_t rom[ROM_SIZE];
+
+struct result {
+	uint8_t state[STATE_MAX];
+	size_t state_len;
+	int16_t audio[AUDIO_MAX * 2];
+	size_t audio_len;
+};
+
+static struct result sequential[THREADS], parallel[THREADS], handed, handed_ref;
+
+static void make_rom() {
+	static const uint8_t entry[] = {0x00, 0xC3, 0x50, 0x01}; //nop; jp 0x150
+	memcpy(rom + 0x100, entry, sizeof(entry));
+	memcpy(rom + 0x104, logo, sizeof(logo));
+	memcpy(rom + 0x134, "THREADS", 7);
+	memcpy(rom + 0x150, program, sizeof(program));
+}
+
+static struct gbcore *new_core() {
+	struct gbcore *core = gbcore_new(rom, sizeof(rom), SAMPLE_RATE, GBCORE_FLAG_DMG, 0);
+	if(core == NULL)
+		exit(1);
+	return core;
+}
+
+//インスタンスごとに違う入力でfromフレーム目からtoフレーム目の手前まで進め、音を溜める
+static void run_frames(struct gbcore *core, int id, int from, int to, struct result *r) {
+	for(int i=from; i<to; i++){
+		gbcore_set_buttons(core, (id + i/8) & 0xf);
+		gbcore_run_frame(core);
+		r->audio_len += gbcore_read_audio(core, r->audio + r->audio_len*2, AUDIO_MAX - r->audio_len);
+	}
+}
+
+static void finish(struct gbcore *core, struct result *r) {
+	r->state_len = gbcore_state_size(core);
+	if(r->state_len > STATE_MAX || gbcore_save_state(core, r->state, STATE_MAX) < 0)
+		exit(1);
+}
+
+static void *run_thread(void *arg) {
+	int id = (int)(intptr_t)arg;
+	struct gbcore *core = new_core();
+	run_frames(core, id, 0, FRAMES + id*10, &parallel[id]);
+	finish(core, &parallel[id]);
+	gbcore_free(core);
+	return NULL;
+}
+
+//同じインスタンスをスレッドを替えながら進める
+static struct gbcore *shared_core;
+
+static void *handoff_thread(void *arg) {
+	int part = (int)(intptr_t)arg;
+	run_frames(shared_core, 0, part*FRAMES, (part+1)*FRAMES, &handed);
+	return NULL;
+}
+
+static int same(const struct result *a, const struct result *b) {
+	return a->state_len == b->state_len && memcmp(a->state, b->state, a->state_len) == 0 &&
+		a->audio_len == b->audio_len && memcmp(a->audio, b->audio, a->audio_len * 2 * sizeof(int16_t)) == 0;
+}
+
+int main() {
+	make_rom();
+	int fail = 0;
+
+	for(int id=0; id<THREADS; id++){
+		struct gbcore *core = new_core();
+		run_frames(core, id, 0, FRAMES + id*10, &sequential[id]);
+		finish(core, &sequential[id]);
+		gbcore_free(core);
+	}
+
+	pthread_t threads[THREADS];
+	for(int id=0; id<THREADS; id++)
+		if(pthread_create(&threads[id], NULL, run_thread, (void *)(intptr_t)id) != 0)
+			exit(1);
+	for(int id=0; id<THREADS; id++)
+		pthread_join(threads[id], NULL);
+	for(int id=0; id<THREADS; id++){
+		if(sequential[id].audio_len == 0 || !same(&sequential[id], &parallel[id])){
+			printf("instance %d: differs when run in parallel\n", id);
+			fail = 1;
+		}
+	}
+
+	//前半と後半を別々のスレッドで進める
+	shared_core = new_core();
+	for(int part=0; part<2; part++){
+		pthread_t t;
+		if(pthread_create(&t, NULL, handoff_thread, (void *)(intptr_t)part) != 0)
+			exit(1);
+		pthread_join(t, NULL);
+	}
+	finish(shared_core, &handed);
+	gbcore_free(shared_core);
+	struct gbcore *core = new_core();
+	run_frames(core, 0, 0, 2*FRAMES, &handed_ref);
+	finish(core, &handed_ref);
+	gbcore_free(core);
+	if(!same(&handed_ref, &handed)){
+		puts("instance handed between threads differs");
+		fail = 1;
+	}
+
+	printf("gbcore_threads: %d instances in parallel, 1 instance across 2 threads\n", THREADS);
+	puts(fail ? "FAIL" : "OK");
+	return fail;
+}
@@ -0,0 +1,123 @@
+//run-aheadの回帰テスト: 先読みしても出力される音(フレームごとのサンプル数と波形)が変わらないこと
+//音を鳴らし続けるだけの小さなROMをその場で作り、先読み0フレームとNフレームで60フレームずつ実行して比べる
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gb.h"
+#include "cartridge.h"
+#include "memory.h"
+#include "cpu.h"
+#include "lcd.h"
+#include "machine.h"
+#include "sound.h"
+#include "runahead.h"
+
+#define ROM_SIZE 0x8000
+#define FRAMES 60
+#define SAMPLE_RATE 48000
+#define MAX_SAMPLES (SAMPLE_RATE * 2) //60フレームは1秒なので2秒分あれば足りる
+
+static const uint8_t logo[] = {
+	0xCE, 0xED, 0x66, 0x66, 0xCC, 0x0D, 0x00, 0x0B, 0x03, 0x73, 0x00, 0x83, 0x00, 0x0C, 0x00, 0x0D,
+	0x00, 0x08, 0x11, 0x1F, 0x88, 0x89, 0x00, 0x0E, 0xDC, 0xCC, 0x6E, 0xE6, 0xDD, 0xDD, 0xD9, 0x99,
+	0xBB, 0xBB, 0x67, 0x63, 0x6E, 0x0E, 0xEC, 0xCC, 0xDD, 0xDC, 0x99, 0x9F, 0xBB, 0xB9, 0x33, 0x3E
+};
+
+//0x150から: APUとLCDをONにし、矩形波(ch2)の周波数を変えながらトリガーし続ける
+static const uint8_t program[] = {
+	0x3E, 0x80, 0xE0, 0x26, //NR52 = 0x80
+	0x3E, 0x77, 0xE0, 0x24, //NR50 = 0x77
+	0x3E, 0xFF, 0xE0, 0x25, //NR51 = 0xff
+	0x3E, 0x91, 0xE0, 0x40, //LCDC = 0x91
+	0x3E, 0x80, 0xE0, 0x16, //NR21 = 0x80 (duty 50%)
+	0x3E, 0xF0, 0xE0, 0x17, //NR22 = 0xf0
+	0x06, 0x00,             //ld b,0
+	//loop:
+	0x78, 0xE0, 0x18,       //NR23 = b
+	0x3E, 0x87, 0xE0, 0x19, //NR24 = 0x87 (trigger)
+	0x04,                   //inc b
+	0x0E, 0x00,             //ld c,0
+	0x0D, 0x20, 0xFD,       //dec c; jr nz,-3
+	0x18, 0xF1,             //jr loop
+};
+
+static uint8_t rom[ROM_SIZE];
+static int16_t samples[2][MAX_SAMPLES * 2];
+
+static void make_rom() {
+	static const uint8_t entry[] = {0x00, 0xC3, 0x50, 0x01}; //nop; jp 0x150
+	memcpy(rom + 0x100, entry, sizeof(entry));
+	memcpy(rom + 0x104, logo, sizeof(logo));
+	memcpy(rom + 0x134, "RUNAHEAD", 8);
+	memcpy(rom + 0x150, program, sizeof(program));
+}
+
+//出力された音を溜める
+struct capture {
+	int16_t *out;
+	size_t count;
+};
+
+static void capture_output(const int16_t *frames, int count, void *userdata) {
+	struct capture *c = userdata;
+	if(c->count + count > MAX_SAMPLES)
+		count = MAX_SAMPLES - c->count;
+	memcpy(c->out + c->count*2, frames, count * 2 * sizeof(int16_t));
+	c->count += count;
+}
+
+//先読みaheadフレームで実行し、フレームごとのサンプル数をcountsに、波形をoutに入れて合計を返す
+//run-aheadは今のインスタンスを動かすので、libgbcoreのAPIではなくインスタンスを直接作る
+static size_t run(int ahead, size_t counts[FRAMES], int16_t *out) {
+	static uint32_t framebuf[160*144];
+	struct capture capture = {out, 0};
+	struct cartridge *cart = cart_init(rom);
+	struct gb *gb = gb_new();
+	if(cart == NULL || gb == NULL || memory_init(cart))
+		exit(1);
+	CGBMODE = 0;
+	if(sound_init(SAMPLE_RATE) < 0)
+		exit(1);
+	sound_set_output(capture_output, &capture);
+	startup();
+	machine_wait_lcd_on();
+
+	runahead_set_frames(ahead);
+	for(int i=0; i<FRAMES; i++){
+		size_t before = capture.count;
+		runahead_run_frame(framebuf, 0);
+		counts[i] = capture.count - before;
+	}
+	runahead_set_frames(0);
+	memory_free();
+	gb_free(gb);
+	free(cart);
+	return capture.count;
+}
+
+int main(int argc, char *argv[]) {
+	int ahead = argc > 1 ? atoi(argv[1]) : 2;
+	size_t counts[2][FRAMES];
+	make_rom();
+	lcd_init();
+
+	size_t total0 = run(0, counts[0], samples[0]);
+	size_t total1 = run(ahead, counts[1], samples[1]);
+	printf("runahead_audio: run-ahead 0: %zu samples, run-ahead %d: %zu samples\n", total0, ahead, total1);
+
+	int fail = total0 == 0;
+	for(int i=0; i<FRAMES; i++){
+		if(counts[0][i] != counts[1][i]){
+			printf("frame %d: %zu != %zu samples\n", i, counts[0][i], counts[1][i]);
+			fail = 1;
+			break;
+		}
+	}
+	if(!fail && memcmp(samples[0], samples[1], total0 * 2 * sizeof(int16_t)) != 0){
+		puts("waveform differs");
+		fail = 1;
+	}
+	puts(fail ? "FAIL" : "OK");
+	return fail;
+}
@@ -0,0 +1,35 @@
+#!/usr/bin/env python3
+# src/sound.cのblip_kernel(帯域制限ステップのカーネル)を作る
+# ホストの浮動小数点・libmで結果が変わらないよう、表にしてソースに入れておく
+# 使い方: python3 tools/blip_kernel.py の出力でsound.cの表を置き換える
+import math
+
+PHASES = 32    # BLIP_PHASES
+WIDTH = 16     # BLIP_WIDTH
+UNIT_BITS = 15 # BLIP_UNIT_BITS
+CUTOFF = 0.45  # サンプリング周波数比
+
+def lround(x):
+    return int(math.floor(x + 0.5)) if x >= 0 else -int(math.floor(-x + 0.5))
+
+def kernel():
+    pi = 3.14159265358979323846
+    rows = []
+    for p in range(PHASES):
+        taps = []
+        for i in range(WIDTH):
+            x = i - (WIDTH//2 - 1) - p / PHASES
+            sinc = 1.0 if x == 0 else math.sin(2*pi*CUTOFF*x) / (2*pi*CUTOFF*x)
+            w = 0.42 + 0.5*math.cos(2*pi*x/WIDTH) + 0.08*math.cos(4*pi*x/WIDTH)
+            taps.append(sinc * w)
+        total = sum(taps)
+        row = [lround(t / total * (1 << UNIT_BITS)) for t in taps]
+        peak = max(range(WIDTH), key=lambda i: (row[i], -i))
+        row[peak] += (1 << UNIT_BITS) - sum(row) # 丸め誤差で直流がずれないように
+        rows.append(row)
+    return rows
+
+print("static const int16_t blip_kernel[BLIP_PHASES][BLIP_WIDTH] = {")
+for row in kernel():
+    print("\t{" + ", ".join("%d" % v for v in row) + "},")
+print("};")